@@ -0,0 +1,267 @@
+/*
+ * lxi-control - Periodic acquisition
+ *
+ * This program is free software; you can redistribute  it and/or modify it
+ * under  the terms of  the GNU General  Public License as published by the
+ * Free Software Foundation;  either version 2 of the  License, or (at your
+ * option) any later version.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "acquire.h"
+
+#define ACQUIRE_RING	65536	// Records buffered for the writer, a power of 2
+#define ACQUIRE_IDLE	10	// ms the writer sleeps when the ring is empty
+
+/* Single producer, single consumer ring. head is only written by the
+ * network thread, tail only by the writer thread. */
+static acquire_record_t ring[ACQUIRE_RING];
+static atomic_size_t ringHead;
+static atomic_size_t ringTail;
+static atomic_bool writerStop;
+static atomic_int writerError;
+
+static volatile sig_atomic_t stopRequested;
+
+typedef struct {
+	acquire_stats_t *stats;
+	uint64_t sent;			/* Time the query in flight was sent */
+	bool busy;			/* Query in flight */
+	double latency;			/* Sum of round trips in us */
+} poll_t;
+
+static void stop_handler(int signum)
+{
+	(void) signum;
+	stopRequested = 1;
+}
+
+static bool ring_push(const acquire_record_t *record)
+{
+	size_t head = atomic_load_explicit(&ringHead, memory_order_relaxed);
+	size_t tail = atomic_load_explicit(&ringTail, memory_order_acquire);
+
+	if (head - tail == ACQUIRE_RING)
+		return false;
+	ring[head & (ACQUIRE_RING - 1)] = *record;
+	atomic_store_explicit(&ringHead, head + 1, memory_order_release);
+	return true;
+}
+
+/* Drain the ring into the log file until stopped and the ring is empty */
+static void *writer(void *arg)
+{
+	FILE *fp = arg;
+	struct timespec idle = { 0, ACQUIRE_IDLE * 1000000 };
+	size_t head, tail, index, n;
+	bool stop;
+
+	while (1)
+	{
+		stop = atomic_load_explicit(&writerStop, memory_order_acquire);
+		head = atomic_load_explicit(&ringHead, memory_order_acquire);
+		tail = atomic_load_explicit(&ringTail, memory_order_relaxed);
+		if (head == tail)
+		{
+			if (stop)
+				break;
+			/* Hand the records to the kernel while there is time */
+			if (fflush(fp) != 0)
+				goto error;
+			nanosleep(&idle, NULL);
+			continue;
+		}
+
+		/* Write the records up to the end of the ring in one go */
+		index = tail & (ACQUIRE_RING - 1);
+		n = head - tail;
+		if (index + n > ACQUIRE_RING)
+			n = ACQUIRE_RING - index;
+		if (fwrite(&ring[index], sizeof(acquire_record_t), n, fp) != n)
+			goto error;
+		atomic_store_explicit(&ringTail, tail + n, memory_order_release);
+	}
+	if (fflush(fp) != 0)
+		goto error;
+	return NULL;
+
+error:
+	atomic_store(&writerError, errno ? errno : EIO);
+	return NULL;
+}
+
+static void poll_done(lxi_session_t *session, int status, const char *response,
+		size_t length, void *ctx)
+{
+	poll_t *p = ctx;
+	acquire_stats_t *stats = p->stats;
+	acquire_record_t record;
+	char *end;
+	long latency;
+
+	(void) session;
+	(void) length;
+
+	p->busy = false;
+	if (status != LXI_OK)
+		return;
+
+	latency = (lxi_now_ns() - p->sent) / 1000;
+	if (latency > stats->max_latency)
+		stats->max_latency = latency;
+	p->latency += latency;
+
+	record.time = p->sent;
+	record.value = strtod(response, &end);
+	if (end == response)
+	{
+		record.value = NAN;
+		stats->invalid++;
+	}
+	if (!ring_push(&record))
+		stats->dropped++;
+	stats->samples++;
+}
+
+int acquire_run(lxi_session_t *session, const char *query, double rate,
+		long count, const char *log, acquire_stats_t *stats)
+{
+	struct sigaction action, oldInt, oldTerm;
+	sigset_t block, old;
+	pthread_t thread;
+	struct pollfd pfd;
+	struct timespec wait;
+	poll_t p = { .stats = stats };
+	uint64_t period, next, now, late;
+	long sent = 0;
+	int status, timeout, n, error;
+	FILE *fp;
+
+	memset(stats, 0, sizeof(*stats));
+	period = 1e9 / rate;
+	if (period == 0)
+		period = 1;
+
+	fp = fopen(log, "ab");
+	if (fp == NULL)
+		return LXI_ESYSTEM;
+
+	atomic_store(&ringHead, 0);
+	atomic_store(&ringTail, 0);
+	atomic_store(&writerStop, false);
+	atomic_store(&writerError, 0);
+
+	/* The writer inherits a blocked SIGINT/SIGTERM, so they interrupt the
+	 * network loop */
+	sigemptyset(&block);
+	sigaddset(&block, SIGINT);
+	sigaddset(&block, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &block, &old);
+	error = pthread_create(&thread, NULL, writer, fp);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (error)
+	{
+		fclose(fp);
+		errno = error;
+		return LXI_ESYSTEM;
+	}
+
+	stopRequested = 0;
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = stop_handler;
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGINT, &action, &oldInt);
+	sigaction(SIGTERM, &action, &oldTerm);
+
+	next = lxi_now_ns();
+	status = lxi_status(session);
+	while (status == LXI_OK && !stopRequested && !atomic_load(&writerError))
+	{
+		now = lxi_now_ns();
+		if (now >= next && (count == 0 || sent < count))
+		{
+			if (p.busy)
+				stats->missed++;
+			else
+			{
+				p.sent = now;
+				p.busy = true;
+				sent++;
+				lxi_query(session, query, poll_done, &p);
+			}
+
+			/* Deadlines which passed while we were late are missed, not
+			 * caught up with a burst of queries */
+			next += period;
+			if (now >= next)
+			{
+				late = (now - next) / period + 1;
+				stats->missed += late;
+				next += late * period;
+			}
+		}
+		else if (count && sent == count && !p.busy)
+			break;
+
+		/* Sleep until the next deadline or the session needs attention */
+		pfd.fd = lxi_fd(session);
+		pfd.events = lxi_events(session);
+		pfd.revents = 0;
+		now = lxi_now_ns();
+		wait.tv_sec = 0;
+		wait.tv_nsec = 0;
+		if (next > now && (count == 0 || sent < count))
+		{
+			wait.tv_sec = (next - now) / 1000000000;
+			wait.tv_nsec = (next - now) % 1000000000;
+		}
+		else if (p.busy)
+			wait.tv_sec = 3600;
+		timeout = lxi_timeout(session);
+		if (timeout >= 0 && (uint64_t) timeout * 1000000 <
+				(uint64_t) wait.tv_sec * 1000000000 + wait.tv_nsec)
+		{
+			wait.tv_sec = timeout / 1000;
+			wait.tv_nsec = (timeout % 1000) * 1000000;
+		}
+		n = ppoll(&pfd, 1, &wait, NULL);
+		if (n == -1 && errno != EINTR)
+		{
+			status = LXI_ESYSTEM;
+			break;
+		}
+		status = lxi_process(session, n > 0 ? pfd.revents : 0);
+	}
+	error = errno;
+
+	sigaction(SIGINT, &oldInt, NULL);
+	sigaction(SIGTERM, &oldTerm, NULL);
+
+	atomic_store_explicit(&writerStop, true, memory_order_release);
+	pthread_join(thread, NULL);
+	if (fclose(fp) != 0 && !atomic_load(&writerError))
+		atomic_store(&writerError, errno);
+
+	if (stats->samples)
+		stats->mean_latency = p.latency / stats->samples;
+
+	if (status == LXI_OK && atomic_load(&writerError))
+	{
+		errno = atomic_load(&writerError);
+		return LXI_ESYSTEM;
+	}
+	errno = error;
+	return status;
+}
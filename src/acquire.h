@@ -0,0 +1,51 @@
+/*
+ * lxi-control - Periodic acquisition
+ *
+ * A query is sent at a fixed rate over one session and the numeric
+ * responses are appended to a binary log file. The network I/O runs in
+ * the calling thread, a writer thread stores the records, and the two are
+ * decoupled by a lock-free ring buffer so a slow disk does not delay the
+ * queries.
+ *
+ * The log file holds one record per response, in host byte order:
+ *
+ *   uint64_t  CLOCK_MONOTONIC time in ns when the query was sent
+ *   double    response value, NaN if the response is not a number
+ *
+ * This program is free software; you can redistribute  it and/or modify it
+ * under  the terms of  the GNU General  Public License as published by the
+ * Free Software Foundation;  either version 2 of the  License, or (at your
+ * option) any later version.
+ */
+
+#ifndef ACQUIRE_H
+#define ACQUIRE_H
+
+#include <stdint.h>
+
+#include "lxi.h"
+
+typedef struct {
+	uint64_t time;		/* ns when the query was sent */
+	double value;		/* Response value */
+} acquire_record_t;
+
+typedef struct {
+	long samples;		/* Responses received */
+	long missed;		/* Deadlines missed, no query sent */
+	long dropped;		/* Records lost because the writer fell behind */
+	long invalid;		/* Responses which are not a number */
+	long max_latency;	/* Longest query round trip in us */
+	double mean_latency;	/* Average query round trip in us */
+} acquire_stats_t;
+
+/* Send query rate times per second until count responses are received
+ * (0 for no limit) or SIGINT/SIGTERM arrives, appending the records to
+ * the file log. A query is only sent once the previous one is answered,
+ * otherwise the deadline counts as missed. Returns an lxi status; on
+ * error the message is in lxi_error() or, for LXI_ESYSTEM without a
+ * failed session, errno. */
+int acquire_run(lxi_session_t *session, const char *query, double rate,
+		long count, const char *log, acquire_stats_t *stats);
+
+#endif
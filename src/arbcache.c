@@ -0,0 +1,145 @@
+/*
+ * lxi-control - Cache of the arbitrary waveforms held by instruments
+ *
+ * The cache file has one waveform slot per line with tab separated
+ * fields:
+ *
+ *   <ip> <port> <slot> <hash> <points> <name>
+ *
+ * This program is free software; you can redistribute  it and/or modify it
+ * under  the terms of  the GNU General  Public License as published by the
+ * Free Software Foundation;  either version 2 of the  License, or (at your
+ * option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "inventory.h"
+#include "arbcache.h"
+
+#define ARBCACHE_FILE	"arbcache"
+
+#define FNV_PRIME	0x100000001b3ULL
+
+uint64_t arbcache_hash(uint64_t hash, const void *data, size_t length)
+{
+	const unsigned char *p = data;
+	size_t i;
+
+	for (i = 0; i < length; i++)
+	{
+		hash ^= p[i];
+		hash *= FNV_PRIME;
+	}
+	return hash;
+}
+
+/* Split a cache line into its fields, returns -1 if it is not valid */
+static int parse_line(char *line, char **ip, unsigned int *port, int *slot,
+		arbcache_slot_t *content)
+{
+	char *field[6], *p = line;
+	int i;
+
+	line[strcspn(line, "\n")] = 0;
+	if (line[0] == '#' || line[0] == 0)
+		return -1;
+	for (i = 0; i < 6 && p != NULL; i++)
+		field[i] = strsep(&p, "\t");
+	if (i < 6)
+		return -1;
+
+	*ip = field[0];
+	*port = strtoul(field[1], NULL, 10);
+	*slot = atoi(field[2]);
+	content->hash = strtoull(field[3], NULL, 16);
+	content->points = strtol(field[4], NULL, 10);
+	snprintf(content->name, sizeof(content->name), "%s", field[5]);
+	return 0;
+}
+
+int arbcache_get(const char *ip, unsigned int port, int slot,
+		arbcache_slot_t *content)
+{
+	char *path, *line = NULL, *entry_ip;
+	size_t size = 0;
+	unsigned int entry_port;
+	int entry_slot, ret = -1;
+	arbcache_slot_t entry;
+	FILE *fp;
+
+	path = cache_path(ARBCACHE_FILE);
+	if (path == NULL)
+		return -1;
+	fp = fopen(path, "r");
+	free(path);
+	if (fp == NULL)
+		return -1;
+
+	while (ret == -1 && getline(&line, &size, fp) != -1)
+	{
+		if (parse_line(line, &entry_ip, &entry_port, &entry_slot, &entry) == 0 &&
+				entry_port == port && entry_slot == slot &&
+				strcmp(entry_ip, ip) == 0)
+		{
+			*content = entry;
+			ret = 0;
+		}
+	}
+
+	free(line);
+	fclose(fp);
+	return ret;
+}
+
+typedef struct {
+	const char *ip;
+	unsigned int port;
+	int slot;
+	const arbcache_slot_t *content;
+} arbcache_put_t;
+
+/* Copy the other slots of the cache file in and add the new content */
+static int arbcache_write(FILE *in, FILE *out, void *ctx)
+{
+	arbcache_put_t *put = ctx;
+	char *line = NULL, *copy = NULL, *entry_ip;
+	size_t size = 0;
+	unsigned int entry_port;
+	int entry_slot;
+	arbcache_slot_t entry;
+
+	fprintf(out, "# lxi-control waveforms: ip port slot hash points name\n");
+	while (in != NULL && getline(&line, &size, in) != -1)
+	{
+		free(copy);
+		copy = strdup(line);
+		if (copy == NULL ||
+				parse_line(line, &entry_ip, &entry_port, &entry_slot, &entry) != 0 ||
+				(entry_port == put->port && entry_slot == put->slot &&
+				 strcmp(entry_ip, put->ip) == 0))
+			continue;
+		fputs(copy, out);
+	}
+	free(copy);
+	free(line);
+
+	if (put->content != NULL)
+		fprintf(out, "%s\t%u\t%d\t%016llx\t%ld\t%s\n", put->ip, put->port,
+				put->slot, (unsigned long long) put->content->hash,
+				put->content->points, put->content->name);
+	return ferror(out) ? -1 : 0;
+}
+
+int arbcache_put(const char *ip, unsigned int port, int slot,
+		const arbcache_slot_t *content)
+{
+	arbcache_put_t put = { ip, port, slot, content };
+
+	return cache_rewrite(ARBCACHE_FILE, arbcache_write, &put);
+}
@@ -0,0 +1,43 @@
+/*
+ * lxi-control - Cache of the arbitrary waveforms held by instruments
+ *
+ * The content of each ARB1 to ARB4 slot is remembered by a hash of its
+ * data, as uploaded or read back, along with the name and length the
+ * instrument reports with ARBxDEF?. An upload of the same data can then be
+ * skipped after checking that cheap signature.
+ *
+ * This program is free software; you can redistribute  it and/or modify it
+ * under  the terms of  the GNU General  Public License as published by the
+ * Free Software Foundation;  either version 2 of the  License, or (at your
+ * option) any later version.
+ */
+
+#ifndef ARBCACHE_H
+#define ARBCACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define ARBCACHE_HASH_INIT	0xcbf29ce484222325ULL	// FNV-1a offset basis
+
+typedef struct {
+	uint64_t hash;		/* Of the samples in network order */
+	long points;
+	char name[40];		/* From ARBxDEF? */
+} arbcache_slot_t;
+
+/* Continue the hash of waveform data with length more bytes, starting
+ * from ARBCACHE_HASH_INIT */
+uint64_t arbcache_hash(uint64_t hash, const void *data, size_t length);
+
+/* Content of ARB<slot> of ip:port when it was last uploaded or read back.
+ * Returns -1 if it is not known. */
+int arbcache_get(const char *ip, unsigned int port, int slot,
+		arbcache_slot_t *content);
+
+/* Remember the content of a slot, or forget it if content is NULL. Returns
+ * -1 on error. */
+int arbcache_put(const char *ip, unsigned int port, int slot,
+		const arbcache_slot_t *content);
+
+#endif
@@ -0,0 +1,707 @@
+/*
+ * lxi-control - Connection broker
+ *
+ * One epoll loop serves the listening socket, the clients and the
+ * instrument connections. A client first sends its CONNECT line and waits
+ * in the line of the instrument. When it is its turn, data is relayed
+ * between the client and the instrument through one buffer per direction,
+ * reading from a side only when its previous data has been written out.
+ *
+ * An instrument is handed to the next client at once, unless the last
+ * client left with a query unanswered. The response then still arrives
+ * later, so the instrument is only handed on after BROKER_SETTLE ms
+ * without data, and that data is dropped.
+ *
+ * This program is free software; you can redistribute  it and/or modify it
+ * under  the terms of  the GNU General  Public License as published by the
+ * Free Software Foundation;  either version 2 of the  License, or (at your
+ * option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "lxi.h"
+#include "broker.h"
+
+#define BROKER_BUF	65536	// Relay buffer per connection
+#define BROKER_HELLO	128	// Longest CONNECT line
+#define BROKER_EVENTS	64
+#define BROKER_DROP	4096	// Chunk of unwanted instrument data
+
+#define CLIENT_HELLO		0	/* Reading the CONNECT line */
+#define CLIENT_WAITING		1	/* In line for the instrument */
+#define CLIENT_RELAY		2	/* Using the instrument */
+#define CLIENT_CLOSING		3	/* Gone, passing on its last data */
+
+#define INSTR_CLOSED		0
+#define INSTR_CONNECTING	1
+#define INSTR_READY		2	/* Connected and free */
+#define INSTR_BUSY		3	/* Used by a client */
+#define INSTR_SETTLING		4	/* Dropping a late response */
+
+typedef struct conn conn_t;
+
+struct conn {
+	bool client;		/* Client or instrument side */
+	int fd;			/* Socket, -1 when closed */
+	int state;		/* CLIENT_* or INSTR_* */
+	uint32_t events;	/* Events registered with epoll */
+	char *buf;		/* Data read from fd, not yet written to peer */
+	size_t len, off;	/* Bytes in buf and bytes of them written */
+	conn_t *peer;		/* Other side while a client uses an instrument */
+	conn_t *next;		/* Next client in line or next instrument */
+	/* Instrument only */
+	char ip[64];
+	unsigned int port;
+	conn_t *head, *tail;	/* Clients waiting for the instrument */
+	bool query;		/* A query is waiting for its response */
+	struct timespec deadline; /* End of connecting or settling */
+};
+
+static int epfd;
+static conn_t *instruments;
+static int connect_timeout;
+static bool verbose;
+static bool closed;	/* A connection was closed, events may be stale */
+
+char *broker_path(void)
+{
+	const char *dir = getenv("XDG_RUNTIME_DIR");
+	char *path;
+
+	if (dir != NULL && *dir != 0)
+	{
+		path = malloc(strlen(dir) + 1 + strlen(BROKER_SOCKET) + 1);
+		if (path != NULL)
+			sprintf(path, "%s/%s", dir, BROKER_SOCKET);
+	}
+	else
+	{
+		path = malloc(64);
+		if (path != NULL)
+			sprintf(path, "/tmp/lxi-control-%u.sock", (unsigned) getuid());
+	}
+	return path;
+}
+
+static int unix_address(struct sockaddr_un *addr, const char *path)
+{
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr->sun_path))
+	{
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	strcpy(addr->sun_path, path);
+	return 0;
+}
+
+static conn_t *instrument_find(const char *ip, unsigned int port)
+{
+	conn_t *inst;
+
+	for (inst = instruments; inst != NULL; inst = inst->next)
+		if (inst->port == port && strcmp(inst->ip, ip) == 0)
+			return inst;
+
+	inst = calloc(1, sizeof(conn_t));
+	if (inst == NULL)
+		return NULL;
+	inst->buf = malloc(BROKER_BUF);
+	if (inst->buf == NULL)
+	{
+		free(inst);
+		return NULL;
+	}
+	inst->fd = -1;
+	inst->state = INSTR_CLOSED;
+	strncpy(inst->ip, ip, sizeof(inst->ip) - 1);
+	inst->port = port;
+	inst->next = instruments;
+	instruments = inst;
+	return inst;
+}
+
+int broker_instrument(const char *ip, unsigned int port)
+{
+	return instrument_find(ip, port) == NULL ? -1 : 0;
+}
+
+/* Register the events conn is interested in, given its state */
+static void watch(conn_t *c)
+{
+	struct epoll_event ev = { 0 };
+	bool relay;
+
+	/* A closing client was taken out of the epoll set */
+	if (c->client && c->state == CLIENT_CLOSING)
+		return;
+
+	if (c->client)
+	{
+		relay = (c->state == CLIENT_RELAY);
+		if (c->state == CLIENT_HELLO)
+			ev.events = EPOLLIN;
+		else if (c->state == CLIENT_WAITING)
+			ev.events = EPOLLRDHUP;
+	}
+	else
+	{
+		relay = (c->state == INSTR_BUSY);
+		if (c->state == INSTR_CONNECTING)
+			ev.events = EPOLLOUT;
+		else if (c->state == INSTR_READY || c->state == INSTR_SETTLING)
+			ev.events = EPOLLIN;
+	}
+	if (relay && c->len == 0)
+		ev.events |= EPOLLIN;
+	if (c->peer != NULL && c->peer->len > 0)
+		ev.events |= EPOLLOUT;
+
+	if (c->fd == -1 || ev.events == c->events)
+		return;
+	ev.data.ptr = c;
+	epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+	c->events = ev.events;
+}
+
+static int watch_add(conn_t *c)
+{
+	struct epoll_event ev = { 0 };
+
+	ev.events = 0;
+	ev.data.ptr = c;
+	c->events = 0;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev) == -1)
+		return -1;
+	watch(c);
+	return 0;
+}
+
+static void client_free(conn_t *client)
+{
+	closed = true;
+	close(client->fd);
+	free(client->buf);
+	free(client);
+}
+
+static void client_fail(conn_t *client, int status, const char *message)
+{
+	dprintf(client->fd, "ERR %d %s\n", status, message);
+	client_free(client);
+}
+
+static void instrument_close(conn_t *inst)
+{
+	closed = true;
+	if (inst->fd != -1)
+		close(inst->fd);
+	inst->fd = -1;
+	inst->state = INSTR_CLOSED;
+	inst->len = inst->off = 0;
+}
+
+/* The instrument can not be reached, turn away everybody waiting */
+static void instrument_fail(conn_t *inst, const char *message)
+{
+	conn_t *client;
+
+	if (verbose)
+		printf("%s:%u: %s\n", inst->ip, inst->port, message);
+	instrument_close(inst);
+	while ((client = inst->head) != NULL)
+	{
+		inst->head = client->next;
+		client_fail(client, 2, message);
+	}
+	inst->tail = NULL;
+}
+
+static void instrument_connect(conn_t *inst)
+{
+	struct addrinfo hints = { 0 }, *addr;
+	char port[8];
+	int one = 1, error;
+
+	/* IPv4 or IPv6 */
+	hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV;
+	hints.ai_socktype = SOCK_STREAM;
+	snprintf(port, sizeof(port), "%u", inst->port);
+	if (getaddrinfo(inst->ip, port, &hints, &addr) != 0)
+	{
+		instrument_fail(inst, "Invalid IP address");
+		return;
+	}
+
+	inst->fd = socket(addr->ai_family,
+			SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (inst->fd == -1)
+	{
+		freeaddrinfo(addr);
+		instrument_fail(inst, strerror(errno));
+		return;
+	}
+	setsockopt(inst->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	setsockopt(inst->fd, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof(one));
+
+	error = connect(inst->fd, addr->ai_addr, addr->ai_addrlen) == -1 ?
+			errno : EINPROGRESS;
+	freeaddrinfo(addr);
+	if (error != EINPROGRESS)
+	{
+		instrument_fail(inst, strerror(error));
+		return;
+	}
+	inst->state = INSTR_CONNECTING;
+	lxi_set_deadline(&inst->deadline, connect_timeout * 1000L);
+	if (watch_add(inst) == -1)
+		instrument_fail(inst, strerror(errno));
+}
+
+/* Hand the instrument to the next client in line */
+static void instrument_next(conn_t *inst)
+{
+	conn_t *client;
+
+	if (inst->state == INSTR_CLOSED && inst->head != NULL)
+		instrument_connect(inst);
+	if (inst->state != INSTR_READY || inst->head == NULL)
+		return;
+
+	client = inst->head;
+	inst->head = client->next;
+	if (inst->head == NULL)
+		inst->tail = NULL;
+
+	if (send(client->fd, "OK\n", 3, MSG_NOSIGNAL) != 3)
+	{
+		client_free(client);
+		instrument_next(inst);
+		return;
+	}
+	client->state = CLIENT_RELAY;
+	client->peer = inst;
+	inst->state = INSTR_BUSY;
+	inst->peer = client;
+	inst->query = (client->len > 0 &&
+			memchr(client->buf, '?', client->len) != NULL);
+	inst->len = inst->off = 0;
+	watch(client);
+	watch(inst);
+}
+
+/* The client is done with the instrument */
+static void instrument_release(conn_t *inst)
+{
+	client_free(inst->peer);
+	inst->peer = NULL;
+	inst->len = inst->off = 0;
+	if (inst->query)
+	{
+		inst->state = INSTR_SETTLING;
+		lxi_set_deadline(&inst->deadline, BROKER_SETTLE);
+	}
+	else
+		inst->state = INSTR_READY;
+	watch(inst);
+	instrument_next(inst);
+}
+
+/* The instrument connection broke while a client was using it */
+static void instrument_lost(conn_t *inst)
+{
+	if (verbose)
+		printf("%s:%u: connection lost\n", inst->ip, inst->port);
+	if (inst->peer != NULL)
+		client_free(inst->peer);
+	inst->peer = NULL;
+	instrument_close(inst);
+	instrument_next(inst);
+}
+
+/* Read the CONNECT line and get in line for the instrument */
+static void client_hello(conn_t *client)
+{
+	char ip[64];
+	unsigned int port;
+	ssize_t length;
+	char *lf;
+	conn_t *inst;
+
+	length = recv(client->fd, client->buf + client->len,
+			BROKER_HELLO - 1 - client->len, 0);
+	if (length == -1 && errno == EAGAIN)
+		return;
+	if (length <= 0)
+	{
+		client_free(client);
+		return;
+	}
+	client->len += length;
+	client->buf[client->len] = 0;
+	lf = memchr(client->buf, '\n', client->len);
+	if (lf == NULL)
+	{
+		if (client->len == BROKER_HELLO - 1)
+			client_fail(client, 1, "Request too long");
+		return;
+	}
+
+	*lf = 0;
+	if (sscanf(client->buf, "CONNECT %63s %u", ip, &port) != 2)
+	{
+		client_fail(client, 1, "Bad request");
+		return;
+	}
+	inst = instrument_find(ip, port);
+	if (inst == NULL)
+	{
+		client_fail(client, 3, "Out of memory");
+		return;
+	}
+	if (verbose)
+		printf("Client for %s:%u\n", ip, port);
+
+	/* Data sent along with the request goes to the instrument */
+	client->len -= lf + 1 - client->buf;
+	memmove(client->buf, lf + 1, client->len);
+
+	client->state = CLIENT_WAITING;
+	client->next = NULL;
+	if (inst->tail != NULL)
+		inst->tail->next = client;
+	else
+		inst->head = client;
+	inst->tail = client;
+	watch(client);
+	instrument_next(inst);
+}
+
+/* A waiting client gave up */
+static void client_leave(conn_t *client)
+{
+	conn_t *inst, **p;
+
+	for (inst = instruments; inst != NULL; inst = inst->next)
+		for (p = &inst->head; *p != NULL; p = &(*p)->next)
+			if (*p == client)
+			{
+				*p = client->next;
+				if (inst->tail == client)
+				{
+					for (inst->tail = inst->head;
+							inst->tail != NULL && inst->tail->next != NULL;
+							inst->tail = inst->tail->next)
+						;
+				}
+				client_free(client);
+				return;
+			}
+}
+
+/* Write the data buffered by the peer of c to c */
+static void relay_out(conn_t *c)
+{
+	conn_t *src = c->peer;
+	ssize_t length;
+
+	length = send(c->fd, src->buf + src->off, src->len - src->off,
+			MSG_NOSIGNAL);
+	if (length == -1)
+	{
+		if (errno == EAGAIN)
+			return;
+		if (c->client)
+			instrument_release(src);
+		else
+			instrument_lost(c);
+		return;
+	}
+	src->off += length;
+	if (src->off < src->len)
+		return;
+	src->len = src->off = 0;
+
+	/* The last data of a client which has gone */
+	if (src->client && src->state == CLIENT_CLOSING)
+	{
+		instrument_release(c);
+		return;
+	}
+	watch(c);
+	watch(src);
+}
+
+/* Read from c and pass the data on to its peer */
+static void relay_in(conn_t *c)
+{
+	conn_t *inst = c->client ? c->peer : c;
+	ssize_t length;
+
+	length = recv(c->fd, c->buf, BROKER_BUF, 0);
+	if (length == -1 && errno == EAGAIN)
+		return;
+	if (length <= 0)
+	{
+		if (c->client)
+			instrument_release(inst);
+		else
+			instrument_lost(c);
+		return;
+	}
+	c->len = length;
+	c->off = 0;
+
+	/* Remember whether a response is still due */
+	if (c->client && memchr(c->buf, '?', length) != NULL)
+		inst->query = true;
+	else if (!c->client && c->buf[length-1] == '\n')
+		inst->query = false;
+
+	relay_out(c->peer);
+}
+
+/* The client closed its end with data still buffered for the instrument */
+static void client_closing(conn_t *client)
+{
+	client->state = CLIENT_CLOSING;
+	epoll_ctl(epfd, EPOLL_CTL_DEL, client->fd, NULL);
+	watch(client->peer);
+}
+
+static void client_event(conn_t *client, uint32_t events)
+{
+	switch (client->state)
+	{
+		case CLIENT_HELLO:
+			client_hello(client);
+			break;
+
+		case CLIENT_WAITING:
+			client_leave(client);
+			break;
+
+		case CLIENT_RELAY:
+			/* Not reading while data is buffered, so only a hangup
+			 * is reported then */
+			if (events & EPOLLOUT)
+				relay_out(client);
+			else if (client->len > 0)
+				client_closing(client);
+			else
+				relay_in(client);
+			break;
+	}
+}
+
+static void instrument_event(conn_t *inst, uint32_t events)
+{
+	int error = 0;
+	socklen_t len = sizeof(error);
+	char drop[BROKER_DROP];
+	ssize_t length;
+
+	switch (inst->state)
+	{
+		case INSTR_CONNECTING:
+			getsockopt(inst->fd, SOL_SOCKET, SO_ERROR, &error, &len);
+			if (error != 0)
+			{
+				instrument_fail(inst, strerror(error));
+				return;
+			}
+			if (verbose)
+				printf("%s:%u: connected\n", inst->ip, inst->port);
+			inst->state = INSTR_READY;
+			watch(inst);
+			instrument_next(inst);
+			break;
+
+		case INSTR_READY:
+		case INSTR_SETTLING:
+			/* Nobody asked for this data */
+			length = recv(inst->fd, drop, sizeof(drop), 0);
+			if (length == -1 && errno == EAGAIN)
+				return;
+			if (length <= 0)
+			{
+				instrument_close(inst);
+				instrument_next(inst);
+				return;
+			}
+			if (verbose)
+				printf("%s:%u: dropped %ld bytes\n", inst->ip, inst->port,
+						(long) length);
+			if (inst->state == INSTR_SETTLING)
+				lxi_set_deadline(&inst->deadline, BROKER_SETTLE);
+			break;
+
+		case INSTR_BUSY:
+			if (events & EPOLLOUT)
+				relay_out(inst);
+			else if (inst->peer->state == CLIENT_CLOSING)
+			{
+				/* Nobody left to read the response */
+				inst->query = true;
+				length = recv(inst->fd, drop, sizeof(drop), 0);
+				if (length == 0 || (length == -1 && errno != EAGAIN))
+					instrument_lost(inst);
+			}
+			else
+				relay_in(inst);
+			break;
+	}
+}
+
+static void accept_clients(int listener)
+{
+	conn_t *client;
+	int fd;
+
+	while ((fd = accept4(listener, NULL, NULL,
+					SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1)
+	{
+		client = calloc(1, sizeof(conn_t));
+		if (client != NULL)
+			client->buf = malloc(BROKER_BUF);
+		if (client == NULL || client->buf == NULL)
+		{
+			free(client);
+			close(fd);
+			continue;
+		}
+		client->client = true;
+		client->fd = fd;
+		client->state = CLIENT_HELLO;
+		if (watch_add(client) == -1)
+			client_free(client);
+	}
+}
+
+/* Handle passed deadlines, returns ms until the next one or -1 */
+static int run_timers(void)
+{
+	conn_t *inst;
+	long remaining;
+	int wait = -1;
+
+	for (inst = instruments; inst != NULL; inst = inst->next)
+	{
+		if (inst->state != INSTR_CONNECTING && inst->state != INSTR_SETTLING)
+			continue;
+		remaining = lxi_until_ms(&inst->deadline);
+		if (remaining <= 0)
+		{
+			if (inst->state == INSTR_CONNECTING)
+				instrument_fail(inst, "Timeout");
+			else
+			{
+				inst->state = INSTR_READY;
+				watch(inst);
+				instrument_next(inst);
+			}
+			/* May have started a connect with a new deadline */
+			if (inst->state != INSTR_CONNECTING)
+				continue;
+			remaining = lxi_until_ms(&inst->deadline);
+		}
+		if (wait == -1 || remaining < wait)
+			wait = remaining;
+	}
+	return wait;
+}
+
+int broker_run(const char *path, int timeout, bool debug)
+{
+	struct sockaddr_un addr;
+	struct epoll_event ev = { 0 }, events[BROKER_EVENTS];
+	conn_t *inst;
+	int listener, probe;
+	int i, n;
+
+	connect_timeout = timeout;
+	verbose = debug;
+	signal(SIGPIPE, SIG_IGN);
+
+	if (unix_address(&addr, path) == -1)
+		return -1;
+
+	/* Replace a socket left behind, but not a running broker */
+	probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (probe == -1)
+		return -1;
+	if (connect(probe, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+	{
+		close(probe);
+		errno = EADDRINUSE;
+		return -1;
+	}
+	close(probe);
+	unlink(path);
+
+	listener = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (listener == -1)
+		return -1;
+	umask(077);
+	if (bind(listener, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+			listen(listener, 64) == -1)
+	{
+		close(listener);
+		return -1;
+	}
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd == -1)
+		return -1;
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, listener, &ev) == -1)
+		return -1;
+
+	/* Warm up the instruments given on the command line */
+	for (inst = instruments; inst != NULL; inst = inst->next)
+		instrument_connect(inst);
+
+	while (1)
+	{
+		n = epoll_wait(epfd, events, BROKER_EVENTS, run_timers());
+		if (n == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		/* After a close the remaining events may belong to freed or
+		 * reused connections, they are reported again if still valid */
+		closed = false;
+		for (i = 0; i < n && !closed; i++)
+		{
+			conn_t *c = events[i].data.ptr;
+
+			if (c == NULL)
+				accept_clients(listener);
+			else if (c->client)
+				client_event(c, events[i].events);
+			else
+				instrument_event(c, events[i].events);
+		}
+	}
+}
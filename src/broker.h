@@ -0,0 +1,43 @@
+/*
+ * lxi-control - Connection broker
+ *
+ * The broker keeps connections to instruments open and hands them to
+ * lxi-control clients connecting over a local Unix domain socket. Only one
+ * client uses an instrument at a time, others wait in line.
+ *
+ * A client opens the broker socket and sends
+ *
+ *   CONNECT <ip> <port>\n
+ *
+ * The broker answers "OK\n" when the instrument is free and connected, or
+ * "ERR <status> <message>\n" with an exit status as in the man page. After
+ * OK the connection carries the instrument data unchanged in both
+ * directions until the client closes it. lxi_open() speaks this protocol
+ * when given the broker socket.
+ *
+ * This program is free software; you can redistribute  it and/or modify it
+ * under  the terms of  the GNU General  Public License as published by the
+ * Free Software Foundation;  either version 2 of the  License, or (at your
+ * option) any later version.
+ */
+
+#ifndef BROKER_H
+#define BROKER_H
+
+#include <stdbool.h>
+
+#define BROKER_SOCKET	"lxi-control.sock"
+#define BROKER_SETTLE	100	// ms of silence before a queried instrument is handed on
+
+/* Default broker socket, $XDG_RUNTIME_DIR/lxi-control.sock or
+ * /tmp/lxi-control-<uid>.sock. The returned string must be freed. */
+char *broker_path(void);
+
+/* Connect to ip:port when the broker starts and keep the connection open */
+int broker_instrument(const char *ip, unsigned int port);
+
+/* Serve clients on the socket at path, only returns on error. Connections
+ * are made within timeout seconds. */
+int broker_run(const char *path, int timeout, bool debug);
+
+#endif
@@ -0,0 +1,543 @@
+/*
+ * lxi-control - HiSLIP transport
+ *
+ * HiSLIP (IVI-6.1) frames SCPI in messages with a 16 byte header on two
+ * TCP connections to the instrument: the synchronous channel carries the
+ * commands and responses, the asynchronous channel is used at set up for
+ * the maximum message size. A response ends with a DataEnd message, so no
+ * terminator has to be searched for and no quiet period waited out.
+ *
+ * In overlapped mode, if the instrument offers it, requests are sent
+ * without waiting for the responses before, like on a raw socket; the
+ * message ID of each response is checked against the oldest query waiting.
+ * In synchronized mode one query is outstanding at a time. Commands are
+ * written straight from the request, split into messages no larger than
+ * the instrument takes. Response data is received directly into the
+ * session receive buffer and parsed there.
+ *
+ * This program is free software; you can redistribute  it and/or modify it
+ * under  the terms of  the GNU General  Public License as published by the
+ * Free Software Foundation;  either version 2 of the  License, or (at your
+ * option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "lxi.h"
+#include "lxi-private.h"
+
+#define HISLIP_PORT		4880
+#define HISLIP_VERSION		0x0100	// Protocol 1.0
+#define HISLIP_VENDOR		"LC"	// Vendor ID of the client
+#define HISLIP_DEVICE		"hislip0"
+#define HISLIP_FIRST_ID		0xffffff00
+#define HISLIP_MAX_MESSAGE	(1ULL << 30)	// Announced, responses are streamed
+
+/* Message types */
+#define HISLIP_INITIALIZE		0
+#define HISLIP_INITIALIZE_RESPONSE	1
+#define HISLIP_FATAL_ERROR		2
+#define HISLIP_ERROR			3
+#define HISLIP_DATA			6
+#define HISLIP_DATA_END			7
+#define HISLIP_ASYNC_MAX_SIZE		15
+#define HISLIP_ASYNC_MAX_SIZE_RESPONSE	16
+#define HISLIP_ASYNC_INITIALIZE		17
+#define HISLIP_ASYNC_INITIALIZE_RESPONSE	18
+
+#define HISLIP_OVERLAPPED	0x01	/* InitializeResponse control code */
+#define HISLIP_DELIVERED	0x01	/* RMT-delivered, Data control code */
+
+/* Set up */
+#define PHASE_SYNC	0	/* Initialize on the synchronous channel */
+#define PHASE_ASYNC	1	/* AsyncInitialize on the asynchronous channel */
+#define PHASE_MAX_SIZE	2	/* AsyncMaximumMessageSize */
+#define PHASE_READY	3
+
+typedef struct hislip hislip_t;
+
+struct hislip {
+	int phase;		/* PHASE_* */
+	int other;		/* Synchronous channel while the asynchronous
+				 * one is set up, then the asynchronous one */
+	bool overlapped;
+	uint16_t session_id;
+	uint64_t max_message;	/* Largest payload the instrument takes */
+	uint32_t message_id;	/* Of the next Data or DataEnd */
+	bool delivered;		/* A whole response arrived since the last send */
+
+	/* Message being sent, the request data of Data and DataEnd follows
+	 * the header */
+	bool sending;
+	int type;
+	unsigned char header[32];
+	size_t header_length, data;
+	size_t length, sent;
+	size_t written;		/* Data of the send queue head sent before */
+
+	/* Message being received */
+	unsigned char in[16];
+	size_t have;
+	uint64_t left;		/* Payload still to come */
+	bool response;		/* Receiving a response */
+	char text[128];		/* Payload of control messages, truncated */
+	size_t text_length;
+};
+
+static size_t request_length(const lxi_request_t *request)
+{
+	size_t length = 0;
+	int i;
+
+	for (i = request->iov_first; i < request->iovcnt; i++)
+		length += request->iov[i].iov_len;
+	return length;
+}
+
+static void put32(unsigned char *p, uint32_t value)
+{
+	p[0] = value >> 24;
+	p[1] = value >> 16;
+	p[2] = value >> 8;
+	p[3] = value;
+}
+
+static uint32_t get32(const unsigned char *p)
+{
+	return (uint32_t) p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static void put64(unsigned char *p, uint64_t value)
+{
+	put32(p, value >> 32);
+	put32(p + 4, value);
+}
+
+static uint64_t get64(const unsigned char *p)
+{
+	return (uint64_t) get32(p) << 32 | get32(p + 4);
+}
+
+/* Start a message with a short payload, and data bytes of the send queue
+ * head after it. It is sent by send_message(). */
+static void message(lxi_session_t *session, int type, int control,
+		uint32_t parameter, const void *payload, size_t length, size_t data)
+{
+	hislip_t *hs = session->protocol;
+
+	hs->header[0] = 'H';
+	hs->header[1] = 'S';
+	hs->header[2] = type;
+	hs->header[3] = control;
+	put32(&hs->header[4], parameter);
+	put64(&hs->header[8], length + data);
+	if (length > 0)
+		memcpy(&hs->header[16], payload, length);
+	hs->header_length = 16 + length;
+	hs->data = data;
+	hs->length = hs->header_length + data;
+	hs->sent = 0;
+	hs->type = type;
+	hs->sending = true;
+}
+
+/* Start the next Data or DataEnd message of the send queue head */
+static void next_message(lxi_session_t *session)
+{
+	hislip_t *hs = session->protocol;
+	lxi_request_t *request = session->send_head;
+	size_t total, data;
+	int type;
+
+	/* Synchronized mode waits for the response before */
+	if (request == NULL || (!hs->overlapped && session->reply_head != NULL))
+		return;
+
+	total = request_length(request);
+	data = total - hs->written;
+	if (data > hs->max_message)
+		data = hs->max_message;
+	type = hs->written + data == total ? HISLIP_DATA_END : HISLIP_DATA;
+	if (type == HISLIP_DATA_END)
+		request->id = hs->message_id;
+	message(session, type, hs->delivered ? HISLIP_DELIVERED : 0,
+			hs->message_id, NULL, 0, data);
+	hs->message_id += 2;
+	hs->delivered = false;
+}
+
+/* Send the rest of the current message */
+static int send_message(lxi_session_t *session)
+{
+	hislip_t *hs = session->protocol;
+	lxi_request_t *request = session->send_head;
+	struct iovec iov[4], *v;
+	size_t offset, left, n;
+	ssize_t length;
+	int count, i;
+
+	while (hs->sent < hs->length)
+	{
+		/* Header and the request data carried by this message */
+		count = 0;
+		iov[count].iov_base = hs->header;
+		iov[count++].iov_len = hs->header_length;
+		offset = hs->written;
+		left = hs->data;
+		for (i = 0; left > 0 && i < request->iovcnt; i++)
+		{
+			if (offset >= request->iov[i].iov_len)
+			{
+				offset -= request->iov[i].iov_len;
+				continue;
+			}
+			n = request->iov[i].iov_len - offset;
+			if (n > left)
+				n = left;
+			iov[count].iov_base = (char *) request->iov[i].iov_base + offset;
+			iov[count++].iov_len = n;
+			left -= n;
+			offset = 0;
+		}
+
+		/* Skip what was sent */
+		v = iov;
+		offset = hs->sent;
+		while (offset >= v->iov_len)
+		{
+			offset -= v->iov_len;
+			v++;
+			count--;
+		}
+		v->iov_base = (char *) v->iov_base + offset;
+		v->iov_len -= offset;
+
+		length = writev(session->fd, v, count);
+		if (length == -1)
+		{
+			if (errno == EAGAIN || errno == EINTR)
+				return LXI_OK;
+			return lxi_fail(session, LXI_ECONNECT,
+					"Error sending SCPI command: %s", strerror(errno));
+		}
+		hs->sent += length;
+		if (session->state == STATE_READY)
+			lxi_sent(session, length);
+	}
+	hs->sending = false;
+	return LXI_OK;
+}
+
+static int hislip_flush(lxi_session_t *session)
+{
+	hislip_t *hs = session->protocol;
+
+	while (session->state != STATE_FAILED)
+	{
+		if (!hs->sending && session->state == STATE_READY)
+			next_message(session);
+		if (!hs->sending)
+			break;
+		if (send_message(session) != LXI_OK || hs->sending)
+			break;
+
+		if (hs->type == HISLIP_DATA || hs->type == HISLIP_DATA_END)
+		{
+			hs->written += hs->data;
+			if (hs->type == HISLIP_DATA_END)
+			{
+				hs->written = 0;
+				lxi_request_sent(session);
+			}
+		}
+	}
+	return session->status;
+}
+
+/* Set up the asynchronous channel, on the descriptor of the session until
+ * it is done */
+static int async_connect(lxi_session_t *session)
+{
+	hislip_t *hs = session->protocol;
+
+	hs->other = session->fd;
+	session->fd = -1;
+	hs->phase = PHASE_ASYNC;
+	return lxi_reconnect(session, 0);
+}
+
+/* The asynchronous channel is set up, go back to the synchronous one */
+static void ready(lxi_session_t *session)
+{
+	hislip_t *hs = session->protocol;
+	int fd = session->fd;
+
+	session->fd = hs->other;
+	hs->other = fd;
+	hs->phase = PHASE_READY;
+	session->state = STATE_READY;
+	session->stats.connected = lxi_now_ns();
+	lxi_set_deadline(&session->deadline, session->timeout);
+}
+
+/* The instrument sends DataEnd instead of the final LF of a response */
+static void response_end(lxi_session_t *session)
+{
+	if (session->reply_head->reply == REPLY_LINE &&
+			(session->rx_end == session->rx_start ||
+			session->rx[session->rx_end-1] != '\n'))
+	{
+		if (lxi_rx_reserve(session) != LXI_OK)
+			return;
+		session->rx[session->rx_end++] = '\n';
+	}
+	lxi_parse(session, true);
+}
+
+/* The header of a message has arrived */
+static int message_start(lxi_session_t *session)
+{
+	hislip_t *hs = session->protocol;
+	int type = hs->in[2];
+
+	if (hs->in[0] != 'H' || hs->in[1] != 'S')
+		return lxi_fail(session, LXI_ECONNECT, "Invalid HiSLIP message");
+	hs->left = get64(&hs->in[8]);
+	hs->text_length = 0;
+
+	if ((type == HISLIP_DATA || type == HISLIP_DATA_END) &&
+			session->state == STATE_READY && !hs->response)
+	{
+		/* Responses come in the order of the queries, optional ones may
+		 * be left out */
+		hs->response = true;
+		while (hs->overlapped && session->reply_head != NULL &&
+				session->reply_head->match != NULL &&
+				session->reply_head->next != NULL &&
+				get32(&hs->in[4]) != session->reply_head->id)
+			lxi_unanswered(session);
+		if (hs->overlapped && session->reply_head != NULL &&
+				get32(&hs->in[4]) != session->reply_head->id)
+			return lxi_fail(session, LXI_ECONNECT,
+					"Response to message %08x, expected %08x",
+					get32(&hs->in[4]), session->reply_head->id);
+	}
+	return LXI_OK;
+}
+
+/* A whole message has arrived */
+static int message_end(lxi_session_t *session)
+{
+	hislip_t *hs = session->protocol;
+	uint32_t parameter = get32(&hs->in[4]);
+	unsigned char size[8];
+	int type = hs->in[2];
+
+	hs->have = 0;
+	switch (type)
+	{
+		case HISLIP_INITIALIZE_RESPONSE:
+			if (hs->phase != PHASE_SYNC)
+				break;
+			if (parameter >> 16 < HISLIP_VERSION)
+				return lxi_fail(session, LXI_ECONNECT,
+						"Unsupported HiSLIP version %x", parameter >> 16);
+			hs->overlapped = (hs->in[3] & HISLIP_OVERLAPPED) != 0;
+			hs->session_id = parameter & 0xffff;
+			return async_connect(session);
+
+		case HISLIP_ASYNC_INITIALIZE_RESPONSE:
+			if (hs->phase != PHASE_ASYNC)
+				break;
+			put64(size, HISLIP_MAX_MESSAGE);
+			message(session, HISLIP_ASYNC_MAX_SIZE, 0, 0, size, 8, 0);
+			hs->phase = PHASE_MAX_SIZE;
+			return hislip_flush(session);
+
+		case HISLIP_ASYNC_MAX_SIZE_RESPONSE:
+			if (hs->phase != PHASE_MAX_SIZE)
+				break;
+			if (hs->text_length < 8 || get64((unsigned char *) hs->text) == 0)
+				return lxi_fail(session, LXI_ECONNECT,
+						"Invalid HiSLIP maximum message size");
+			hs->max_message = get64((unsigned char *) hs->text);
+			ready(session);
+			return hislip_flush(session);
+
+		case HISLIP_DATA_END:
+			if (!hs->response)
+				break;
+			hs->response = false;
+			hs->delivered = true;
+			if (session->reply_head != NULL)
+				response_end(session);
+			return hislip_flush(session);
+
+		case HISLIP_FATAL_ERROR:
+		case HISLIP_ERROR:
+			return lxi_fail(session, LXI_ECONNECT, "HiSLIP %serror %u: %.*s",
+					type == HISLIP_FATAL_ERROR ? "fatal " : "", hs->in[3],
+					(int) hs->text_length, hs->text);
+	}
+
+	/* Anything else, like service requests, is ignored */
+	return LXI_OK;
+}
+
+static int receive_error(lxi_session_t *session, ssize_t length)
+{
+	if (length == -1 && (errno == EAGAIN || errno == EINTR))
+		return LXI_OK;
+	if (length == -1)
+		return lxi_fail(session, LXI_ESYSTEM, "Error reading response: %s",
+				strerror(errno));
+	return lxi_fail(session, LXI_ECONNECT, "Connection closed by instrument");
+}
+
+static int hislip_receive(lxi_session_t *session)
+{
+	hislip_t *hs = session->protocol;
+	char skip[256], *buffer;
+	ssize_t length;
+	size_t size;
+	int fd;
+
+	/* Nothing is expected on the asynchronous channel once set up */
+	if (hs->phase == PHASE_READY)
+		while (recv(hs->other, skip, sizeof(skip), MSG_DONTWAIT) > 0)
+			;
+
+	while (session->state == STATE_HELLO || session->state == STATE_READY)
+	{
+		fd = session->fd;
+		if (hs->have < sizeof(hs->in))
+		{
+			length = recv(fd, &hs->in[hs->have], sizeof(hs->in) - hs->have, 0);
+			if (length <= 0)
+				return receive_error(session, length);
+			hs->have += length;
+			if (hs->have == sizeof(hs->in) && message_start(session) != LXI_OK)
+				break;
+			continue;
+		}
+
+		if (hs->left > 0 && hs->response)
+		{
+			/* Response data straight into the receive buffer */
+			if (lxi_rx_reserve(session) != LXI_OK)
+				break;
+			size = session->rx_size - session->rx_end;
+			if (size > hs->left)
+				size = hs->left;
+			length = recv(fd, &session->rx[session->rx_end], size, 0);
+			if (length <= 0)
+				return receive_error(session, length);
+			session->rx_end += length;
+			hs->left -= length;
+			lxi_received(session, length);
+			lxi_parse(session, false);
+			continue;
+		}
+
+		if (hs->left > 0)
+		{
+			/* Payload of a control message, only its start is kept */
+			buffer = &hs->text[hs->text_length];
+			size = sizeof(hs->text) - hs->text_length;
+			if (size == 0)
+			{
+				buffer = skip;
+				size = sizeof(skip);
+			}
+			if (size > hs->left)
+				size = hs->left;
+			length = recv(fd, buffer, size, 0);
+			if (length <= 0)
+				return receive_error(session, length);
+			if (buffer != skip)
+				hs->text_length += length;
+			hs->left -= length;
+			continue;
+		}
+
+		if (message_end(session) != LXI_OK || session->fd != fd)
+			break;
+	}
+	return session->status;
+}
+
+static int hislip_connected(lxi_session_t *session)
+{
+	hislip_t *hs = session->protocol;
+
+	hs->have = 0;
+	if (hs->phase == PHASE_SYNC)
+		message(session, HISLIP_INITIALIZE, 0, HISLIP_VERSION << 16 |
+				HISLIP_VENDOR[0] << 8 | HISLIP_VENDOR[1], HISLIP_DEVICE,
+				strlen(HISLIP_DEVICE), 0);
+	else
+		message(session, HISLIP_ASYNC_INITIALIZE, 0, hs->session_id, NULL, 0,
+				0);
+	return LXI_OK;
+}
+
+static short hislip_events(const lxi_session_t *session)
+{
+	const hislip_t *hs = session->protocol;
+
+	/* Writable to start the next message at once */
+	if (hs->sending || (session->state == STATE_READY &&
+			session->send_head != NULL &&
+			(hs->overlapped || session->reply_head == NULL)))
+		return POLLIN | POLLOUT;
+	return POLLIN;
+}
+
+static void hislip_close(lxi_session_t *session)
+{
+	hislip_t *hs = session->protocol;
+
+	if (hs->other != -1)
+		close(hs->other);
+	free(hs);
+	session->protocol = NULL;
+}
+
+static const lxi_transport_t hislip_transport = {
+	hislip_connected,
+	hislip_flush,
+	hislip_receive,
+	hislip_events,
+	hislip_close,
+};
+
+int hislip_open(lxi_session_t *session, unsigned int *port)
+{
+	hislip_t *hs;
+
+	hs = calloc(1, sizeof(hislip_t));
+	if (hs == NULL)
+		return lxi_fail(session, LXI_ESYSTEM, "Out of memory");
+	if (*port == 0)
+		*port = HISLIP_PORT;
+	hs->other = -1;
+	hs->phase = PHASE_SYNC;
+	hs->max_message = HISLIP_MAX_MESSAGE;
+	hs->message_id = HISLIP_FIRST_ID;
+	session->transport = &hislip_transport;
+	session->protocol = hs;
+	return LXI_OK;
+}
@@ -0,0 +1,202 @@
+/*
+ * lxi-control - Cache of host name lookups
+ *
+ * The cache file has one host name per line with tab separated fields:
+ *
+ *   <name> <checked> <resolved> <addresses, comma separated, or ->
+ *
+ * This program is free software; you can redistribute  it and/or modify it
+ * under  the terms of  the GNU General  Public License as published by the
+ * Free Software Foundation;  either version 2 of the  License, or (at your
+ * option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "inventory.h"
+#include "hostcache.h"
+
+#define HOSTCACHE_FILE	"hosts"
+
+static hostcache_entry_t *hostcache_add(hostcache_t *cache)
+{
+	hostcache_entry_t *entries;
+
+	if (cache->count == cache->size)
+	{
+		cache->size = cache->size ? 2 * cache->size : 16;
+		entries = realloc(cache->entries,
+				cache->size * sizeof(hostcache_entry_t));
+		if (entries == NULL)
+			return NULL;
+		cache->entries = entries;
+	}
+	memset(&cache->entries[cache->count], 0, sizeof(hostcache_entry_t));
+	return &cache->entries[cache->count++];
+}
+
+/* Read the cache file fp, NULL for none */
+static int hostcache_read(hostcache_t *cache, FILE *fp)
+{
+	char *line = NULL;
+	size_t size = 0;
+	ssize_t len;
+	char *field[4];
+	char *p, *addr;
+	int i;
+	hostcache_entry_t *entry;
+
+	memset(cache, 0, sizeof(hostcache_t));
+	if (fp == NULL)
+		return 0;
+
+	while ((len = getline(&line, &size, fp)) != -1)
+	{
+		if (len > 0 && line[len-1] == '\n')
+			line[--len] = 0;
+		if (line[0] == '#' || line[0] == 0)
+			continue;
+
+		p = line;
+		for (i = 0; i < 4 && p != NULL; i++)
+			field[i] = strsep(&p, "\t");
+		if (i < 4 || strlen(field[0]) >= sizeof(entry->name))
+			continue;
+
+		entry = hostcache_add(cache);
+		if (entry == NULL)
+			break;
+		strcpy(entry->name, field[0]);
+		entry->checked = strtol(field[1], NULL, 10);
+		entry->resolved = strtol(field[2], NULL, 10);
+		p = strcmp(field[3], "-") != 0 ? field[3] : NULL;
+		while ((addr = strsep(&p, ",")) != NULL &&
+				entry->count < HOSTCACHE_MAX_ADDRS)
+			if (*addr != 0 && strlen(addr) < sizeof(entry->addrs[0]))
+				strcpy(entry->addrs[entry->count++], addr);
+	}
+
+	free(line);
+	return 0;
+}
+
+int hostcache_load(hostcache_t *cache)
+{
+	char *path = cache_path(HOSTCACHE_FILE);
+	FILE *fp;
+	int ret;
+
+	if (path == NULL)
+		return -1;
+	fp = fopen(path, "r");
+	free(path);
+	if (fp == NULL)
+	{
+		memset(cache, 0, sizeof(hostcache_t));
+		return (errno == ENOENT) ? 0 : -1;
+	}
+	ret = hostcache_read(cache, fp);
+	fclose(fp);
+
+	return ret;
+}
+
+/* Merge the changed entries into the cache file in */
+static int hostcache_write(FILE *in, FILE *out, void *ctx)
+{
+	hostcache_t *cache = ctx;
+	hostcache_t disk;
+	hostcache_entry_t *entry, *old;
+	int i, j;
+	int ret = -1;
+
+	if (hostcache_read(&disk, in) == -1)
+		return -1;
+
+	for (i = 0; i < cache->count; i++)
+	{
+		entry = &cache->entries[i];
+		if (!entry->dirty)
+			continue;
+		old = hostcache_update(&disk, entry->name);
+		if (old == NULL)
+			goto out;
+		if (entry->checked >= old->checked)
+			*old = *entry;
+	}
+
+	fprintf(out, "# lxi-control host names: name checked resolved addresses\n");
+	for (i = 0; i < disk.count; i++)
+	{
+		entry = &disk.entries[i];
+		fprintf(out, "%s\t%ld\t%ld\t", entry->name, (long) entry->checked,
+				(long) entry->resolved);
+		for (j = 0; j < entry->count; j++)
+			fprintf(out, "%s%s", j ? "," : "", entry->addrs[j]);
+		fprintf(out, "%s\n", entry->count ? "" : "-");
+	}
+	ret = ferror(out) ? -1 : 0;
+
+out:
+	hostcache_free(&disk);
+	return ret;
+}
+
+int hostcache_save(hostcache_t *cache)
+{
+	int i;
+
+	for (i = 0; i < cache->count && !cache->entries[i].dirty; i++);
+	if (i == cache->count)
+		return 0;
+
+	if (cache_rewrite(HOSTCACHE_FILE, hostcache_write, cache) == -1)
+		return -1;
+	for (i = 0; i < cache->count; i++)
+		cache->entries[i].dirty = false;
+	return 0;
+}
+
+hostcache_entry_t *hostcache_update(hostcache_t *cache, const char *name)
+{
+	hostcache_entry_t *entry;
+	int i;
+
+	if (strlen(name) >= sizeof(entry->name) || strpbrk(name, "\t\n") != NULL)
+		return NULL;
+	for (i = 0; i < cache->count; i++)
+	{
+		entry = &cache->entries[i];
+		if (strcmp(entry->name, name) == 0)
+			return entry;
+	}
+
+	entry = hostcache_add(cache);
+	if (entry != NULL)
+		strcpy(entry->name, name);
+	return entry;
+}
+
+bool hostcache_fresh(const hostcache_entry_t *entry, int ttl, time_t now)
+{
+	int negative = ttl < HOSTCACHE_NEGATIVE_TTL ? ttl : HOSTCACHE_NEGATIVE_TTL;
+
+	if (entry->checked == 0)
+		return false;
+	/* A failed lookup is retried sooner, also while old addresses are
+	 * still in use */
+	if (entry->count == 0 || entry->resolved != entry->checked)
+		return now - entry->checked < negative;
+	return now - entry->checked < ttl;
+}
+
+void hostcache_free(hostcache_t *cache)
+{
+	free(cache->entries);
+	memset(cache, 0, sizeof(hostcache_t));
+}
@@ -0,0 +1,59 @@
+/*
+ * lxi-control - Cache of host name lookups
+ *
+ * The addresses of host names are remembered in the cache directory, so
+ * runs within the TTL do not wait for DNS. Older addresses are still used
+ * while they are looked up again in the background, and stay in use while
+ * DNS can not be reached. Names which did not resolve are remembered for
+ * HOSTCACHE_NEGATIVE_TTL seconds.
+ *
+ * This program is free software; you can redistribute  it and/or modify it
+ * under  the terms of  the GNU General  Public License as published by the
+ * Free Software Foundation;  either version 2 of the  License, or (at your
+ * option) any later version.
+ */
+
+#ifndef HOSTCACHE_H
+#define HOSTCACHE_H
+
+#include <stdbool.h>
+#include <time.h>
+
+#define HOSTCACHE_TTL		300	// Seconds addresses are used without lookup
+#define HOSTCACHE_NEGATIVE_TTL	30	// Seconds a failed lookup is remembered
+#define HOSTCACHE_MAX_ADDRS	8
+
+typedef struct {
+	char name[256];		/* Host name as given */
+	time_t checked;		/* Last lookup, 0 if never */
+	time_t resolved;	/* Last successful lookup, 0 if never */
+	int count;		/* Addresses, 0 if the name did not resolve */
+	char addrs[HOSTCACHE_MAX_ADDRS][64];
+	bool refresh;		/* Look up again in the background */
+	bool dirty;		/* Changed since loaded */
+} hostcache_entry_t;
+
+typedef struct {
+	hostcache_entry_t *entries;
+	int count;
+	int size;
+} hostcache_t;
+
+/* Load the cache, a missing file gives an empty cache. Returns -1 on
+ * error. */
+int hostcache_load(hostcache_t *cache);
+
+/* Merge the changed entries into the cache file. Returns -1 on error. */
+int hostcache_save(hostcache_t *cache);
+
+/* Find the entry of name, adding an empty one if there is none */
+hostcache_entry_t *hostcache_update(hostcache_t *cache, const char *name);
+
+/* Whether the entry may be used without a lookup: for ttl seconds after
+ * a successful one, HOSTCACHE_NEGATIVE_TTL (at most ttl) after a failed
+ * one */
+bool hostcache_fresh(const hostcache_entry_t *entry, int ttl, time_t now);
+
+void hostcache_free(hostcache_t *cache);
+
+#endif
@@ -0,0 +1,362 @@
+/*
+ * lxi-control - Instrument inventory cache
+ *
+ * The inventory file has one instrument per line with tab separated
+ * fields:
+ *
+ *   <ip> <port> <last seen> <rtt us> <alias or -> <*IDN? response>
+ *
+ * This program is free software; you can redistribute  it and/or modify it
+ * under  the terms of  the GNU General  Public License as published by the
+ * Free Software Foundation;  either version 2 of the  License, or (at your
+ * option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#include "inventory.h"
+
+#define INVENTORY_FILE	"inventory"
+
+char *cache_path(const char *name)
+{
+	const char *base;
+	char *dir, *path;
+
+	/* LXI_CONTROL_CACHE_DIR, $XDG_CACHE_HOME/lxi-control or
+	 * ~/.cache/lxi-control */
+	base = getenv("LXI_CONTROL_CACHE_DIR");
+	if (base != NULL)
+		dir = strdup(base);
+	else if ((base = getenv("XDG_CACHE_HOME")) != NULL && *base != 0)
+	{
+		dir = malloc(strlen(base) + strlen("/lxi-control") + 1);
+		if (dir != NULL)
+			sprintf(dir, "%s/lxi-control", base);
+	}
+	else
+	{
+		base = getenv("HOME");
+		if (base == NULL)
+			base = "/tmp";
+		dir = malloc(strlen(base) + strlen("/.cache/lxi-control") + 1);
+		if (dir != NULL)
+		{
+			sprintf(dir, "%s/.cache", base);
+			mkdir(dir, 0700);
+			strcat(dir, "/lxi-control");
+		}
+	}
+	if (dir == NULL)
+		return NULL;
+	mkdir(dir, 0700);
+
+	path = malloc(strlen(dir) + 1 + strlen(name) + 1);
+	if (path != NULL)
+		sprintf(path, "%s/%s", dir, name);
+	free(dir);
+
+	return path;
+}
+
+int cache_rewrite(const char *name, cache_write_t write, void *ctx)
+{
+	char *path, *lock = NULL, *tmp;
+	FILE *in, *out;
+	int fd, status;
+	int ret = -1;
+
+	path = cache_path(name);
+	tmp = malloc(strlen(name) + strlen(".lock") + 1);
+	if (tmp != NULL)
+	{
+		sprintf(tmp, "%s.lock", name);
+		lock = cache_path(tmp);
+		free(tmp);
+		tmp = NULL;
+	}
+	if (path == NULL || lock == NULL)
+		goto out;
+
+	fd = open(lock, O_RDWR | O_CREAT, 0600);
+	if (fd == -1)
+		goto out;
+	flock(fd, LOCK_EX);
+
+	in = fopen(path, "r");
+	if (in == NULL && errno != ENOENT)
+		goto unlock;
+
+	/* Write a new file and move it in place, readers never see it half
+	 * written */
+	tmp = malloc(strlen(path) + 16);
+	if (tmp == NULL)
+		goto close;
+	sprintf(tmp, "%s.%d", path, (int) getpid());
+	out = fopen(tmp, "w");
+	if (out == NULL)
+		goto close;
+	status = write(in, out, ctx);
+	if (fclose(out) == 0 && status == 0 && rename(tmp, path) == 0)
+		ret = 0;
+	else
+		unlink(tmp);
+
+close:
+	if (in != NULL)
+		fclose(in);
+unlock:
+	flock(fd, LOCK_UN);
+	close(fd);
+out:
+	free(tmp);
+	free(path);
+	free(lock);
+	return ret;
+}
+
+static inventory_entry_t *inventory_add(inventory_t *inventory)
+{
+	inventory_entry_t *entries;
+
+	if (inventory->count == inventory->size)
+	{
+		inventory->size = inventory->size ? 2 * inventory->size : 16;
+		entries = realloc(inventory->entries,
+				inventory->size * sizeof(inventory_entry_t));
+		if (entries == NULL)
+			return NULL;
+		inventory->entries = entries;
+	}
+	memset(&inventory->entries[inventory->count], 0,
+			sizeof(inventory_entry_t));
+	return &inventory->entries[inventory->count++];
+}
+
+/* Copy src to a field of size bytes, replacing tabs and line breaks */
+static void copy_field(char *dst, const char *src, size_t size)
+{
+	size_t i;
+
+	for (i = 0; i + 1 < size && src[i] != 0; i++)
+		dst[i] = (src[i] == '\t' || src[i] == '\n' || src[i] == '\r') ?
+			' ' : src[i];
+	dst[i] = 0;
+}
+
+/* Read the inventory file fp, NULL for none */
+static int inventory_read(inventory_t *inventory, FILE *fp)
+{
+	char *line = NULL;
+	size_t size = 0;
+	ssize_t len;
+	char *field[6];
+	char *p;
+	int i;
+	inventory_entry_t *entry;
+
+	memset(inventory, 0, sizeof(inventory_t));
+	if (fp == NULL)
+		return 0;
+
+	while ((len = getline(&line, &size, fp)) != -1)
+	{
+		if (len > 0 && line[len-1] == '\n')
+			line[--len] = 0;
+		if (line[0] == '#' || line[0] == 0)
+			continue;
+
+		p = line;
+		for (i = 0; i < 6 && p != NULL; i++)
+			field[i] = strsep(&p, "\t");
+		if (i < 6)
+			continue;
+
+		entry = inventory_add(inventory);
+		if (entry == NULL)
+			break;
+		copy_field(entry->ip, field[0], sizeof(entry->ip));
+		entry->port = strtoul(field[1], NULL, 10);
+		entry->seen = strtol(field[2], NULL, 10);
+		entry->rtt = strtol(field[3], NULL, 10);
+		if (strcmp(field[4], "-") != 0)
+			copy_field(entry->alias, field[4], sizeof(entry->alias));
+		copy_field(entry->idn, field[5], sizeof(entry->idn));
+	}
+
+	free(line);
+	return 0;
+}
+
+int inventory_load(inventory_t *inventory)
+{
+	char *path = cache_path(INVENTORY_FILE);
+	FILE *fp;
+	int ret;
+
+	if (path == NULL)
+		return -1;
+	fp = fopen(path, "r");
+	free(path);
+	if (fp == NULL)
+	{
+		memset(inventory, 0, sizeof(inventory_t));
+		return (errno == ENOENT) ? 0 : -1;
+	}
+	ret = inventory_read(inventory, fp);
+	fclose(fp);
+
+	return ret;
+}
+
+/* Merge the changed entries into the inventory file in */
+static int inventory_write(FILE *in, FILE *out, void *ctx)
+{
+	inventory_t *inventory = ctx;
+	inventory_t disk;
+	inventory_entry_t *entry, *old;
+	int i;
+	int ret = -1;
+
+	if (inventory_read(&disk, in) == -1)
+		return -1;
+
+	for (i = 0; i < inventory->count; i++)
+	{
+		entry = &inventory->entries[i];
+		if (!entry->dirty)
+			continue;
+		old = inventory_update(&disk, entry->ip, entry->port);
+		if (old == NULL)
+			goto out;
+		if (entry->seen >= old->seen)
+		{
+			old->seen = entry->seen;
+			old->rtt = entry->rtt;
+			if (entry->idn[0] != 0)
+				strcpy(old->idn, entry->idn);
+		}
+		if (entry->alias[0] != 0)
+			strcpy(old->alias, entry->alias);
+	}
+
+	fprintf(out, "# lxi-control inventory: ip port seen rtt_us alias idn\n");
+	for (i = 0; i < disk.count; i++)
+	{
+		entry = &disk.entries[i];
+		fprintf(out, "%s\t%u\t%ld\t%ld\t%s\t%s\n", entry->ip, entry->port,
+				(long) entry->seen, entry->rtt,
+				entry->alias[0] ? entry->alias : "-", entry->idn);
+	}
+	ret = ferror(out) ? -1 : 0;
+
+out:
+	inventory_free(&disk);
+	return ret;
+}
+
+int inventory_save(inventory_t *inventory)
+{
+	int i;
+
+	if (cache_rewrite(INVENTORY_FILE, inventory_write, inventory) == -1)
+		return -1;
+	for (i = 0; i < inventory->count; i++)
+		inventory->entries[i].dirty = false;
+	return 0;
+}
+
+inventory_entry_t *inventory_update(inventory_t *inventory, const char *ip,
+		unsigned int port)
+{
+	inventory_entry_t *entry;
+	int i;
+
+	for (i = 0; i < inventory->count; i++)
+	{
+		entry = &inventory->entries[i];
+		if (entry->port == port && strcmp(entry->ip, ip) == 0)
+			return entry;
+	}
+
+	entry = inventory_add(inventory);
+	if (entry != NULL)
+	{
+		copy_field(entry->ip, ip, sizeof(entry->ip));
+		entry->port = port;
+	}
+	return entry;
+}
+
+/* Compare field <n> of a comma separated *IDN? response with name */
+static bool idn_field_is(const char *idn, int n, const char *name)
+{
+	const char *start, *end;
+
+	for (start = idn; n > 0 && start != NULL; n--)
+	{
+		start = strchr(start, ',');
+		if (start != NULL)
+			start++;
+	}
+	if (start == NULL)
+		return false;
+
+	while (isspace((unsigned char) *start))
+		start++;
+	end = strchr(start, ',');
+	if (end == NULL)
+		end = start + strlen(start);
+	while (end > start && isspace((unsigned char) end[-1]))
+		end--;
+
+	return (size_t) (end - start) == strlen(name) &&
+		strncasecmp(start, name, end - start) == 0;
+}
+
+int inventory_find(inventory_t *inventory, const char *name,
+		inventory_entry_t **matches, int max)
+{
+	inventory_entry_t *entry;
+	int i, pass;
+	int count;
+
+	/* Alias, then model or serial number, then part of *IDN? */
+	for (pass = 0; pass < 3; pass++)
+	{
+		count = 0;
+		for (i = 0; i < inventory->count; i++)
+		{
+			entry = &inventory->entries[i];
+			if ((pass == 0 && strcasecmp(entry->alias, name) == 0) ||
+				(pass == 1 && (idn_field_is(entry->idn, 1, name) ||
+					       idn_field_is(entry->idn, 2, name))) ||
+				(pass == 2 && strcasestr(entry->idn, name) != NULL))
+			{
+				if (count < max)
+					matches[count] = entry;
+				count++;
+			}
+		}
+		if (count > 0)
+			return count;
+	}
+	return 0;
+}
+
+void inventory_free(inventory_t *inventory)
+{
+	free(inventory->entries);
+	memset(inventory, 0, sizeof(inventory_t));
+}
@@ -0,0 +1,72 @@
+/*
+ * lxi-control - Instrument inventory cache
+ *
+ * Discovered instruments are remembered in a small text file in the users
+ * cache directory, so they can be addressed by alias, model or serial
+ * number without broadcasting.
+ *
+ * This program is free software; you can redistribute  it and/or modify it
+ * under  the terms of  the GNU General  Public License as published by the
+ * Free Software Foundation;  either version 2 of the  License, or (at your
+ * option) any later version.
+ */
+
+#ifndef INVENTORY_H
+#define INVENTORY_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <time.h>
+
+#define INVENTORY_TTL	3600	// Seconds until an entry is revalidated
+
+typedef struct {
+	char ip[64];		/* Instrument IP */
+	unsigned int port;	/* Instrument port number */
+	time_t seen;		/* Last time the instrument answered */
+	long rtt;		/* *IDN? round trip time in us */
+	char alias[32];		/* User given name, empty if none */
+	char idn[256];		/* *IDN? response */
+	bool dirty;		/* Changed since loaded */
+} inventory_entry_t;
+
+typedef struct {
+	inventory_entry_t *entries;
+	int count;
+	int size;
+} inventory_t;
+
+/* Path of <name> in the lxi-control cache directory, which is created if
+ * needed. The returned string must be freed. */
+char *cache_path(const char *name);
+
+/* Writes the new contents of a cache file to out. in is the current file,
+ * NULL if there is none. Returns -1 on error. */
+typedef int (*cache_write_t)(FILE *in, FILE *out, void *ctx);
+
+/* Replace <name> in the cache directory with what write produces. Other
+ * runs may do the same at the same time, so write runs under the lock
+ * <name>.lock and sees the file as it is then. The new file is written
+ * next to it and renamed in place. Returns -1 on error. */
+int cache_rewrite(const char *name, cache_write_t write, void *ctx);
+
+/* Load the inventory, a missing file gives an empty inventory. Returns -1
+ * on error. */
+int inventory_load(inventory_t *inventory);
+
+/* Merge the changed entries into the inventory file. Returns -1 on error. */
+int inventory_save(inventory_t *inventory);
+
+/* Find the entry of ip:port, adding an empty one if there is none */
+inventory_entry_t *inventory_update(inventory_t *inventory, const char *ip,
+		unsigned int port);
+
+/* Find entries by alias, model, serial number or part of the *IDN?
+ * response, in that order of precedence. Returns the number of matches,
+ * the first max of them are stored in matches. */
+int inventory_find(inventory_t *inventory, const char *name,
+		inventory_entry_t **matches, int max);
+
+void inventory_free(inventory_t *inventory);
+
+#endif
@@ -0,0 +1,317 @@
+/*
+ * lxi-bench - Microbenchmarks of the lxi-control hot paths
+ *
+ * Times the waveform kernels (fit and byte swap, for every kernel set the
+ * CPU supports), the resampling of imported waveforms, the plotting of
+ * received samples and the parsing of ARBxDEF? responses on synthetic
+ * waveforms. Each case is warmed up and then run in batches of at least
+ * BENCH_BATCH_NS; the median and the best batch are reported as ns per
+ * sample, along with the throughput in GB/s of waveform data and the
+ * number of allocations per run.
+ *
+ * This program is free software; you can redistribute  it and/or modify it
+ * under  the terms of  the GNU General  Public License as published by the
+ * Free Software Foundation;  either version 2 of the  License, or (at your
+ * option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <getopt.h>
+#include <math.h>
+#include <time.h>
+
+#include "wfconv.h"
+#include "wfimport.h"
+#include "wfplot.h"
+
+#define BENCH_BATCH_NS	5000000		// Shortest timed batch
+#define BENCH_WARMUP_NS	50000000	// Warm-up before the batches
+#define BENCH_REPEAT	15		// Batches per case
+#define BENCH_ALIGN	64
+
+typedef struct {
+	const char *name;
+	bool kernels;		/* Run for every kernel set */
+	bool waveform;		/* Sized by --points, else one item per run */
+	void (*run)(size_t n);
+	size_t bytes;		/* Waveform bytes per sample, or per item */
+} bench_t;
+
+static const char *kernels[] = { "scalar", "sse2", "avx2" };
+
+static int16_t *src;
+static uint16_t *dst;
+static double *samples;
+static FILE *devnull;
+static volatile int sink;
+
+/* Allocation counting, by wrapping the glibc allocator */
+static unsigned long allocations;
+
+#ifdef __GLIBC__
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *p, size_t size);
+
+void *malloc(size_t size)
+{
+	allocations++;
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size)
+{
+	allocations++;
+	return __libc_calloc(n, size);
+}
+
+void *realloc(void *p, size_t size)
+{
+	allocations++;
+	return __libc_realloc(p, size);
+}
+#endif
+
+static uint64_t now_ns(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/* .wfm amplitude fit of an upload */
+static void run_fit(size_t n)
+{
+	wf_fit(dst, src, n, 8192);
+}
+
+/* Byte swap of an upload or a readback */
+static void run_swap(size_t n)
+{
+	wf_swap(dst, src, n);
+}
+
+/* Imported waveform of half the points resampled to the upload */
+static void run_resample(size_t n)
+{
+	wf_resample(dst, n, samples, n / 2, 8192);
+}
+
+/* Readback samples reduced to the plot columns and sent to gnuplot */
+static void run_plot(size_t n)
+{
+	wf_plot_t plot;
+
+	wf_plot_init(&plot, n, WF_PLOT_WIDTH);
+	wf_plot_add(&plot, dst, n);
+	wf_plot_gnuplot(&plot, devnull, "bench", "bench.png");
+	wf_plot_free(&plot);
+}
+
+/* ARBxDEF? response, parsed like lxi-control does */
+static void run_arbdef(size_t n)
+{
+	char name[40], interpolation[4];
+	int length = 0;
+
+	(void) n;
+	sscanf("ARBITRARY_WAVE1,ON,131072", "%39[^','],%3[^','],%d", name,
+			interpolation, &length);
+	sink = length;
+}
+
+static const bench_t benches[] = {
+	{ "fit",    true,  true,  run_fit,    2 },
+	{ "swap",   true,  true,  run_swap,   2 },
+	{ "resample", false, true, run_resample, 2 },
+	{ "plot",   false, true,  run_plot,   2 },
+	{ "arbdef", false, false, run_arbdef, 26 },
+};
+
+static int compare(const void *a, const void *b)
+{
+	double x = *(const double *) a, y = *(const double *) b;
+
+	return (x > y) - (x < y);
+}
+
+/* Time bench on n samples, results in ns per sample */
+static void measure(const bench_t *bench, size_t n, int repeat,
+		double *median, double *best, double *allocs)
+{
+	double results[repeat];
+	uint64_t warmup, start, elapsed;
+	unsigned long runs = 1, i, counted = 0;
+	int r;
+
+	/* Warm up caches and branch predictors while finding how many runs
+	 * make up a batch */
+	warmup = now_ns();
+	do
+	{
+		start = now_ns();
+		for (i = 0; i < runs; i++)
+			bench->run(n);
+		elapsed = now_ns() - start;
+		if (elapsed < BENCH_BATCH_NS)
+			runs *= 2;
+	} while (elapsed < BENCH_BATCH_NS || now_ns() - warmup < BENCH_WARMUP_NS);
+
+	for (r = 0; r < repeat; r++)
+	{
+		counted = allocations;
+		start = now_ns();
+		for (i = 0; i < runs; i++)
+			bench->run(n);
+		elapsed = now_ns() - start;
+		counted = allocations - counted;
+		results[r] = (double) elapsed / runs / n;
+	}
+	*allocs = (double) counted / runs;
+
+	qsort(results, repeat, sizeof(double), compare);
+	*median = results[repeat / 2];
+	*best = results[0];
+}
+
+static void report(bool csv, const bench_t *bench, const char *kernel,
+		size_t n, double median, double best, double allocs)
+{
+	double gbs = bench->bytes / median;	/* bytes/ns is GB/s */
+
+	if (csv)
+		printf("%s,%s,%zu,%.4f,%.4f,%.3f,%.3f\n", bench->name, kernel, n,
+				median, best, gbs, allocs);
+	else
+		printf("%-8s %-7s %9zu %12.4f %12.4f %9.3f %11.3f\n", bench->name,
+				kernel, n, median, best, gbs, allocs);
+}
+
+static void usage(void)
+{
+	printf("Usage: lxi-bench [options]\n\n");
+	printf("--points <list>   Comma separated waveform sizes (default: 1024,8192,65536,131072,1048576)\n");
+	printf("--repeat <count>  Timed batches per case (default: %d)\n", BENCH_REPEAT);
+	printf("--bench  <name>   Run only fit, swap, resample, plot or arbdef\n");
+	printf("--csv             Print comma separated values\n");
+	printf("--help            Display help\n");
+}
+
+int main(int argc, char *argv[])
+{
+	static struct option options[] =
+	{
+		{"points", required_argument, 0, 'p'},
+		{"repeat", required_argument, 0, 'r'},
+		{"bench",  required_argument, 0, 'b'},
+		{"csv",    no_argument,       0, 'c'},
+		{"help",   no_argument,       0, 'h'},
+		{0, 0, 0, 0}
+	};
+	size_t points[32] = { 1024, 8192, 65536, 131072, 1048576 };
+	int pointCount = 5;
+	int repeat = BENCH_REPEAT;
+	const char *only = NULL;
+	bool csv = false;
+	double median, best, allocs;
+	size_t max = 0, i;
+	char *list, *item;
+	int c, b, k, p;
+
+	while ((c = getopt_long(argc, argv, "p:r:b:ch", options, NULL)) != -1)
+	{
+		switch (c)
+		{
+			case 'p':
+				pointCount = 0;
+				list = strdup(optarg);
+				for (item = strtok(list, ","); item != NULL && pointCount < 32;
+						item = strtok(NULL, ","))
+					if ((points[pointCount] = strtoul(item, NULL, 0)) > 0)
+						pointCount++;
+				free(list);
+				break;
+			case 'r':
+				repeat = atoi(optarg);
+				break;
+			case 'b':
+				only = optarg;
+				break;
+			case 'c':
+				csv = true;
+				break;
+			case 'h':
+				usage();
+				exit(0);
+			default:
+				exit(1);
+		}
+	}
+	if (optind < argc || pointCount == 0 || repeat < 1)
+	{
+		usage();
+		exit(1);
+	}
+
+	/* Synthetic waveform, a sine of full .wfm amplitude */
+	for (p = 0; p < pointCount; p++)
+		if (points[p] > max)
+			max = points[p];
+	if (posix_memalign((void **) &src, BENCH_ALIGN, max * 2) != 0 ||
+			posix_memalign((void **) &dst, BENCH_ALIGN, max * 2) != 0 ||
+			(samples = malloc(max * sizeof(double))) == NULL)
+	{
+		fprintf(stderr, "Could not allocate %zu points\n", max);
+		exit(3);
+	}
+	for (i = 0; i < max; i++)
+	{
+		src[i] = 8192 * sin(2 * M_PI * i / 4096.0);
+		samples[i] = src[i];
+	}
+	memset(dst, 0, max * 2);
+
+	devnull = fopen("/dev/null", "w");
+	if (devnull == NULL)
+	{
+		perror("/dev/null");
+		exit(3);
+	}
+
+	if (csv)
+		printf("bench,kernel,points,ns_per_sample,best_ns_per_sample,gb_per_s,allocs_per_run\n");
+	else
+		printf("%-8s %-7s %9s %12s %12s %9s %11s\n", "bench", "kernel",
+				"points", "ns/sample", "best", "GB/s", "allocs/run");
+
+	for (b = 0; b < (int) (sizeof(benches) / sizeof(benches[0])); b++)
+	{
+		if (only != NULL && strcmp(only, benches[b].name) != 0)
+			continue;
+		for (k = 0; k < (benches[b].kernels ? 3 : 1); k++)
+		{
+			if (benches[b].kernels && wf_select_kernel(kernels[k]) != 0)
+				continue;
+			for (p = 0; p < (benches[b].waveform ? pointCount : 1); p++)
+			{
+				measure(&benches[b], benches[b].waveform ? points[p] : 1,
+						repeat, &median, &best, &allocs);
+				report(csv, &benches[b], benches[b].kernels ? kernels[k] : "-",
+						benches[b].waveform ? points[p] : 1, median, best, allocs);
+			}
+		}
+	}
+
+	fclose(devnull);
+	free(src);
+	free(dst);
+	free(samples);
+	return 0;
+}
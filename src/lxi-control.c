@@ -22,28 +22,57 @@
 #include <stdbool.h>
 #include <getopt.h>
 #include <string.h>
+#include <ctype.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <poll.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <time.h>
+#include <ifaddrs.h>
+#include <net/if.h>
 #include <netdb.h> // hostent
 #include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
 #include <unistd.h> // implicit decl of close 
 
+#include "wfconv.h"
+#include "wfimport.h"
+#include "inventory.h"
+#include "hostcache.h"
+#include "arbcache.h"
+#include "wfplot.h"
+#include "broker.h"
+#include "acquire.h"
+#include "stats.h"
+#include "lxi.h"
+
 /* Application configuration */
 #define APP_VERSION		"1.2.0c"
 #define NET_NODELAY	1	// TCP nodelay enabled
 #define NET_TIMEOUT	4	// Network timeout in seconds (default)
-#define NET_MAX_NODES	256
 #define ERR		-1
 #define NET_MAX_BUF	1500
 #define BROADCAST_ADDR	"255.255.255.255"
 #define BROADCAST_PORT	111
+#define BROADCAST_RETRY	100	// ms until first broadcast retransmission
+#define BROADCAST_RETRY_MAX	1000	// Longest ms between retransmissions
 
 #define MAX_WF_BUFFER 128*1024*2 // 128k points of 2 bytes each
+#define WF_BUF_ALIGN	64	// Alignment of the waveform conversion buffer
+#define FANOUT_PARALLEL	32	// Instruments served at a time (default)
 
 /* Status message macros */
 #define INFO(format, args...) \
@@ -54,21 +83,40 @@
 
 #define MODE_NORMAL	0
 #define MODE_DISCOVERY	1
+#define MODE_SCRIPT	2
+#define MODE_INVENTORY	3
+#define MODE_FANOUT	4
+#define MODE_DAEMON	5
+#define MODE_POLL	6
+#define MODE_ARBSET	7
+
+/* Error check after commands, see --sync */
+#define SYNC_OFF	0
+#define SYNC_ERR	1	// SYST:ERR?, the oldest error queue entry
+#define SYNC_ESR	2	// *ESR?, the event status register
+#define SYNC_OPC	3	// *OPC?, completion only
+
+#define ESR_ERRORS	0x3c	// Query, device, execution and command error bits
 
 //bool debug = true;
 bool debug = false;
 
 /*Waveform globals*/
-int16_t * waveform_buf;
+const uint16_t * waveform_buf; // Waveform data in network order
 long lSize;
-FILE * file;
+void * wfm_map; // Mapped .wfm file
+size_t wfm_map_size;
+uint16_t * conv_buf; // Conversion buffer, kept for the next waveform
+size_t conv_buf_size;
 FILE * outFile;
 char * fileNameOut;
 //int16_t * read_buf;
 bool wf = false;
+char * fileNameIn; // Waveform to upload (--file)
+size_t targetPoints = 0; // --points, 0 for the length of the file
+bool forceUpload = false; // --force, upload even if the slot holds the waveform
 bool fitWaveform = false;
 int waveAmplitude; // Default from Waveform Manager
-int genAmplitude = 8192; // Function generator peak amplitude
 int fileAmp=0;
 int customAmp=0; // Function generator peak amplitude
 bool usingCustomAmp = false;
@@ -79,23 +127,106 @@ bool dumpPlot = false;
 char * plotFileName;
 bool plotNameSpecified = false;
 
+/* Script mode */
+char * scriptFileName;
+int pipelineDepth = 1; // Number of queries in flight
+
+/* Poll mode */
+char * pollQuery;
+double pollRate = 10;   // Queries per second
+char * logFileName;
+long pollSamples = 0;   // Samples to take, 0 until interrupted
+
+/* Statistics */
+bool showStats = false;
+int statsFormat = STATS_JSON;
+
+/* Connection to the instrument */
+lxi_session_t * session;
+int transport = LXI_RAW; // --transport
+int connectTimeout = 0;  // --connect-timeout in ms, 0 for the network timeout
+
+/* Checking commands, see --sync */
+int syncMode = SYNC_OFF;
+bool syncPending = false; // Commands sent since the last check
+int syncStatus = 0;       // 1 once the device reported an error
+static const char *syncQuery[] = { NULL, "SYST:ERR?", "*ESR?", "*OPC?" };
+
 /* Configuration structure */
 static struct {
 	char *ip;		/* Instrument IP */
+	char **addrs;		/* All addresses of the instrument, ip first */
+	int addrCount;
 	unsigned int port;	/* Instrument port number */
 	char *command;		/* SCPI command */
-	int socket;		/* Socket handle */
 	int mode;		/* Program mode */
 	int timeout;
+	int expect;		/* Discovery: stop when this many answered */
+	int idle;		/* Discovery: stop after ms without new answers */
 } config = {			/* Defaults */
 	NULL,
-	9221,
 	NULL,
 	0,
+	9221,
+	NULL,
 	MODE_NORMAL,
-	NET_TIMEOUT
+	NET_TIMEOUT,
+	0,
+	0
 };
 
+/* Options without a short form */
+#define OPT_EXPECT	256
+#define OPT_IDLE	257
+#define OPT_ALIAS	258
+#define OPT_CACHE_TTL	259
+#define OPT_INVENTORY	260
+#define OPT_HOSTS_FILE	261
+#define OPT_PARALLEL	262
+#define OPT_DAEMON	263
+#define OPT_BROKER	264
+#define OPT_POLL	265
+#define OPT_RATE	266
+#define OPT_LOG		267
+#define OPT_SAMPLES	268
+#define OPT_STATS	269
+#define OPT_TRANSPORT	270
+#define OPT_POINTS	271
+#define OPT_FORCE	272
+#define OPT_ARB		273
+#define OPT_CONNECT_TIMEOUT	274
+#define OPT_DNS_TTL	275
+#define OPT_SYNC	276
+
+/* Inventory of known instruments */
+inventory_t inventory;
+bool inventoryLoaded = false;
+char * aliasName;       // --alias
+int cacheTtl = INVENTORY_TTL;
+bool portSet = false;   // --port given
+
+/* Addresses of host names */
+hostcache_t hostCache;
+bool hostCacheLoaded = false;
+int dnsTtl = HOSTCACHE_TTL; // --dns-ttl, 0 to always ask DNS
+
+/* Instruments given by --ip, --host, --device and --hosts-file */
+typedef struct {
+  char * name;           /* Name as given, used to tag output */
+  char * ip;             /* Instrument IP, NULL until a device is resolved */
+  char ** addrs;         /* All addresses of a host name, ip is the first */
+  int addrCount;         /* 0 for a single IP */
+  unsigned int port;     /* Port number, 0 for the --port value */
+} target_t;
+
+target_t * targets;
+int targetCount;
+int parallel = FANOUT_PARALLEL; // Instruments served at a time in fan-out mode
+
+/* Connection broker */
+char * daemonPath;      // --daemon socket, NULL for the default
+char * brokerPath;      // Broker used by clients, NULL to connect directly
+
 /* Waveform information */
 typedef struct {
   char name[40];         /* Waveform name */
@@ -105,6 +236,64 @@ typedef struct {
   int  arb;              /* Waveform number (ARB<arb>) */
 } wf_info_t;
 
+/* Waveform of the set given by --arb */
+typedef struct {
+	int arb;		/* Slot 1 to 4 */
+	char *filename;
+	char *name;		/* Set with ARBxDEF, NULL to keep the name */
+	pthread_t thread;
+	uint16_t *data;		/* Samples in network order, NULL on errors */
+	size_t points;
+	size_t bytes;		/* File size */
+	uint64_t hash;
+	char error[160];
+	bool known;		/* The content of the slot is in the cache */
+	arbcache_slot_t cached;
+	wf_info_t def;		/* ARBxDEF? response */
+	bool sent;
+	atomic_bool done;	/* Converted, data or error is set */
+} arb_slot_t;
+
+arb_slot_t arbSlots[4];
+int arbCount;
+int arbEvent = -1;	/* Signalled by each finished conversion */
+
+/* Command sent to many instruments concurrently */
+#define PROBE_CONNECTING	0
+#define PROBE_SENDING		1
+#define PROBE_RECEIVING		2
+#define PROBE_DONE		3
+
+typedef struct {
+  const char * name;          /* Tag for output, may be NULL */
+  char ip[64];                /* Instrument IP */
+  char ** addrs;              /* Addresses to try in turn, ip is the current */
+  int addr_count;             /* 0 for ip only */
+  int addr_next;
+  long connect_timeout;       /* ms per address, 0 for the whole timeout */
+  unsigned int port;          /* Instrument port number */
+  const char * broker;        /* Broker socket, NULL to connect directly */
+  char hello[96];             /* CONNECT line for the broker */
+  size_t hello_length;
+  bool accepted;              /* Broker answered OK */
+  int fd;                     /* Socket, -1 when not running */
+  int state;                  /* PROBE_* */
+  const char * request;       /* Data to send */
+  size_t request_length;
+  size_t sent;
+  bool reply;                 /* Wait for a LF terminated response */
+  char * response;            /* Response without LF, grows as needed */
+  size_t size;
+  size_t received;
+  int status;                 /* Exit status, see man page */
+  struct timespec start;      /* Time of connect */
+  struct timespec begin;      /* Time of the first connect, for the timeout */
+  long rtt;                   /* us from connect to response */
+} probe_t;
+
+/* Called once for every finished probe */
+typedef void (*probe_done_t)(probe_t *probe);
+
 /* Binary UDP payload which represents GETPORT RPC call */
 char rpc_GETPORT_msg[] = {
 0x00, 0x00, 0x03, 0xe8, 0x00, 0x00, 0x00, 0x00, 
@@ -117,7 +306,11 @@ char rpc_GETPORT_msg[] = {
 
 /*----------------------------------------------------------------------------*/
 
-int hostname_to_ip(char *  , char *);
+static int hostname_to_ip(const char *, char ***);
+static void revalidate_hosts(void);
+static void resolve_targets(void);
+static void alias_device(const char *name);
+static void print_stats(void);
 
 void print_help(void)
 {
@@ -126,20 +319,57 @@ void print_help(void)
   INFO("----------------------------------------------------------------------------------------------\n");
 	INFO("\n");
 	INFO("Options:\n");
-	INFO("--ip,i       <ip>           Remote device IP\n");
+	INFO("--ip,i       <ip>           Remote device IPv4 or IPv6 address\n");
 	INFO("--host,n     <host name>    Remote device host name\n");
+	INFO("--device,D   <name>         Remote device alias, model or serial number from inventory\n");
+	INFO("--hosts-file <filename>     Remote devices from file, one host[:port] per line\n");
+	INFO("--parallel   <count>        Devices served at a time if more than one is given (default: %d)\n",
+								parallel);
 	INFO("--port,p     <port>         Remote device port (default: %d)\n",
 								config.port);
 	INFO("--scpi,s     <command>      SCPI command. Commands are not case sensitive\n");
-	INFO("--file,f     <filename>     Waveform filename\n");
+	INFO("--file,f     <filename>     Waveform filename: .wfm, .csv or .txt (last column),\n"
+       "                            .f32, .f64 (raw floats) or .npy\n");
+	INFO("--points     <count>        Resample the waveform to <count> points (2 - %d)\n",
+								MAX_WF_BUFFER/2);
 	INFO("--gnuplot,g  <filename>     Plot waveform in gnuplot and dump to file (in home folder)\n"
-       "                            (default is name given in function generator)\n");
+       "                            (default is name given in function generator),\n"
+       "                            a name ending in .svg is drawn without gnuplot\n");
+	INFO("--arb        <n>=<file>[,<name>]\n"
+       "                            Upload <file> to ARB<n> (1 - 4) and name it <name>.\n"
+       "                            Up to four, converted in parallel and sent on one connection\n");
+	INFO("--force                     Upload the waveform even if the device already holds it\n");
 	INFO("--adjust,a   <amp>          Adjust waveform to fit original peak amplitude <amp> \n"
        "                            to function generator max peak amplitude of 8192 counts.\n"
        "                            Default value is read from first 2 bytes of .wfm file\n");
 	INFO("--timeout,t  <seconds>      Network timeout (default: %d s)\n",
 								config.timeout);
+	INFO("--connect-timeout <ms>      Connection setup timeout (default: network timeout)\n");
+	INFO("--dns-ttl    <seconds>      Use remembered host name addresses for <seconds> (default: %d)\n",
+								dnsTtl);
+	INFO("--script,S   <filename>     Run commands from file (- for stdin) on one connection\n");
+	INFO("--pipeline,P <queries>      Queries in flight in script mode (default: %d)\n",
+								pipelineDepth);
+	INFO("--sync[=<check>]            Check commands for errors with err (SYST:ERR?, default),\n"
+       "                            esr (*ESR?) or opc (*OPC?, completion only).\n"
+       "                            err and esr clear the device status with *CLS first\n");
 	INFO("--discover,d                Discover LXI devices on hosts subnet\n");
+	INFO("--expect     <count>        Stop discovery when <count> devices have answered\n");
+	INFO("--idle       <ms>           Stop discovery after <ms> without new devices\n");
+	INFO("--inventory                 List devices remembered from discovery\n");
+	INFO("--alias      <name>         Remember remote device under <name>\n");
+	INFO("--cache-ttl  <seconds>      Revalidate remembered devices after <seconds> (default: %d)\n",
+								cacheTtl);
+	INFO("--poll       <query>        Send query periodically and log the numeric responses\n");
+	INFO("--rate       <hz>           Queries per second in poll mode (default: %g)\n",
+								pollRate);
+	INFO("--log        <filename>     Append poll samples to binary file\n");
+	INFO("--samples    <count>        Stop polling after <count> samples (default: until interrupted)\n");
+	INFO("--daemon[=<socket>]         Run a broker keeping connections to devices open\n");
+	INFO("--broker[=<socket>]         Use devices through the broker (also LXI_CONTROL_BROKER)\n");
+	INFO("--stats[=<format>]          Print phase times and byte counts to stderr at exit,\n"
+       "                            as json (default) or openmetrics\n");
+	INFO("--transport  <protocol>     raw (SCPI over TCP, default), vxi11 or hislip\n");
 	INFO("--version,v                 Display version\n");
 	INFO("--help,h                    Display help\n");
 	INFO("\n\n");
@@ -150,8 +380,323 @@ void print_help(void)
   INFO("* Fetch waveform stored in ARB1, store to ~/test2.out and create a png of the waveform with default name:\n");
   INFO("\t./lxi-control --host functiongenerator.cern.ch --scpi arb1? --file ~/test2.out -g\n\n");
   INFO("* Load waveform to function generator:\n");
+  INFO("\t./lxi-control --host functiongenerator.cern.ch --scpi arb1 --adjust --file ~/test.wfm\n\n");
+  INFO("* Run a sequence of commands, one per line, over a single connection:\n");
+  INFO("\tprintf 'OUTP OFF\\narb1 ~/test.wfm\\narb1def?\\nOUTP ON\\n' | ./lxi-control --ip 10.0.0.2 --script -\n\n");
+  INFO("* Query several devices at once, responses are tagged with the device:\n");
+  INFO("\t./lxi-control --ip 10.0.0.2 --ip 10.0.0.3 --hosts-file ~/rack.txt --scpi '*idn?'\n\n");
+  INFO("* Log a measurement 200 times a second until interrupted:\n");
+  INFO("\t./lxi-control --ip 10.0.0.4 --poll 'MEAS:VOLT?' --rate 200 --log ~/volt.bin\n");
   INFO("\n");
 }
+/* Returns true if the command addresses one of the arbitrary waveforms
+ * (ARB1 to ARB4) */
+static bool is_arb_command(const char *command)
+{
+	return (strncasecmp(command,"ARB1",4)==0 ||
+		strncasecmp(command,"ARB2",4)==0 ||
+		strncasecmp(command,"ARB3",4)==0 ||
+		strncasecmp(command,"ARB4",4)==0);
+}
+
+/* Make room for size bytes in conv_buf. The conversion buffer only grows. */
+static void reserve_conv_buf(size_t size)
+{
+  if(conv_buf_size >= size)
+    return;
+  free(conv_buf);
+  if(posix_memalign((void **) &conv_buf, WF_BUF_ALIGN, size) != 0){
+    ERROR("Could not allocate %ld bytes for waveform\n", (long) size);
+    exit(3);
+  }
+  conv_buf_size = size;
+}
+
+/* Read a waveform in any of the formats of wfimport.h and resample it to
+ * --points, or to its own length if that fits in the generator. .wfm data
+ * is fitted with --adjust only, like load_waveform() does. Other samples are
+ * always fitted: to --adjust <amp> if given, else to their peak. */
+static int import_waveform(const char *filename, int format)
+{
+  wf_samples_t wave;
+  char error[160];
+  size_t points;
+  double amplitude;
+
+  if(debug) printf("file: %s, format %d\n", filename, format);
+  stats_start(PHASE_FILE);
+  if(wf_import(filename, format, &wave, error, sizeof(error)) != 0){
+    ERROR("%s\n", error);
+    exit(1);
+  }
+
+  points = targetPoints;
+  if(points == 0){
+    points = wave.n;
+    if(points > MAX_WF_BUFFER/2){
+      points = MAX_WF_BUFFER/2;
+      INFO("Waveform has %zu points, resampling to %zu\n", wave.n, points);
+    }
+  }
+  amplitude = 0;
+  if(format != WF_FORMAT_WFM || fitWaveform){
+    amplitude = usingCustomAmp ? customAmp : wave.amplitude;
+    if(amplitude == 0){
+      printf("Zero amplitude is impossible, exiting...\n");
+      exit(1);
+    }
+  }
+
+  lSize = points * 2;
+  reserve_conv_buf(lSize);
+  if(wf_resample(conv_buf, points, wave.samples, wave.n, amplitude) != 0){
+    ERROR("Could not allocate memory to resample %s\n", filename);
+    exit(3);
+  }
+  waveform_buf = conv_buf;
+  printf("File %s successfully opened, %zu samples resampled to %zu points\n",
+         filename, wave.n, points);
+  stats_stop(PHASE_FILE);
+  stats_file_bytes(wave.bytes);
+  wf_samples_free(&wave);
+  return 0;
+}
+
+/* Map a TTi Waveform Manager .wfm file and point waveform_buf at its data
+ * in network order, fitting it to the function generator amplitude if
+ * requested (--adjust). The file data is converted into conv_buf, which is
+ * kept for the next waveform. .wfm samples are little endian, so on the
+ * usual little endian hosts they are always copied there, fitted or just
+ * swapped; the mapping only saves the read into a buffer of our own. Only a
+ * big endian host sends the file data straight from the mapping. */
+static int load_waveform(const char *filename)
+{
+  int fd;
+  struct stat st;
+  const uint8_t * data;
+  size_t points;
+  int format = wf_format(filename);
+
+  /* Other formats, or a different length, go through the resampler */
+  if(format != WF_FORMAT_WFM || targetPoints > 0)
+    return import_waveform(filename, format);
+
+  if(debug) printf("file: %s\n", filename);
+  stats_start(PHASE_FILE);
+  fd = open(filename, O_RDONLY);
+  if (fd == ERR || fstat(fd, &st) == ERR){
+    fprintf(stdout, "Read: Error opening file %s, errno: %s\n", filename,strerror(errno));
+    exit(1);
+  }
+  if(st.st_size < 2){
+    close(fd);
+    printf("Could not read header in file %s, read %ld bytes\n", filename, (long) st.st_size);
+    exit(1);
+  }
+
+  wfm_map_size = st.st_size;
+  wfm_map = mmap(NULL, wfm_map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(wfm_map == MAP_FAILED){
+    fprintf(stdout, "Failed to map file %s, errno: %s\n", filename, strerror(errno));
+    exit(1);
+  }
+  madvise(wfm_map, wfm_map_size, MADV_SEQUENTIAL);
+
+  /* Waveform max peak amplitude from the first 2 bytes (little endian) */
+  data = wfm_map;
+  fileAmp = data[0] | (data[1] << 8);
+  data += 2; // Account for .wfm header
+  points = (wfm_map_size - 2) / 2;
+  lSize = points * 2;
+  if(debug) printf("waveform size: %ld\n", lSize);
+  printf("File %s successfully opened, waveform size is %ld points\n", filename, lSize/2);
+
+  if(fitWaveform || htons(1) != 1)
+    reserve_conv_buf(lSize);
+  
+  /* Normalize and fit the waveform */
+  if(fitWaveform){
+    if(usingCustomAmp){
+      waveAmplitude = customAmp;
+      if(debug) printf("using custom amp: %d, waveamp: %d\n", customAmp, waveAmplitude);
+    } else {
+      waveAmplitude = fileAmp;
+      if(debug) printf("using amp read from file: %d, waveamp: %d\n", fileAmp, waveAmplitude);
+    }
+    if(waveAmplitude == 0){
+      printf("Zero amplitude is impossible, exiting...\n");
+      exit(1);
+    }
+    /* Have to hack the shitty output of TTi's waveform editor.
+     * Amplitude goes from -8192 to +8192, but -8192 is 0 in the generator
+     * only the 14 LSB bits are used. The samples are converted to network
+     * order in the same pass.
+     * */
+    wf_fit(conv_buf, (const int16_t *) data, points, waveAmplitude);
+    waveform_buf = conv_buf;
+  } else if(htons(1) != 1) {
+    /* Convert to network order */
+    wf_swap(conv_buf, data, points);
+    waveform_buf = conv_buf;
+  } else {
+    /* Big endian host: send the file as is, like the samples were sent
+     * before the file was mapped */
+    waveform_buf = (const uint16_t *) data;
+  }
+  if(debug) printf("converted waveform using %s kernels\n", wf_kernel());
+  stats_stop(PHASE_FILE);
+  stats_file_bytes(wfm_map_size);
+  return 0;
+}
+
+/* Release the mapping of the last loaded waveform */
+static void unload_waveform(void)
+{
+  if(wfm_map != NULL)
+    munmap(wfm_map, wfm_map_size);
+  wfm_map = NULL;
+  waveform_buf = NULL;
+}
+
+/* Add a waveform to the set, given as <slot>=<file>[,<name>] */
+static void add_arb_slot(char *arg)
+{
+	arb_slot_t *slot;
+	char *comma;
+	int i;
+
+	if (arg[0] < '1' || arg[0] > '4' || arg[1] != '=' || arg[2] == 0)
+	{
+		ERROR("Invalid waveform, use --arb <slot>=<file>[,<name>] with slot 1 to 4: %s\n",
+				arg);
+		exit(1);
+	}
+	for (i = 0; i < arbCount; i++)
+	{
+		if (arbSlots[i].arb == arg[0] - '0')
+		{
+			ERROR("ARB%c is given more than once\n", arg[0]);
+			exit(1);
+		}
+	}
+
+	slot = &arbSlots[arbCount++];
+	slot->arb = arg[0] - '0';
+	slot->filename = arg + 2;
+	comma = strrchr(slot->filename, ',');
+	if (comma != NULL)
+	{
+		*comma = 0;
+		slot->name = comma + 1;
+		if (*slot->name == 0 || strpbrk(slot->name, ";\n") != NULL)
+		{
+			ERROR("Invalid name for ARB%d: %s\n", slot->arb, slot->name);
+			exit(1);
+		}
+	}
+}
+
+/* Add an instrument to the targets. ip is NULL for a --device name, which
+ * is looked up in the inventory when all options are read. */
+static target_t *add_target(char *name, char *ip, unsigned int port)
+{
+	target_t *list;
+
+	list = realloc(targets, (targetCount + 1) * sizeof(target_t));
+	if (list == NULL)
+	{
+		ERROR("Out of memory\n");
+		exit(3);
+	}
+	targets = list;
+	targets[targetCount].name = name;
+	targets[targetCount].ip = ip;
+	targets[targetCount].addrs = NULL;
+	targets[targetCount].addrCount = 0;
+	targets[targetCount].port = port;
+	return &targets[targetCount++];
+}
+
+/* Add an instrument given by host name with all its addresses */
+static void add_host(char *name, const char *host, unsigned int port)
+{
+	target_t *target;
+	char **addrs;
+	int count;
+
+	count = hostname_to_ip(host, &addrs);
+	if (count == 0)
+	{
+		ERROR("Could not resolve %s\n", host);
+		/* Remember the failure */
+		if (hostCacheLoaded)
+			hostcache_save(&hostCache);
+		exit(1);
+	}
+	target = add_target(name, addrs[0], port);
+	target->addrs = addrs;
+	target->addrCount = count;
+}
+
+/* Add the instruments listed in a file, one host name or IP with an
+ * optional :port per line, IPv6 addresses with a port in brackets. Empty
+ * lines and lines starting with # are skipped. */
+static void read_hosts_file(const char *filename)
+{
+	FILE *fp;
+	char *line = NULL;
+	size_t size = 0;
+	ssize_t len;
+	char *host, *name, *colon, *bracket;
+	unsigned int port;
+
+	fp = fopen(filename, "r");
+	if (fp == NULL)
+	{
+		ERROR("Could not open hosts file %s: %s\n", filename, strerror(errno));
+		exit(1);
+	}
+
+	while ((len = getline(&line, &size, fp)) != -1)
+	{
+		while (len > 0 && isspace((unsigned char)line[len-1]))
+			line[--len] = 0;
+		host = line;
+		while (isspace((unsigned char)*host))
+			host++;
+		if (*host == 0 || *host == '#')
+			continue;
+
+		name = strdup(host);
+		port = 0;
+		colon = strchr(host, ':');
+		if (*host == '[' && (bracket = strchr(host, ']')) != NULL)
+		{
+			*bracket = 0;
+			host++;
+			colon = bracket[1] == ':' ? bracket + 1 : NULL;
+		}
+		else if (colon != NULL && strchr(colon + 1, ':') != NULL)
+			colon = NULL;	/* IPv6 address without port */
+		if (colon != NULL)
+		{
+			*colon = 0;
+			port = atoi(colon + 1);
+			if (port == 0)
+			{
+				ERROR("Invalid port in hosts file: %s\n", name);
+				exit(1);
+			}
+		}
+
+		add_host(name, host, port);
+	}
+
+	free(line);
+	fclose(fp);
+}
+
 static int parse_options(int argc, char *argv[])
 {
 	static int c;
@@ -168,13 +713,37 @@ static int parse_options(int argc, char *argv[])
 		{
 			{"ip",		  required_argument,	0, 'i'},
 			{"host",		required_argument,	0, 'n'},
+			{"device",  required_argument,	0, 'D'},
+			{"hosts-file", required_argument,	0, OPT_HOSTS_FILE},
+			{"parallel", required_argument,	0, OPT_PARALLEL},
 			{"port",	  required_argument,	0, 'p'},
 			{"scpi",	  required_argument,	0, 's'},
 			{"file",	  required_argument,	0, 'f'},
 			{"gnuplot", optional_argument,	0, 'g'},
 			{"adjust",	optional_argument,	0, 'a'},
-			{"timeout",	no_argument,		    0, 't'},
+			{"timeout",	required_argument,	0, 't'},
+			{"connect-timeout", required_argument,	0, OPT_CONNECT_TIMEOUT},
+			{"dns-ttl", required_argument,	0, OPT_DNS_TTL},
+			{"sync",    optional_argument,	0, OPT_SYNC},
+			{"script",  required_argument,	0, 'S'},
+			{"pipeline",required_argument,	0, 'P'},
 			{"discover",no_argument,		    0, 'd'},
+			{"expect",  required_argument,	0, OPT_EXPECT},
+			{"idle",    required_argument,	0, OPT_IDLE},
+			{"inventory", no_argument,	0, OPT_INVENTORY},
+			{"alias",   required_argument,	0, OPT_ALIAS},
+			{"cache-ttl", required_argument,	0, OPT_CACHE_TTL},
+			{"daemon",  optional_argument,	0, OPT_DAEMON},
+			{"broker",  optional_argument,	0, OPT_BROKER},
+			{"poll",    required_argument,	0, OPT_POLL},
+			{"rate",    required_argument,	0, OPT_RATE},
+			{"log",     required_argument,	0, OPT_LOG},
+			{"samples", required_argument,	0, OPT_SAMPLES},
+			{"stats",   optional_argument,	0, OPT_STATS},
+			{"transport", required_argument,	0, OPT_TRANSPORT},
+			{"points",  required_argument,	0, OPT_POINTS},
+			{"force",   no_argument,	0, OPT_FORCE},
+			{"arb",     required_argument,	0, OPT_ARB},
 			{"version",	no_argument,		    0, 'v'},
 			{"help",	  no_argument,		    0, 'h'},
 			{0, 0, 0, 0}
@@ -184,7 +753,7 @@ static int parse_options(int argc, char *argv[])
 		int option_index = 0;
 
 		/* Parse argument using getopt_long (no short opts allowed) */
-		c = getopt_long (argc, argv, "i:n:p:s:f:g::a::tdvh", long_options, &option_index);
+		c = getopt_long (argc, argv, "i:n:D:p:s:f:g::a::t:S:P:dvh", long_options, &option_index);
 		//c = getopt_long (argc, argv, "i:n:p:s:f:a:t:d:v:h:", long_options, &option_index);
 
 		/* Detect the end of the options. */
@@ -205,26 +774,68 @@ static int parse_options(int argc, char *argv[])
 			
       /* Define IP */
 			case 'i':
-				config.ip = optarg;
+				add_target(optarg, optarg, 0);
 				break;
 			
       /* Get IP from hostname */
       case 'n':
-        {};
-        char test[100];
-        if(hostname_to_ip(optarg, test)!=0){
-          printf("Could not resolve %s, exiting...\n", optarg);
-          exit(1);
-        } else {
-					config.ip = test;
-          //strcpy(config.ip, test);
-          printf("Resolved %s to ip %s\n",optarg, config.ip);
-        }
+				add_host(optarg, optarg, 0);
+        printf("Resolved %s to ip %s\n", optarg, targets[targetCount-1].ip);
+				break;
+
+      /* Instrument from inventory, resolved after all options are read */
+			case 'D':
+				add_target(optarg, NULL, 0);
+				break;
+
+			case OPT_HOSTS_FILE:
+				read_hosts_file(optarg);
+				break;
+
+      /* Instruments served at a time */
+			case OPT_PARALLEL:
+				parallel = atoi(optarg);
+				if (parallel < 1)
+				{
+					ERROR("Parallel count must be at least 1\n");
+					exit(1);
+				}
+				break;
+
+      /* Network timeout */
+			case 't':
+				config.timeout = atoi(optarg);
+				if (config.timeout < 1)
+				{
+					ERROR("Timeout must be at least 1 s\n");
+					exit(1);
+				}
+				break;
+
+      /* Bound on the connection setup */
+			case OPT_CONNECT_TIMEOUT:
+				connectTimeout = atoi(optarg);
+				if (connectTimeout < 1)
+				{
+					ERROR("Connect timeout must be at least 1 ms\n");
+					exit(1);
+				}
+				break;
+
+      /* Age of remembered host name addresses */
+			case OPT_DNS_TTL:
+				dnsTtl = atoi(optarg);
+				if (dnsTtl < 0)
+				{
+					ERROR("DNS TTL must not be negative\n");
+					exit(1);
+				}
 				break;
 
       /* Configure port number */
 			case 'p':
 				config.port = atoi(optarg);
+				portSet = true;
 				break;
 
       /* Set command */
@@ -260,11 +871,7 @@ static int parse_options(int argc, char *argv[])
       /* Read waveform file  */
       case 'f':
         /* Check to see if the command is correct */
-        if((strncasecmp(config.command,"ARB1",4)==0 ||
-            strncasecmp(config.command,"ARB2",4)==0 ||
-            strncasecmp(config.command,"ARB3",4)==0 ||
-            strncasecmp(config.command,"ARB4",4)==0) 
-            ){
+        if(config.command != NULL && is_arb_command(config.command)){
           if(debug) printf("ARBx start, strlen:%ld, command: %s, last char: %c\n", strlen(config.command), config.command, config.command[strlen(config.command)-1]);
           
           /* ARBx?  */
@@ -277,74 +884,10 @@ static int parse_options(int argc, char *argv[])
 
           /* ARBx <bin>  */          
           } else if ( strlen(config.command) == 4 ) {
-            /* We want to define waveform */
+            /* We want to define waveform, loaded when all options are
+             * known */
             wf=true;
-            printf("strcmp: %d\n", strncmp(config.command, "ARB1x", 5));
-            if(debug) printf("file: %s\n", optarg);
-            file = fopen(optarg, "rb");
-            if (file == NULL){
-              fprintf(stdout, "Read: Error opening file %s, errno: %s\n", optarg,strerror(errno));
-              exit(1);
-            }
-            
-            fseek(file, 0L, SEEK_END);
-            lSize = ftell(file)-2; // Account for .wfm header
-            rewind(file);
-            if(debug) printf("waveform size: %ld\n", lSize);
-            
-            /* 16bit */
-            size_t res;
-            waveform_buf = (int16_t*) calloc((lSize/2), sizeof(int16_t));
-            rewind(file);
-            /* Read waveform max peak amplitude from file  */
-            res = fread(&fileAmp, sizeof(int16_t), 1, file); // Read wfm header
-            if(res != 1){
-              fclose(file);
-              free(waveform_buf);
-              printf("Could not read header in file %s, read %ld bytes\n", optarg, res*2);
-            } else {
-              fileAmp<0?fileAmp*=-1:fileAmp; // abs(fileAmp)
-            }
-            
-            /* Read waveform data and store in buffer */
-            res = fread(waveform_buf, sizeof(int16_t), lSize, file); // lSize:num_bytes
-            if(res != lSize/2){
-              fclose(file);
-              free(waveform_buf);
-              fprintf(stdout, "Failed to read file into buffer -- res: %ld, lSize: %ld\n", res, lSize);
-              exit(-1);
-            } else {
-              fclose(file);
-              printf("File %s successfully opened, waveform size is %ld points\n", optarg, lSize/2);
-            }
-            
-            /* Normalize and fit the waveform */
-            if(fitWaveform){
-              if(usingCustomAmp){
-                waveAmplitude = customAmp;
-                if(debug) printf("using custom amp: %d, waveamp: %d\n", customAmp, waveAmplitude);
-              } else {
-                waveAmplitude = fileAmp;
-                if(debug) printf("using amp read from file: %d, waveamp: %d\n", fileAmp, waveAmplitude);
-              }
-              /* Have to hack the shitty output of TTi's waveform editor */
-              int i;
-              uint16_t temp;
-              double fTemp;
-              for(i=0; i<lSize/2; i++){
-                /* Amplitude goes from -8192 to +8192, but -8192 is 0 in the generator
-                 * only the 14 LSB bits are used.
-                 * */
-                fTemp = (double) waveform_buf[i] / (double) waveAmplitude;
-                fTemp *= genAmplitude;
-                (fTemp >= 0) ? (fTemp+=0.5) : (fTemp-=0.5); // Rounding
-                fTemp += genAmplitude;
-    //            printf("%f ",fTemp);
-                //printf("%d ",(int16_t)fTemp);
-                temp = (uint16_t) fTemp;
-                waveform_buf[i] = temp & 0x7fff;
-              }
-            }
+            fileNameIn = optarg;
          } else {
             printf("File defined but command is not ARBx <bin>, no waveform will be loaded to the function generator\n");
             wf=false;
@@ -377,11 +920,152 @@ static int parse_options(int argc, char *argv[])
 				exit(0);
 				break;
   
+      /* Run script */
+			case 'S':
+				scriptFileName = optarg;
+				config.mode = MODE_SCRIPT;
+				break;
+
+      /* Configure pipeline depth */
+			case 'P':
+				pipelineDepth = atoi(optarg);
+				if (pipelineDepth < 1)
+				{
+					ERROR("Pipeline depth must be at least 1\n");
+					exit(1);
+				}
+				break;
+
       /* Discover devices */
 			case 'd':
 				config.mode = MODE_DISCOVERY;
 				break;
 
+      /* Discovery early exit */
+			case OPT_EXPECT:
+				config.expect = atoi(optarg);
+				break;
+
+			case OPT_IDLE:
+				config.idle = atoi(optarg);
+				break;
+
+      /* Inventory */
+			case OPT_INVENTORY:
+				config.mode = MODE_INVENTORY;
+				break;
+
+			case OPT_ALIAS:
+				aliasName = optarg;
+				break;
+
+			case OPT_CACHE_TTL:
+				cacheTtl = atoi(optarg);
+				break;
+
+      /* Connection broker */
+			case OPT_DAEMON:
+				config.mode = MODE_DAEMON;
+				daemonPath = optarg;
+				break;
+
+			case OPT_BROKER:
+				brokerPath = optarg ? optarg : broker_path();
+				break;
+
+      /* Periodic measurement */
+			case OPT_POLL:
+				config.mode = MODE_POLL;
+				pollQuery = optarg;
+				break;
+
+			case OPT_RATE:
+				pollRate = atof(optarg);
+				if (!(pollRate > 0))
+				{
+					ERROR("Rate must be above 0\n");
+					exit(1);
+				}
+				break;
+
+			case OPT_LOG:
+				logFileName = optarg;
+				break;
+
+			case OPT_SAMPLES:
+				pollSamples = atol(optarg);
+				if (pollSamples < 1)
+				{
+					ERROR("Sample count must be at least 1\n");
+					exit(1);
+				}
+				break;
+
+      /* Dump statistics at exit */
+			case OPT_STATS:
+				if (optarg == NULL || strcmp(optarg, "json") == 0)
+					statsFormat = STATS_JSON;
+				else if (strcmp(optarg, "openmetrics") == 0)
+					statsFormat = STATS_OPENMETRICS;
+				else
+				{
+					ERROR("Unknown statistics format: %s\n", optarg);
+					exit(1);
+				}
+				showStats = true;
+				break;
+
+      /* Instrument protocol */
+			case OPT_TRANSPORT:
+				if (strcmp(optarg, "raw") == 0)
+					transport = LXI_RAW;
+				else if (strcmp(optarg, "vxi11") == 0)
+					transport = LXI_VXI11;
+				else if (strcmp(optarg, "hislip") == 0)
+					transport = LXI_HISLIP;
+				else
+				{
+					ERROR("Unknown transport: %s\n", optarg);
+					exit(1);
+				}
+				break;
+
+      /* Check every command */
+			case OPT_SYNC:
+				if (optarg == NULL || strcmp(optarg, "err") == 0)
+					syncMode = SYNC_ERR;
+				else if (strcmp(optarg, "esr") == 0)
+					syncMode = SYNC_ESR;
+				else if (strcmp(optarg, "opc") == 0)
+					syncMode = SYNC_OPC;
+				else
+				{
+					ERROR("Unknown check: %s\n", optarg);
+					exit(1);
+				}
+				break;
+
+      /* Resample the waveform */
+			case OPT_POINTS:
+				targetPoints = strtoul(optarg, NULL, 10);
+				if (targetPoints < 2 || targetPoints > MAX_WF_BUFFER/2)
+				{
+					ERROR("--points must be between 2 and %d\n", MAX_WF_BUFFER/2);
+					exit(1);
+				}
+				break;
+
+      /* Waveform set */
+			case OPT_ARB:
+				add_arb_slot(optarg);
+				config.mode = MODE_ARBSET;
+				break;
+
+      /* Upload unconditionally */
+			case OPT_FORCE:
+				forceUpload = true;
+				break;
+
       /* Print help */
 			case 'h':
 				print_help();
@@ -397,13 +1081,106 @@ static int parse_options(int argc, char *argv[])
 		}
 	}
 
+	/* Look up --device in the inventory, the first target is used when
+	 * there is only one */
+	resolve_targets();
+
+	if (wf && config.mode == MODE_ARBSET)
+	{
+		ERROR("--arb can not be combined with --file\n");
+		exit(1);
+	}
+	if (wf)
+		load_waveform(fileNameIn);
+
+	/* Use a running broker, which only relays raw sockets */
+	if (brokerPath != NULL && transport != LXI_RAW)
+	{
+		ERROR("The broker only supports the raw transport\n");
+		exit(1);
+	}
+	if (brokerPath == NULL && transport == LXI_RAW &&
+			getenv("LXI_CONTROL_BROKER") != NULL)
+	{
+		brokerPath = getenv("LXI_CONTROL_BROKER");
+		if (*brokerPath == 0)
+			brokerPath = broker_path();
+	}
+
+	/* Name the device */
+	if (aliasName != NULL)
+	{
+		if (targetCount > 1)
+		{
+			ERROR("--alias needs a single device\n");
+			exit(1);
+		}
+		alias_device(aliasName);
+	}
+
 	/* Check that --ip is set */
-	if ((config.ip == NULL) && (config.mode == MODE_NORMAL))
+	if ((config.ip == NULL) && (config.mode != MODE_DISCOVERY) &&
+			(config.mode != MODE_INVENTORY) && (config.mode != MODE_DAEMON) &&
+			(aliasName == NULL))
 	{
 		ERROR("Missing option: --ip\n");
 		exit(1);
 	}
 
+	/* Check that --scpi is set */
+	if ((config.command == NULL) && (config.mode == MODE_NORMAL))
+	{
+		/* Only naming a device is fine */
+		if (aliasName != NULL)
+			exit(0);
+		ERROR("Missing option: --scpi\n");
+		exit(1);
+	}
+
+	/* Same command to all devices */
+	if (targetCount > 1 && config.mode == MODE_NORMAL)
+	{
+		if (getWaveData)
+		{
+			ERROR("Waveforms can only be read from a single device\n");
+			exit(1);
+		}
+		config.mode = MODE_FANOUT;
+	}
+	if (targetCount > 1 && config.mode == MODE_SCRIPT)
+	{
+		ERROR("Scripts can only be run on a single device\n");
+		exit(1);
+	}
+	if (targetCount > 1 && config.mode == MODE_ARBSET)
+	{
+		ERROR("Waveform sets can only be loaded on a single device\n");
+		exit(1);
+	}
+	if (syncMode != SYNC_OFF &&
+			(config.mode == MODE_FANOUT || config.mode == MODE_POLL))
+	{
+		ERROR("--sync needs a single device and can not be used with --poll\n");
+		exit(1);
+	}
+	if (targetCount > 1 && config.mode == MODE_POLL)
+	{
+		ERROR("Only a single device can be polled\n");
+		exit(1);
+	}
+	if (transport != LXI_RAW && (config.mode == MODE_FANOUT ||
+			config.mode == MODE_DISCOVERY || config.mode == MODE_DAEMON))
+	{
+		ERROR("The %s transport needs a single device\n",
+				transport == LXI_VXI11 ? "vxi11" : "hislip");
+		exit(1);
+	}
+	if ((logFileName == NULL) && (config.mode == MODE_POLL))
+	{
+		ERROR("Missing option: --log\n");
+		exit(1);
+	}
+
 	/* Print any remaining command line arguments (invalid options). */
 	if (optind < argc)
 	{
@@ -413,222 +1190,647 @@ static int parse_options(int argc, char *argv[])
 		ERROR("\n");
 		exit(1);
 	}
+
+	/* Only runs which got past the options are reported */
+	if (showStats)
+		atexit(print_stats);
+}
+
+/* Dump the statistics of the run, registered with atexit() by --stats */
+static void print_stats(void)
+{
+	if (session != NULL)
+		stats_session(lxi_stats(session));
+	fflush(stdout);
+	stats_print(stderr, statsFormat);
 }
 
 static int disconnect_instrument(void)
 {
-	/* Close socket */
-	if(close(config.socket)==ERR)
-	{
-		ERROR("Error closing socket\n");
-		exit(3);
-	}
-	
+	stats_session(lxi_stats(session));
+	lxi_close(session);
+	session = NULL;
+
 	return 0;
 }
 
 static int connect_instrument(void)
 {
-	int retval = 0;
-	struct sockaddr_in recv_addr = { 0 };
-	int state_nodelay = NET_NODELAY;
-	struct timeval tv;
-	
-	/* Create socket */
-	config.socket = socket(PF_INET,SOCK_STREAM,0);
-	
-	if(config.socket == ERR)
+	stats_start(PHASE_CONNECT);
+	/* Other transports have their own default port */
+	session = lxi_open_addrs((const char *const *) config.addrs,
+			config.addrCount,
+			transport != LXI_RAW && !portSet ? 0 : config.port, transport,
+			brokerPath, config.timeout * 1000,
+			connectTimeout ? connectTimeout : config.timeout * 1000);
+	if (session == NULL)
 	{
-		ERROR("Error connecting socket: %s\n",strerror(errno));
+		ERROR("Out of memory\n");
 		exit(3);
 	}
 
-	/* Set socket options - TCP */
-	setsockopt(config.socket, IPPROTO_TCP, TCP_NODELAY,
-				(void *)&state_nodelay,sizeof state_nodelay);
-
-	/* Set socket options - timeout */
-	tv.tv_sec = config.timeout;
-	tv.tv_usec = 0;
-	if ((setsockopt(config.socket, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv))) == ERR)
+	/* Establish connection */
+	lxi_wait(session, 0);
+	stats_stop(PHASE_CONNECT);
+	if (lxi_status(session) != LXI_OK)
 	{
-		perror("setsockopt - SO_RCVTIMEO");
-		exit(3);
+		ERROR("%s\n", lxi_error(session));
+		return ERR;
 	}
 
-	/* Receivers address */
-	memset(&recv_addr,0,sizeof(struct sockaddr_in));
-	recv_addr.sin_family=PF_INET;			// IPv4
-	recv_addr.sin_port=htons(config.port);
-	inet_aton(config.ip, &recv_addr.sin_addr);	// IP Address
-
-	/* Establish TCP connection */
-	retval = connect(config.socket,(struct sockaddr *)&recv_addr,
-						sizeof(struct sockaddr_in));
-	if(retval == ERR)
-	{
-		ERROR("Error establishing TCP connection: %s\n",strerror(errno)); // FIXME
-	}
-	return retval;
-}
-
-static int send_command(void)
-{
-	int retval = 0;
-  int c;
-  if(debug) printf("send_command\n");
-  if(!wf){
-    /* Add <LF> to end of command, this is required by the function generator */
-    char * newBuff = (char*) calloc(1,strlen(config.command)+1+1); /* make room for one LF and NULL*/
-    strcpy(newBuff, config.command);
-    strcat(newBuff, "\n");
-    config.command = newBuff;
-//    free(newBuff);
-  	/* Send SCPI command */
-	  retval = send(config.socket,config.command,strlen(config.command),0);
-    if(debug) printf("strlen: %ld\n", strlen(config.command));
-	  if (retval == ERR) {
-		  ERROR("Error sending SCPI command\n");
-		  exit(3);
-	  }
-  // Waveform loading
-  } else {
-    if(debug) printf("else\n");
-    int h_num; /* Storing number of chars in the size */
-    int h_size;
-    h_num = snprintf(NULL, 0, "%ld", lSize); /*Count chars in lSize*/
-    if(debug) printf("h_num: %d\n", h_num);
-    char * header = (char *) calloc(1, 3+h_num+1); /* <space>+#+number of chars to follow + h_num + 0 */
-    h_size = sprintf(header, " #%d%ld", h_num, lSize); /*Assemble header, space between command and data is defined here*/
-    if(debug) printf("h_size: %d, header: %s\n", h_size, header);
-
-
-    char * newBuff = (char*) calloc(1,strlen(config.command)+1); /* make room for one NULL*/
-    strcpy(newBuff, config.command);
-    config.command = newBuff;
-    //printf("starting conversion\n");
-	  retval = send(config.socket,config.command,strlen(config.command),0);
-	  if (retval == ERR) {
-		  ERROR("Error sending SCPI command\n");
-		  exit(3);
-	  }
-    if(debug) printf("command: %s, retval=%d\n", config.command, retval);
-    /* Send header */
-	  retval = send(config.socket,header,h_size,0);
-	  if (retval == ERR) {
-		  ERROR("Error sending SCPI command\n");
-		  exit(3);
-	  }
-    if(debug) printf("header:%s, retval=%d, h_size=%d\n", header, retval, h_size);
-
-    /*Send bytes*/
-    if(debug) printf("sizeof(waveform_buf) size: %ld, lSize: %ld\n", sizeof(waveform_buf), lSize);
-    if(debug) printf("sizeof(uint32_t): %ld\n", sizeof(uint32_t));
-    if(debug) printf("sizeof(uint32_t)*lSize: %ld\n", sizeof(uint32_t)*lSize);
-	 // retval = send(config.socket,waveform_buf,sizeof(uint32_t)*lSize/4,0);
-	  //retval = send(config.socket,et_wave_buf,lSize,0);
-
-    /*Convert to network order*/
-    int g;
-    int16_t temp;
-    for(g=0; g<lSize/2; g++){
-      temp = (waveform_buf[g]<<8)&0xff00;
-      temp |= (waveform_buf[g]>>8)&0xff;
-      waveform_buf[g]=temp;
-    }
-	  retval = send(config.socket,waveform_buf,lSize,0);
-	  if (retval == ERR) {
-      printf("Error\n");
-		  ERROR("Error sending SCPI command\n");
-		  exit(3);
-	  }
-    if(debug) printf("waveform_buf: retval=%d\n", retval);
-
-    /*Send LF*/
-    char LF[2] = {'\n','\0'};
-	  retval = send(config.socket,LF,strlen(LF),0);
-	  if (retval == ERR) {
-		  ERROR("Error sending SCPI command\n");
-		  exit(3);
-	  }
-    if(debug) printf("LF: %s, retval=%d\n", LF, retval);
-
-  }
-	return retval;
+	/* Errors left by earlier runs would be taken for ours. This clears the
+	 * status for everyone, see --sync in the man page. */
+	if (syncMode == SYNC_ERR || syncMode == SYNC_ESR)
+		lxi_write(session, "*CLS", NULL, NULL);
+	return 0;
 }
 
-static int receive_response(char ** response)
+/* Wait until at most pending requests are outstanding, exits on errors */
+static void wait_instrument(int pending)
 {
-	char buffer[189500];
-	int length;
-	int i, question = 0;
-	fd_set rset;
-	int ret;
-	struct timespec t;
-	
-	/* Skip receive if no '?' in command */
-	for (i=0; i<strlen(config.command);i++)
+	int status;
+
+	status = lxi_wait(session, pending);
+	if (status != LXI_OK)
 	{
-		if (config.command[i] == '?')
-			question=1;
+		ERROR("%s\n", lxi_error(session));
+		exit(status);
 	}
-	if (question == 0)
-		return 0;
+}
 
-	/* The device do not return any data if command send is wrong. If no
-	 * data recived until the specified timeout, exit. */	
-	FD_ZERO(&rset);
-	FD_SET(config.socket, &rset);
-	t.tv_sec=config.timeout; t.tv_nsec=0;
-	ret=pselect(config.socket+1, &rset, NULL, NULL, &t, NULL);
-	if(ret == -1) {
-		ERROR("Error reading response: %s\n",strerror(errno));
-		exit(3);
-	}
+/* Print a response, nothing for a query the device did not answer */
+static void print_response(lxi_session_t *s, int status, const char *response,
+		size_t length, void *ctx)
+{
+	if (status == LXI_OK && response != NULL)
+		printf("%s\n", response);
+}
 
-	if(!ret) {
-		INFO("Timeout waiting for response\n");
-		exit(2);
+/* Whether a line answers a query, rather than being the error queue entry
+ * read by the SYST:ERR? check queued after it, like -113,"Undefined header".
+ * Only negative SCPI error codes and 0 are taken for an entry, so answers
+ * like 3,"name" still go to the query. */
+static int query_answered(const char *response, size_t length, void *ctx)
+{
+	const char *p = response;
+
+	if (p[0] == '-' && isdigit((unsigned char) p[1]))
+	{
+		while (isdigit((unsigned char) *++p));
 	}
-  /* Read response */
-  if((length=recv(config.socket,&buffer[0],189500,0))==ERR)
-  {
-    ERROR("Error reading response: %s\n",strerror(errno));
-    exit(3);
-  }
-  printf("length: %d\n", length);
-  
-  /* Add zero character (C string) */
-  buffer[length]=0;
-  //response = calloc(length, sizeof(char));
-  if(*response != NULL) *response = *&buffer;
-  //memcpy(response, buffer, length);
-  /* Print received data */
-  if(buffer != NULL)
-    printf("%s",buffer);
-  
-  return 0;
+	else if (p[0] == '0' && !isdigit((unsigned char) p[1]))
+		p++;
+	else
+		return 1;
+	while (*p == ' ')
+		p++;
+	if (*p++ != ',')
+		return 1;
+	while (*p == ' ')
+		p++;
+	return *p != '"';
 }
 
-static int discover_instruments(void)
+/* Whether command reads the error queue itself */
+static bool is_error_query(const char *command)
 {
-	int sockfd;
-	struct sockaddr_in send_addr;
-	struct sockaddr_in recv_addr;
-	int broadcast = 1;
+	const char *node = strchr(command, ':');
+
+	return strncasecmp(command, "SYST", 4) == 0 && node != NULL &&
+		strncasecmp(node + 1, "ERR", 3) == 0;
+}
+
+/* Response of the --sync check, ctx is the label of the checked commands */
+static void sync_done(lxi_session_t *s, int status, const char *response,
+		size_t length, void *ctx)
+{
+	static const char *esrErrors[] = { "query error",
+		"device-dependent error", "execution error", "command error" };
+	char *label = ctx;
+	char text[128] = "";
+	long value;
+	int bit;
+
+	if (status == LXI_OK && response != NULL)
+	{
+		value = strtol(response, NULL, 10);
+		if (syncMode == SYNC_ERR && value != 0)
+		{
+			ERROR("%s: %s\n", label, response);
+			syncStatus = 1;
+		}
+		else if (syncMode == SYNC_ESR && (value & ESR_ERRORS))
+		{
+			for (bit = 2; bit <= 5; bit++)
+				if (value & (1 << bit))
+					snprintf(text + strlen(text), sizeof(text) - strlen(text),
+							"%s%s", *text ? ", " : "", esrErrors[bit - 2]);
+			ERROR("%s: %s (*ESR? %ld)\n", label, text, value);
+			syncStatus = 1;
+		}
+	}
+	free(label);
+}
+
+/* Queue the --sync check of the commands sent since the last one, label
+ * names them in error messages */
+static void sync_check(const char *label)
+{
+	char *copy;
+
+	if (syncMode == SYNC_OFF || !syncPending)
+		return;
+	copy = strdup(label);
+	if (copy == NULL)
+	{
+		ERROR("Out of memory\n");
+		exit(3);
+	}
+	lxi_query(session, syncQuery[syncMode], sync_done, copy);
+	syncPending = false;
+}
+
+/* Queue config.command, or the upload of the loaded waveform with it. The
+ * response of a query is printed when it arrives. With --sync=err a query
+ * is followed by its check right away, which reads the error in place of
+ * the response if the device rejects it; label names the query then. */
+static int send_command(const char *label)
+{
+	int status;
+
+	if(debug) printf("send_command: %s\n", config.command);
+	if (wf)
+	{
+		/* waveform_buf is already in network order */
+		syncPending = true;
+		return lxi_write_block(session, config.command, waveform_buf, lSize,
+				NULL, NULL);
+	}
+	if (strchr(config.command, '?') == NULL)
+	{
+		syncPending = true;
+		return lxi_write(session, config.command, NULL, NULL);
+	}
+	/* The response of other checks can not be told from that of the query */
+	if (syncMode != SYNC_ERR || is_error_query(config.command))
+		return lxi_query(session, config.command, print_response, NULL);
+	syncPending = true;
+	status = lxi_query_optional(session, config.command, query_answered,
+			print_response, NULL);
+	sync_check(label);
+	return status;
+}
+
+/* Microseconds passed since t */
+static long elapsed_us(const struct timespec *t)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - t->tv_sec) * 1000000L +
+		(now.tv_nsec - t->tv_nsec) / 1000;
+}
+
+static void probe_finish(probe_t *probe, int epfd, int status, probe_done_t done)
+{
+	if (probe->fd != ERR)
+	{
+		epoll_ctl(epfd, EPOLL_CTL_DEL, probe->fd, NULL);
+		close(probe->fd);
+		probe->fd = ERR;
+	}
+	probe->state = PROBE_DONE;
+	probe->status = status;
+	done(probe);
+	free(probe->response);
+	probe->response = NULL;
+	probe->size = 0;
+}
+
+/* Address of a numeric IPv4 or IPv6 ip, returns -1 if it is not valid */
+static int ip_address(const char *ip, unsigned int port,
+		struct sockaddr_storage *addr, socklen_t *length)
+{
+	struct addrinfo hints = { 0 }, *result;
+	char service[8];
+
+	hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV;
+	hints.ai_socktype = SOCK_STREAM;
+	snprintf(service, sizeof(service), "%u", port);
+	if (getaddrinfo(ip, service, &hints, &result) != 0)
+		return ERR;
+	memcpy(addr, result->ai_addr, result->ai_addrlen);
+	*length = result->ai_addrlen;
+	freeaddrinfo(result);
+	return 0;
+}
+
+/* Start a non-blocking connect, returns -1 if the probe failed at once */
+static int probe_start(probe_t *probe, int epfd)
+{
+	struct sockaddr_storage addr;
+	struct sockaddr_un local = { 0 };
+	struct sockaddr *to = (struct sockaddr *)&addr;
+	socklen_t to_length;
+	struct epoll_event ev = { 0 };
+	int state_nodelay = NET_NODELAY;
+
+	probe->hello_length = 0;
+	probe->accepted = false;
+	if (probe->broker != NULL)
+	{
+		/* The request follows the CONNECT line to the broker */
+		probe->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+		if (probe->fd == ERR || strlen(probe->broker) >= sizeof(local.sun_path))
+			return ERR;
+		local.sun_family = AF_UNIX;
+		strcpy(local.sun_path, probe->broker);
+		to = (struct sockaddr *)&local;
+		to_length = sizeof(local);
+		probe->hello_length = sprintf(probe->hello, "CONNECT %s %u\n",
+				probe->ip, probe->port);
+	}
+	else
+	{
+		if (ip_address(probe->ip, probe->port, &addr, &to_length) == ERR)
+			return ERR;
+		probe->fd = socket(addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+		if (probe->fd == ERR)
+			return ERR;
+		setsockopt(probe->fd, IPPROTO_TCP, TCP_NODELAY,
+				(void *)&state_nodelay, sizeof state_nodelay);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &probe->start);
+	if (connect(probe->fd, to, to_length) == ERR && errno != EINPROGRESS)
+		return ERR;
+
+	probe->state = PROBE_CONNECTING;
+	probe->sent = 0;
+	probe->received = 0;
+	ev.events = EPOLLOUT;
+	ev.data.ptr = probe;
+	return epoll_ctl(epfd, EPOLL_CTL_ADD, probe->fd, &ev);
+}
+
+/* Connect to the next address of the probe after a failed or timed out
+ * connect, returns -1 if none is left */
+static int probe_next(probe_t *probe, int epfd)
+{
+	while (probe->addr_next < probe->addr_count)
+	{
+		if (probe->fd != ERR)
+		{
+			epoll_ctl(epfd, EPOLL_CTL_DEL, probe->fd, NULL);
+			close(probe->fd);
+			probe->fd = ERR;
+		}
+		snprintf(probe->ip, sizeof(probe->ip), "%s",
+				probe->addrs[probe->addr_next++]);
+		if(debug) printf("%s: trying %s\n", probe->name, probe->ip);
+		if (probe_start(probe, epfd) == 0)
+			return 0;
+	}
+	return ERR;
+}
+
+/* Advance a probe whose socket is ready */
+static void probe_event(probe_t *probe, int epfd, probe_done_t done)
+{
+	struct epoll_event ev = { 0 };
+	int error = 0;
+	socklen_t len = sizeof(error);
+	ssize_t length;
+	size_t size, scanned;
+	char *lf, *response;
+
+	switch (probe->state)
+	{
+		case PROBE_CONNECTING:
+			getsockopt(probe->fd, SOL_SOCKET, SO_ERROR, &error, &len);
+			if (error != 0)
+			{
+				if(debug) printf("%s: %s\n", probe->ip, strerror(error));
+				if (probe_next(probe, epfd) == 0)
+					return;
+				probe_finish(probe, epfd, 2, done);
+				return;
+			}
+			probe->state = PROBE_SENDING;
+			/* Fall through */
+
+		case PROBE_SENDING:
+			if (probe->sent < probe->hello_length)
+				length = send(probe->fd, probe->hello + probe->sent,
+						probe->hello_length - probe->sent, MSG_NOSIGNAL);
+			else
+				length = send(probe->fd,
+						probe->request + probe->sent - probe->hello_length,
+						probe->hello_length + probe->request_length - probe->sent,
+						MSG_NOSIGNAL);
+			if (length == ERR)
+			{
+				if (errno != EAGAIN)
+					probe_finish(probe, epfd, 3, done);
+				return;
+			}
+			probe->sent += length;
+			if (probe->sent < probe->hello_length + probe->request_length)
+				return;
+			/* Through the broker the request may only be queued yet, wait
+			 * for its OK */
+			if (!probe->reply && probe->hello_length == 0)
+			{
+				probe_finish(probe, epfd, 0, done);
+				return;
+			}
+			probe->state = PROBE_RECEIVING;
+			ev.events = EPOLLIN;
+			ev.data.ptr = probe;
+			epoll_ctl(epfd, EPOLL_CTL_MOD, probe->fd, &ev);
+			return;
+
+		case PROBE_RECEIVING:
+			/* Double the response buffer when it is full, a response at
+			 * the limit is cut off */
+			if (probe->received + 1 >= probe->size)
+			{
+				if (probe->size >= LXI_MAX_RESPONSE)
+				{
+					probe->rtt = elapsed_us(&probe->start);
+					probe_finish(probe, epfd, 0, done);
+					return;
+				}
+				size = probe->size ? probe->size * 2 : NET_MAX_BUF;
+				response = realloc(probe->response, size);
+				if (response == NULL)
+				{
+					probe_finish(probe, epfd, 3, done);
+					return;
+				}
+				probe->response = response;
+				probe->size = size;
+			}
+			length = recv(probe->fd, probe->response + probe->received,
+					probe->size - 1 - probe->received, 0);
+			if (length == ERR)
+			{
+				if (errno != EAGAIN)
+					probe_finish(probe, epfd, 3, done);
+				return;
+			}
+			if (length == 0)
+			{
+				probe_finish(probe, epfd, 2, done);
+				return;
+			}
+			scanned = probe->received;
+			probe->received += length;
+			probe->response[probe->received] = 0;
+
+			/* The broker answers OK or ERR <status> before any instrument
+			 * data */
+			if (probe->hello_length > 0 && !probe->accepted)
+			{
+				lf = strchr(probe->response, '\n');
+				if (lf == NULL)
+					return;
+				*lf = 0;
+				if (strcmp(probe->response, "OK") != 0)
+				{
+					error = 2;
+					sscanf(probe->response, "ERR %d", &error);
+					probe_finish(probe, epfd, error, done);
+					return;
+				}
+				probe->accepted = true;
+				probe->received -= lf + 1 - probe->response;
+				memmove(probe->response, lf + 1, probe->received + 1);
+				scanned = 0;
+				if (!probe->reply)
+				{
+					probe_finish(probe, epfd, 0, done);
+					return;
+				}
+			}
+
+			/* Only the new data can hold the LF */
+			lf = memchr(probe->response + scanned, '\n',
+					probe->received - scanned);
+			if (lf != NULL)
+			{
+				*lf = 0;
+				probe->rtt = elapsed_us(&probe->start);
+				probe_finish(probe, epfd, 0, done);
+			}
+			return;
+	}
+}
+
+/* Send the request of each probe to its instrument over non-blocking
+ * connections driven by one epoll loop. At most parallel probes run at a
+ * time and each must be done within timeout seconds of its start; probes
+ * taking longer get status 2. Probes with more addresses move on to the
+ * next one when a connect fails or takes connect_timeout. done is called as
+ * each probe finishes. Returns the highest status of all probes. */
+static int run_probes(probe_t *probes, int count, int parallel, int timeout,
+		probe_done_t done)
+{
+	struct epoll_event events[64];
+	int epfd;
+	int next = 0, running = 0, finished = 0;
+	int status = 0;
+	int i, n;
+	long remaining, age;
+
+	epfd = epoll_create1(0);
+	if (epfd == ERR)
+	{
+		ERROR("Error creating epoll instance: %s\n", strerror(errno));
+		exit(3);
+	}
+	for (i = 0; i < count; i++)
+		probes[i].fd = ERR;
+
+	while (finished < count)
+	{
+		/* Keep up to parallel probes running */
+		while (next < count && running < parallel)
+		{
+			clock_gettime(CLOCK_MONOTONIC, &probes[next].begin);
+			if (probe_start(&probes[next], epfd) == ERR &&
+					probe_next(&probes[next], epfd) == ERR)
+			{
+				probe_finish(&probes[next], epfd, 2, done);
+				finished++;
+			}
+			else
+				running++;
+			next++;
+		}
+		if (running == 0)
+			continue;
+
+		/* Expire probes out of time and wait for the next one to expire */
+		remaining = timeout * 1000L;
+		for (i = 0; i < next; i++)
+		{
+			if (probes[i].state == PROBE_DONE)
+				continue;
+			/* A connect taking connect_timeout moves on to the next address */
+			if (probes[i].state == PROBE_CONNECTING &&
+					probes[i].connect_timeout > 0)
+			{
+				age = elapsed_us(&probes[i].start) / 1000;
+				if (age >= probes[i].connect_timeout &&
+						probe_next(&probes[i], epfd) == ERR)
+				{
+					probe_finish(&probes[i], epfd, 2, done);
+					running--;
+					finished++;
+					continue;
+				}
+				age = elapsed_us(&probes[i].start) / 1000;
+				if (probes[i].connect_timeout - age < remaining)
+					remaining = probes[i].connect_timeout - age;
+			}
+			age = elapsed_us(&probes[i].begin) / 1000;
+			if (age >= timeout * 1000L)
+			{
+				probe_finish(&probes[i], epfd, 2, done);
+				running--;
+				finished++;
+			}
+			else if (timeout * 1000L - age < remaining)
+				remaining = timeout * 1000L - age;
+		}
+		if (running == 0)
+			continue;
+
+		n = epoll_wait(epfd, events, 64, remaining);
+		if (n == ERR && errno != EINTR)
+		{
+			ERROR("Error waiting for instruments: %s\n", strerror(errno));
+			exit(3);
+		}
+		for (i = 0; i < n; i++)
+		{
+			probe_t *probe = events[i].data.ptr;
+
+			probe_event(probe, epfd, done);
+			if (probe->state == PROBE_DONE)
+			{
+				running--;
+				finished++;
+			}
+		}
+	}
+
+	for (i = 0; i < count; i++)
+		if (probes[i].status > status)
+			status = probes[i].status;
+	close(epfd);
+
+	return status;
+}
+
+/* Remember an instrument which answered *IDN? in the inventory */
+static void inventory_done(probe_t *probe)
+{
+	inventory_entry_t *entry;
+
+	if (probe->status != 0)
+		return;
+	entry = inventory_update(&inventory, probe->ip, probe->port);
+	if (entry == NULL)
+		return;
+	entry->seen = time(NULL);
+	entry->rtt = probe->rtt;
+	strncpy(entry->idn, probe->response, sizeof(entry->idn) - 1);
+	entry->dirty = true;
+}
+
+/* Print the *IDN? response of a discovered instrument */
+static void discover_done(probe_t *probe)
+{
+	if (probe->status == 0)
+		INFO("IP %s  -  %s\n", probe->ip, probe->response);
+	else if(debug)
+		printf("IP %s  -  no response\n", probe->ip);
+	inventory_done(probe);
+}
+
+/* Directed broadcast addresses of all IPv4 interfaces which are up. The
+ * limited broadcast address is used if there are none. */
+static int broadcast_addresses(struct in_addr **list)
+{
+	struct ifaddrs *ifaddr, *ifa;
+	int count = 0;
+
+	if (getifaddrs(&ifaddr) == ERR)
+	{
+		perror("getifaddrs");
+		exit(3);
+	}
+
+	for (ifa = ifaddr; ifa != NULL; ifa = ifa->ifa_next)
+	{
+		if (ifa->ifa_addr == NULL || ifa->ifa_addr->sa_family != AF_INET)
+			continue;
+		if (!(ifa->ifa_flags & IFF_UP) || (ifa->ifa_flags & IFF_LOOPBACK) ||
+				!(ifa->ifa_flags & IFF_BROADCAST) ||
+				ifa->ifa_broadaddr == NULL)
+			continue;
+
+		*list = realloc(*list, (count + 1) * sizeof(struct in_addr));
+		(*list)[count++] =
+			((struct sockaddr_in *)ifa->ifa_broadaddr)->sin_addr;
+		if(debug) printf("broadcast on %s: %s\n", ifa->ifa_name, inet_ntoa((*list)[count-1]));
+	}
+	freeifaddrs(ifaddr);
+
+	if (count == 0)
+	{
+		*list = realloc(*list, sizeof(struct in_addr));
+		(*list)[count++].s_addr = inet_addr(BROADCAST_ADDR);
+	}
+	return count;
+}
+
+static int discover_instruments(void)
+{
+	int sockfd;
+	int epfd;
+	struct sockaddr_in send_addr;
+	struct sockaddr_in recv_addr;
+	struct epoll_event ev = { 0 };
+	struct epoll_event events[64];
+	struct in_addr *broadcast_list = NULL;
+	struct timespec start;
+	int broadcast = 1;
+	int broadcasts;
 	int count;
-	int addrlen;
+	socklen_t addrlen;
 	char buf[NET_MAX_BUF];
-	struct timeval tv;
-	struct in_addr ip_list[NET_MAX_NODES];
+	probe_t **probes = NULL;
 	int i = 0;
 	int j = 0;
+	int k, n;
+	int size = 0;
+	int running = 0;  /* Probes in progress */
+	int answered = 0; /* Probes which got an *IDN? response */
+	long now, wait;
+	long next_send = 0, interval = BROADCAST_RETRY;
+	long last_found = 0;
 	char idn_command[] = "*IDN?\n";
 
 	INFO("\nDiscovering LXI devices on hosts subnet - please wait...\n");
 
+	/* Answering devices are added to the inventory */
+	inventory_load(&inventory);
+
 	/* create a socket */
-	sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+	sockfd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
 	if (sockfd == -1)
 	{
 		perror("Socket creation error");
@@ -642,15 +1844,6 @@ static int discover_instruments(void)
 		perror("setsockopt - SO_SOCKET");
 		exit(3);
 	}
-	
-	/* Set socket options - timeout */
-	tv.tv_sec = config.timeout;
-	tv.tv_usec = 0;
-	if ((setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv))) == ERR)
-	{
-		perror("setsockopt - SO_RCVTIMEO");
-		exit(3);
-	}
 
 	/* Senders address */
 	send_addr.sin_family = AF_INET;
@@ -660,240 +1853,1319 @@ static int discover_instruments(void)
 	/* Bind socket to address */
 	bind(sockfd, (struct sockaddr*)&send_addr, sizeof(send_addr));
 
-	/* Receivers address */ 
-	recv_addr.sin_family = AF_INET;
-	recv_addr.sin_addr.s_addr = inet_addr(BROADCAST_ADDR);
-	recv_addr.sin_port = htons(BROADCAST_PORT);
+	broadcasts = broadcast_addresses(&broadcast_list);
 
-	/* Broadcast RPC GETPORT message */
-	sendto(sockfd, rpc_GETPORT_msg, sizeof(rpc_GETPORT_msg), 0, 
-			(struct sockaddr*)&recv_addr, sizeof(recv_addr));
+	/* The broadcast responses and the *IDN? probes of the responders are
+	 * all handled by one epoll loop */
+	epfd = epoll_create1(0);
+	if (epfd == ERR)
+	{
+		ERROR("Error creating epoll instance: %s\n", strerror(errno));
+		exit(3);
+	}
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, sockfd, &ev);
 
-	addrlen = sizeof(recv_addr);
+	INFO("\nDiscovered devices:\n");
 
-	/* Go through received responses */
-	do {
-		count = recvfrom(sockfd, buf, NET_MAX_BUF, 0, 
-					(struct sockaddr*)&recv_addr, &addrlen);
-		if (count > 0)
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while ((now = elapsed_us(&start) / 1000) < config.timeout * 1000L)
+	{
+		/* Broadcast RPC GETPORT message on all interfaces, repeated with
+		 * backoff in case a datagram is lost */
+		if (now >= next_send)
 		{
-			ip_list[i] = recv_addr.sin_addr;
-			i++;
+			for (j = 0; j < broadcasts; j++)
+			{
+				recv_addr.sin_family = AF_INET;
+				recv_addr.sin_addr = broadcast_list[j];
+				recv_addr.sin_port = htons(BROADCAST_PORT);
+				sendto(sockfd, rpc_GETPORT_msg, sizeof(rpc_GETPORT_msg), 0,
+						(struct sockaddr*)&recv_addr, sizeof(recv_addr));
+			}
+			next_send = now + interval;
+			interval *= 2;
+			if (interval > BROADCAST_RETRY_MAX)
+				interval = BROADCAST_RETRY_MAX;
 		}
-	} while (count > 0);
 
-	INFO("\nDiscovered devices:\n");
+		/* Early exit once the expected devices answered, or no new
+		 * device showed up for the idle time */
+		if (running == 0)
+		{
+			if (config.expect > 0 && answered >= config.expect)
+				break;
+			if (config.idle > 0 && i > 0 && now - last_found >= config.idle)
+				break;
+		}
 
-	/* Request SCPI IDN of responding hosts */
-	for (j=0; j<i; j++)
-	{
-		config.ip = inet_ntoa(ip_list[j]);
-		if (connect_instrument() == 0)
+		wait = next_send - now;
+		if (config.idle > 0 && i > 0 && last_found + config.idle - now < wait)
+			wait = last_found + config.idle - now;
+		if (config.timeout * 1000L - now < wait)
+			wait = config.timeout * 1000L - now;
+		if (wait < 0)
+			wait = 0;
+
+		n = epoll_wait(epfd, events, 64, wait);
+		if (n == ERR && errno != EINTR)
 		{
-			config.command = idn_command;
-			
-			send_command();
-			
-			INFO("IP %s  -  ", config.ip);
-		  
-			receive_response(NULL);
-		
-			disconnect_instrument();
+			ERROR("Error waiting for instruments: %s\n", strerror(errno));
+			exit(3);
+		}
+
+		for (j = 0; j < n; j++)
+		{
+			probe_t *probe = events[j].data.ptr;
+
+			/* Probe of a responder */
+			if (probe != NULL)
+			{
+				probe_event(probe, epfd, discover_done);
+				if (probe->state == PROBE_DONE)
+				{
+					running--;
+					if (probe->status == 0)
+						answered++;
+				}
+				continue;
+			}
+
+			/* Go through received responses */
+			addrlen = sizeof(recv_addr);
+			while ((count = recvfrom(sockfd, buf, NET_MAX_BUF, 0,
+						(struct sockaddr*)&recv_addr, &addrlen)) > 0)
+			{
+				/* Skip hosts which answered more than once */
+				for (k = 0; k < i; k++)
+					if (strcmp(probes[k]->ip, inet_ntoa(recv_addr.sin_addr)) == 0)
+						break;
+				if (k < i)
+					continue;
+
+				if (i == size)
+				{
+					size = size ? 2 * size : 64;
+					probes = realloc(probes, size * sizeof(probe_t *));
+					if (probes == NULL)
+					{
+						ERROR("Out of memory\n");
+						exit(3);
+					}
+				}
+				probe = calloc(1, sizeof(probe_t));
+				if (probe == NULL)
+				{
+					ERROR("Out of memory\n");
+					exit(3);
+				}
+				strcpy(probe->ip, inet_ntoa(recv_addr.sin_addr));
+				probe->port = config.port;
+				probe->request = idn_command;
+				probe->request_length = strlen(idn_command);
+				probe->reply = true;
+				probes[i++] = probe;
+				last_found = elapsed_us(&start) / 1000;
+
+				/* Request SCPI IDN of the responder right away */
+				if (probe_start(probe, epfd) == ERR)
+					probe_finish(probe, epfd, 2, discover_done);
+				else
+					running++;
+			}
 		}
 	}
 
+	/* Out of time */
+	for (j = 0; j < i; j++)
+	{
+		if (probes[j]->state != PROBE_DONE)
+			probe_finish(probes[j], epfd, 2, discover_done);
+		free(probes[j]);
+	}
+	close(epfd);
+	close(sockfd);
+
 	INFO("\n");
 
+	if (inventory_save(&inventory) == ERR && debug)
+		printf("Could not save inventory: %s\n", strerror(errno));
+
+	free(probes);
+	free(broadcast_list);
+
 	return 0;
 }
 
-static int receive_waveform(wf_info_t wf_info)
+/* Continue in a child detached from the terminal and the parent, which
+ * returns false at once */
+static bool detach(void)
 {
-	int i, question = 0;
-	fd_set rset;
-	int ret;
-  long length;
-	struct timespec t;
-//  int h_num = snprintf(NULL, 0, "%d", nBytes); /*Count chars in nBytes*/
-  int h_num = snprintf(NULL, 0, "%d", wf_info.nBytes); /*Count chars in nBytes*/
-  int header = 1+1+h_num; /* #+N+nBytes */
-  int totalBytes = header+wf_info.nBytes; /* #+N+nBytes+data */
-  int bytesLeft = totalBytes;
-	/* Skip receive if no '?' in command */
-	for (i=0; i<strlen(config.command);i++)
+	pid_t pid;
+	int fd;
+
+	fflush(stdout);
+	pid = fork();
+	if (pid != 0)
 	{
-		if (config.command[i] == '?')
-			question=1;
+		/* Reap the intermediate child */
+		if (pid > 0)
+			waitpid(pid, NULL, 0);
+		return false;
 	}
-	if (question == 0)
-		return 0;
+	if (fork() != 0)
+		_exit(0);
+
+	setsid();
+	fd = open("/dev/null", O_RDWR);
+	dup2(fd, STDIN_FILENO);
+	dup2(fd, STDOUT_FILENO);
+	dup2(fd, STDERR_FILENO);
+	return true;
+}
+
+/* Probe all inventory entries not seen for cacheTtl seconds again. This is
+ * done by a detached process, so the current run is not delayed; the next
+ * run finds the updated inventory. */
+static void revalidate_inventory(void)
+{
+	probe_t *probes;
+	inventory_entry_t *entry;
+	time_t now = time(NULL);
+	char idn_command[] = "*IDN?\n";
+	int count = 0;
+	int i;
+
+	for (i = 0; i < inventory.count; i++)
+		if (now - inventory.entries[i].seen >= cacheTtl)
+			count++;
+	if (count == 0 || !detach())
+		return;
+
+	probes = calloc(count, sizeof(probe_t));
+	if (probes == NULL)
+		_exit(3);
+	count = 0;
+	for (i = 0; i < inventory.count; i++)
+	{
+		entry = &inventory.entries[i];
+		if (now - entry->seen < cacheTtl)
+			continue;
+		strcpy(probes[count].ip, entry->ip);
+		probes[count].port = entry->port;
+		probes[count].request = idn_command;
+		probes[count].request_length = strlen(idn_command);
+		probes[count].reply = true;
+		count++;
+	}
+	run_probes(probes, count, count, config.timeout, inventory_done);
+	inventory_save(&inventory);
+	_exit(0);
+}
+
+/* Point target at the inventory entry matching its name */
+static void resolve_device(target_t *target)
+{
+	inventory_entry_t *entry, *matches[8];
+	const char *name = target->name;
+	int i, count;
+
+	if (!inventoryLoaded)
+	{
+		if (inventory_load(&inventory) == ERR)
+		{
+			ERROR("Could not read inventory: %s\n", strerror(errno));
+			exit(1);
+		}
+		inventoryLoaded = true;
+	}
+
+	count = inventory_find(&inventory, name, matches, 8);
+	if (count == 0)
+	{
+		ERROR("No device %s in inventory, run --discover first\n", name);
+		exit(1);
+	}
+	if (count > 1)
+	{
+		ERROR("%s matches %d devices:\n", name, count);
+		for (i = 0; i < count && i < 8; i++)
+			ERROR("  %s:%u  %s\n", matches[i]->ip, matches[i]->port,
+					matches[i]->idn);
+		exit(1);
+	}
+	entry = matches[0];
+
+	target->ip = strdup(entry->ip);
+	if (!portSet)
+		target->port = entry->port;
+	if(debug) printf("Resolved %s to %s:%u\n", name, target->ip, target->port);
+}
+
+/* Look up the --device targets, fill in the --port default and point
+ * config at the first target */
+static void resolve_targets(void)
+{
+	int i;
+
+	for (i = 0; i < targetCount; i++)
+	{
+		if (targets[i].ip == NULL)
+			resolve_device(&targets[i]);
+		if (targets[i].port == 0)
+			targets[i].port = config.port;
+	}
+	if (inventoryLoaded)
+		revalidate_inventory();
+	if (hostCacheLoaded)
+	{
+		if (hostcache_save(&hostCache) == ERR && debug)
+			printf("Could not save host names: %s\n", strerror(errno));
+		revalidate_hosts();
+	}
+
+	if (targetCount > 0)
+	{
+		config.ip = targets[0].ip;
+		config.addrs = targets[0].addrCount ? targets[0].addrs : &targets[0].ip;
+		config.addrCount = targets[0].addrCount ? targets[0].addrCount : 1;
+		config.port = targets[0].port;
+	}
+}
+
+/* Remember the device given by --ip/--host/--device under name */
+static void alias_device(const char *name)
+{
+	inventory_entry_t *entry;
+
+	if (config.ip == NULL)
+	{
+		ERROR("Missing option: --ip\n");
+		exit(1);
+	}
+	if (!inventoryLoaded)
+		inventory_load(&inventory);
 
-	/* The device do not return any data if command send is wrong. If no
-	 * data recived until the specified timeout, exit. */	
-	FD_ZERO(&rset);
-	FD_SET(config.socket, &rset);
-	t.tv_sec=config.timeout; t.tv_nsec=0;
-	ret=pselect(config.socket+1, &rset, NULL, NULL, &t, NULL);
-	if(ret == -1) {
-		ERROR("Error reading response: %s\n",strerror(errno));
+	entry = inventory_update(&inventory, config.ip, config.port);
+	if (entry == NULL)
+	{
+		ERROR("Out of memory\n");
+		exit(3);
+	}
+	strncpy(entry->alias, name, sizeof(entry->alias) - 1);
+	entry->dirty = true;
+	if (inventory_save(&inventory) == ERR)
+	{
+		ERROR("Could not save inventory: %s\n", strerror(errno));
 		exit(3);
 	}
+}
 
-	if(!ret) {
-		INFO("Timeout waiting for response\n");
-		exit(2);
+/* List the inventory */
+static int list_inventory(void)
+{
+	inventory_entry_t *entry;
+	time_t now = time(NULL);
+	char seen[32];
+	int i;
+
+	inventory_load(&inventory);
+	for (i = 0; i < inventory.count; i++)
+	{
+		entry = &inventory.entries[i];
+		if (entry->seen == 0)
+			strcpy(seen, "never");
+		else
+			snprintf(seen, sizeof(seen), "%lds ago", (long) (now - entry->seen));
+		INFO("%-15s %5u  %-12s %12s %7.1fms  %s\n", entry->ip,
+				entry->port, entry->alias[0] ? entry->alias : "-",
+				seen, entry->rtt / 1000.0, entry->idn);
 	}
+	revalidate_inventory();
 
-    uint16_t * read_buf;
-    int bytesRead=0; 
-    /* Read data
-     * Has to be read 1426 bytes at a time, first frame is 14267+header
-     * */
-    //read_buf = (int16_t*) calloc((size/2), sizeof(int16_t));
-    read_buf = (uint16_t*) calloc(totalBytes/2, sizeof(uint16_t));
-
-    /* The device first send the first 1432 bytes of data, then the rest in chunks of 1426  */
-//    #if 0
-    /* Read first chunk */
-    if((length=recv(config.socket,read_buf,1432,0))==ERR) {
-      ERROR("Error reading response: %s\n",strerror(errno));
+	return 0;
+}
+
+/* Waveform readback state shared with the block data sink */
+typedef struct {
+  FILE * outFile;        /* Raw samples */
+  FILE * wfmFile;        /* Samples with .wfm header */
+  wf_plot_t plot;        /* Minimum and maximum per column */
+  long   sample;         /* Samples received so far */
+  bool   odd;            /* A sample is split between two chunks */
+  uint8_t msb;           /* First byte of split sample */
+  long   nBytes;         /* Bytes received */
+  uint64_t hash;         /* Of the data as received, for the cache */
+} wf_sink_t;
+
+/* Convert a chunk of block data to host endianness and write it out */
+static int waveform_sink(const void *data, size_t length, void *ctx)
+{
+  wf_sink_t * sink = ctx;
+  const uint8_t * bytes = data;
+  uint16_t samples[LXI_BLOCK_CHUNK/2+1];
+  size_t n = 0;
+  size_t i = 0;
+
+  sink->hash = arbcache_hash(sink->hash, data, length);
+  if(sink->odd && length > 0){
+    samples[n++] = (sink->msb << 8) | bytes[0];
+    sink->odd = false;
+    i = 1;
+  }
+  wf_swap(&samples[n], &bytes[i], (length-i)/2);
+  n += (length-i)/2;
+  i += (length-i)/2*2;
+  if(i < length){
+    sink->msb = bytes[i];
+    sink->odd = true;
+  }
+
+  stats_start(PHASE_PLOT);
+  wf_plot_add(&sink->plot, samples, n);
+  sink->sample += n;
+  stats_stop(PHASE_PLOT);
+
+  stats_start(PHASE_FILE);
+  if(fwrite(samples, sizeof(uint16_t), n, sink->outFile) != n ||
+     fwrite(samples, sizeof(uint16_t), n, sink->wfmFile) != n){
+    stats_stop(PHASE_FILE);
+    printf("Could not write to file: %s\n", strerror(errno));
+    return -1;
+  }
+  stats_stop(PHASE_FILE);
+  stats_file_bytes(2*n*sizeof(uint16_t));
+  return 0;
+}
+
+/* Note the amount of block data received */
+static void waveform_done(lxi_session_t *s, int status, const char *response,
+		size_t length, void *ctx)
+{
+  wf_sink_t * sink = ctx;
+
+  sink->nBytes = length;
+}
+
+/* Draw the plot to ~/<plotFileName>, as SVG if the name ends in .svg and
+ * with gnuplot otherwise */
+static void plot_waveform(const wf_plot_t *plot, const char *title)
+{
+  const char *ext = strrchr(plotFileName, '.');
+  const char *home = getenv("HOME");
+  void (*pipeHandler)(int);
+  char *path;
+  FILE *fp;
+  int status;
+
+  if(ext != NULL && strcasecmp(ext, ".svg") == 0){
+    path = malloc(strlen(home ? home : ".") + 1 + strlen(plotFileName) + 1);
+    if(path == NULL){
+      ERROR("Out of memory\n");
       exit(3);
     }
-    bytesLeft -= length;
-    bytesRead += length;
-    /* Read rest of data */
-    int bytes;
-    for(bytes=1432; bytes<totalBytes; bytes+=length){
-      if(bytesLeft>=1426){
-        if((length=recv(config.socket,&read_buf[bytes/2],1426,0))==ERR) {
-          ERROR("Error reading response: %s\n",strerror(errno));
-          exit(3);
-        }      
-        bytesLeft -= length;
-        bytesRead += length;
-      } else {
-        if((length=recv(config.socket,&read_buf[bytes/2],bytesLeft,0))==ERR) {
-          ERROR("Error reading response: %s\n",strerror(errno));
-          exit(3);
-        }       
-        bytesLeft -= length;
-        bytesRead += length;
-      }
+    sprintf(path, "%s/%s", home ? home : ".", plotFileName);
+    fp = fopen(path, "w");
+    if(fp == NULL){
+      printf("Error opening file %s, errno: %s\n", path, strerror(errno));
+      free(path);
+      return;
     }
+    status = wf_plot_svg(plot, fp, title);
+    if(fclose(fp) != 0 || status != 0)
+      printf("Could not write to file %s\n", path);
+    free(path);
+    return;
+  }
 
-    /* Convert to host endianness */
-    uint16_t * netToHost = (uint16_t*) calloc(wf_info.nBytes/2, sizeof(uint16_t));
-    for(i=header; i<(bytesRead-header)/2; i++) netToHost[i] = ntohs(read_buf[i]);
-    
-    /* Plot test */
-    if(!plotNameSpecified){
-      plotFileName = (char*) calloc(strlen(wf_info.name)+4+1, sizeof(char)); /*Add .png and \0*/
-      strcpy(plotFileName, wf_info.name);
-      strcat(plotFileName, ".png");
-    }
-    FILE *gnuplot = popen("gnuplot", "w");
-    fprintf(gnuplot, "set term png\n");
-    fprintf(gnuplot, "set xlabel 'Bins'\n");
-    fprintf(gnuplot, "set ylabel 'Value'\n");
-    fprintf(gnuplot, "set title 'Arbitrary waveform ARB%d: %s'\n", wf_info.arb, wf_info.name);
-    fprintf(gnuplot, "set output '~/%s'\n", plotFileName);
-    fprintf(gnuplot, "plot [0:%d] [0:16384]'-'\n", wf_info.length);
-    for(i=0; i<wf_info.nBytes/2; i++){
-      fprintf(gnuplot, "%d %d\n", i, netToHost[i]);
-    }
-    fprintf(gnuplot, "e\n");
-/*
-    fprintf(gnuplot, "set term png\n");
-    fprintf(gnuplot, "set output '%s'\n", plotFileName);
-    fprintf(gnuplot, "replot\n");
-*/
-    fflush(gnuplot);
-    printf("Waveform plot stored as ~/%s\n", plotFileName);
+  path = malloc(2 + strlen(plotFileName) + 1);
+  fp = popen("gnuplot", "w");
+  if(path == NULL || fp == NULL){
+    printf("Could not run gnuplot: %s\n", strerror(errno));
+    free(path);
+    if(fp != NULL)
+      pclose(fp);
+    return;
+  }
+  sprintf(path, "~/%s", plotFileName);
+  /* Without gnuplot the pipe closes early, which must not end the run */
+  pipeHandler = signal(SIGPIPE, SIG_IGN);
+  status = wf_plot_gnuplot(plot, fp, title, path);
+  if(pclose(fp) != 0 || status != 0)
+    printf("Could not plot with gnuplot\n");
+  signal(SIGPIPE, pipeHandler);
+  free(path);
+}
+
+static int receive_waveform(wf_info_t wf_info)
+{
+	int i, question = 0;
+  wf_sink_t sink = { 0 };
+  arbcache_slot_t content;
+  char title[80];
+
+	/* Skip receive if no '?' in command */
+	for (i=0; i<strlen(config.command);i++)
+	{
+		if (config.command[i] == '?')
+			question=1;
+	}
+	if (question == 0)
+		return 0;
 
     /* Open file for writing */
-    outFile = fopen(fileNameOut, "wb");
-    if (outFile == NULL){
-      fclose(outFile);
+    stats_start(PHASE_FILE);
+    sink.outFile = fopen(fileNameOut, "wb");
+    if (sink.outFile == NULL){
       fprintf(stdout, "Error opening file %s, errno: %s\n", fileNameOut, strerror(errno));
       exit(1);
     } else {
        printf("Opened file %s for writing data from function generator\n", fileNameOut);
     }   
-    int res;
-    /* Dump to file, skip header  */
-    res = fwrite(netToHost, sizeof(uint16_t), wf_info.nBytes/2, outFile);
-    if(res != wf_info.nBytes/2){
-      fclose(outFile);
-      free(read_buf);
-      free(netToHost);
-      printf("Could not write to file, wrote %d bytes, nBytes=%d\n", res*2, wf_info.nBytes);
-      exit(1);
-    }
     /* Also write a .wfm file */
-    FILE * wfmFile;
     char * wfm = (char*) calloc(strlen(fileNameOut)+4+1, sizeof(char));
     strcpy(wfm, fileNameOut);
     strcat(wfm, ".wfm");
-    wfmFile = fopen(wfm, "wb");
-    if (wfmFile == NULL){
-      fclose(outFile);
+    sink.wfmFile = fopen(wfm, "wb");
+    if (sink.wfmFile == NULL){
+      fclose(sink.outFile);
       fprintf(stdout, "Error opening file %s, errno: %s\n", wfm, strerror(errno));
       exit(1);
-    } else {
-       printf("Wrote wfm file: %s\n", wfm);
     }
-    /* Dump to wfm file  */
     uint16_t wfmHeader = 0x2000;
-    res = fwrite(&wfmHeader, sizeof(uint16_t), 1, wfmFile);
-    res = fwrite(netToHost, sizeof(uint16_t), wf_info.nBytes/2, wfmFile);
-    if(res != wf_info.nBytes/2){
-      fclose(wfmFile);
-      free(read_buf);
-      free(netToHost);
-      printf("Could not write to file, wrote %d bytes\n", res*2);
-      exit(1);
+    fwrite(&wfmHeader, sizeof(uint16_t), 1, sink.wfmFile);
+    stats_stop(PHASE_FILE);
+
+    /* Plot test */
+    if(!plotNameSpecified){
+      plotFileName = (char*) calloc(strlen(wf_info.name)+4+1, sizeof(char)); /*Add .png and \0*/
+      strcpy(plotFileName, wf_info.name);
+      strcat(plotFileName, ".png");
+    }
+    /* Reduced to the plot width while receiving */
+    if(wf_plot_init(&sink.plot, wf_info.length, WF_PLOT_WIDTH) != 0){
+      ERROR("Out of memory\n");
+      exit(3);
+    }
+
+    /* Stream block data to the files and the plot */
+    sink.hash = ARBCACHE_HASH_INIT;
+    lxi_query_block(session, config.command, waveform_sink, waveform_done, &sink);
+    wait_instrument(0);
+    if(sink.nBytes != wf_info.nBytes){
+      printf("Received %ld bytes, ARB%dDEF? announced %d\n", sink.nBytes, wf_info.arb, wf_info.nBytes);
+      arbcache_put(config.ip, config.port, wf_info.arb, NULL);
+    } else {
+      /* Now the content of the slot is known */
+      content.hash = sink.hash;
+      content.points = wf_info.length;
+      snprintf(content.name, sizeof(content.name), "%s", wf_info.name);
+      arbcache_put(config.ip, config.port, wf_info.arb, &content);
     }
+
+    stats_start(PHASE_PLOT);
+    snprintf(title, sizeof(title), "Arbitrary waveform ARB%d: %s", wf_info.arb, wf_info.name);
+    plot_waveform(&sink.plot, title);
+    wf_plot_free(&sink.plot);
+    stats_stop(PHASE_PLOT);
+    printf("Waveform plot stored as ~/%s\n", plotFileName);
+    printf("Wrote wfm file: %s\n", wfm);
     printf("Wrote data to files\n");
 
     /* Free up memory */
-    free(plotFileName);
-    free(read_buf);
-    free(netToHost);
+    if(!plotNameSpecified) free(plotFileName);
     free(wfm);
-    fclose(outFile);
-    fclose(wfmFile);
+    stats_start(PHASE_FILE);
+    fclose(sink.outFile);
+    fclose(sink.wfmFile);
+    stats_stop(PHASE_FILE);
    
     return 0;
 }
 
-/* http://www.binarytides.com/hostname-to-ip-address-c-sockets-linux/ */
-int hostname_to_ip(char *hostname , char *ip)
-{
-    int sockfd;  
-    struct addrinfo hints, *servinfo, *p;
-    struct sockaddr_in *h;
-    int rv;
- 
-    memset(&hints, 0, sizeof hints);
-    hints.ai_family = AF_INET;//AF_UNSPEC; // use AF_INET6 to force IPv6
-    hints.ai_socktype = SOCK_STREAM;
- 
-    if ( (rv = getaddrinfo( hostname , NULL , &hints , &servinfo)) != 0) 
-    {
-        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
-        return 1;
-    }
- 
-    // loop through all the results and connect to the first we can
-    for(p = servinfo; p != NULL; p = p->ai_next) 
-    {
-        h = (struct sockaddr_in *) p->ai_addr;
-        //strcpy(ip , inet_ntoa( h->sin_addr ) );
-				memcpy(ip, inet_ntoa(h->sin_addr), strlen(inet_ntoa(h->sin_addr)));
+/* Extract the waveform definition from the ARBxDEF? response */
+static void waveform_definition(lxi_session_t *s, int status,
+		const char *response, size_t length, void *ctx)
+{
+  wf_info_t * wf_info = ctx;
+
+  if (status != LXI_OK)
+    return;
+  if(debug) printf("response: %s\n", response);
+
+  /* extract tokens */
+  /* Names should be max 9 chars or it will overflow to the other ARBs */
+  sscanf(response, "%39[^','],%3[^','],%d", wf_info->name, wf_info->interpolation, &wf_info->length);
+  wf_info->nBytes = 2*wf_info->length;
+  if(debug) printf("name=%s, interpol=%s, length=%d, nBytes=%d\n", wf_info->name, wf_info->interpolation, wf_info->length, wf_info->nBytes);
+}
+
+/* Print the ARBxDEF? response and extract the waveform definition */
+static void waveform_info(lxi_session_t *s, int status, const char *response,
+		size_t length, void *ctx)
+{
+  if (status == LXI_OK)
+    printf("%s\n", response);
+  waveform_definition(s, status, response, length, ctx);
+}
+
+/* Ask ARBxDEF? for the definition of ARB<arb>, printing the response if
+ * print is set */
+static void query_definition(int arb, wf_info_t *wf_info, bool print)
+{
+  char defCommand[16];
+
+  memset(wf_info, 0, sizeof(wf_info_t));
+  wf_info->arb = arb;
+  snprintf(defCommand, sizeof(defCommand), "ARB%dDEF?", arb);
+  lxi_query(session, defCommand, print ? waveform_info : waveform_definition,
+            wf_info);
+  wait_instrument(0);
+}
+
+/* Read back the waveform addressed by config.command (ARBx?). The waveform
+ * definition is fetched first with ARBxDEF? to learn its name and length */
+static int fetch_waveform(void)
+{
+  wf_info_t wf_info;
+
+  query_definition((int)config.command[3]-'0', &wf_info, true);
+  return receive_waveform(wf_info);
+}
+
+/* Upload the loaded waveform with config.command (ARBx), unless the slot is
+ * known to hold the same data and ARBxDEF? still reports the name and length
+ * it had then. The slot is remembered after the upload. */
+static void upload_waveform(void)
+{
+  int arb = (int)config.command[3]-'0';
+  arbcache_slot_t cached, content;
+  wf_info_t wf_info;
+
+  content.hash = arbcache_hash(ARBCACHE_HASH_INIT, waveform_buf, lSize);
+  content.points = lSize/2;
+  if(!forceUpload &&
+     arbcache_get(config.ip, config.port, arb, &cached) == 0 &&
+     cached.hash == content.hash && cached.points == content.points){
+    query_definition(arb, &wf_info, false);
+    if(wf_info.length == cached.points && strcmp(wf_info.name, cached.name) == 0){
+      printf("ARB%d already holds this waveform (%s), upload skipped\n", arb, wf_info.name);
+      return;
     }
-     
-    freeaddrinfo(servinfo); // all done with this structure
-    return 0;
+  }
+
+  /* Forget the slot until the upload is confirmed */
+  arbcache_put(config.ip, config.port, arb, NULL);
+  wf = true;
+  send_command(config.command);
+  wf = false;
+  sync_check(config.command);
+  wait_instrument(0);
+  if(syncStatus)
+    return;
+
+  query_definition(arb, &wf_info, false);
+  if(wf_info.length == content.points){
+    snprintf(content.name, sizeof(content.name), "%s", wf_info.name);
+    arbcache_put(config.ip, config.port, arb, &content);
+  }
+}
+
+/* Convert the file of a --arb slot into the slot. Like load_waveform() and
+ * import_waveform(), but errors are left in the slot. */
+static void convert_file(arb_slot_t *slot)
+{
+	int format = wf_format(slot->filename);
+	wf_samples_t wave;
+	const uint8_t *data;
+	void *map;
+	struct stat st;
+	double amplitude;
+	bool fit;
+	int fd;
+
+	if (format == WF_FORMAT_WFM && targetPoints == 0)
+	{
+		/* Sent as is, or fitted */
+		fd = open(slot->filename, O_RDONLY);
+		if (fd == -1 || fstat(fd, &st) == -1)
+		{
+			snprintf(slot->error, sizeof(slot->error), "Could not open %s: %s",
+					slot->filename, strerror(errno));
+			if (fd != -1)
+				close(fd);
+			return;
+		}
+		map = st.st_size < 2 ? MAP_FAILED :
+			mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if (map == MAP_FAILED)
+		{
+			snprintf(slot->error, sizeof(slot->error), "Could not read header");
+			return;
+		}
+		data = map;
+		amplitude = usingCustomAmp ? customAmp : (data[0] | (data[1] << 8));
+		slot->bytes = st.st_size;
+		slot->points = (st.st_size - 2) / 2;
+		if (fitWaveform && amplitude == 0)
+			snprintf(slot->error, sizeof(slot->error), "Zero amplitude is impossible");
+		else if (posix_memalign((void **) &slot->data, WF_BUF_ALIGN,
+					slot->points * 2) != 0)
+		{
+			slot->data = NULL;
+			snprintf(slot->error, sizeof(slot->error), "Out of memory");
+		}
+		else if (fitWaveform)
+			wf_fit(slot->data, (const int16_t *) (data + 2), slot->points,
+					amplitude);
+		else if (htons(1) != 1)
+			wf_swap(slot->data, data + 2, slot->points);
+		else
+			memcpy(slot->data, data + 2, slot->points * 2);
+		munmap(map, st.st_size);
+	}
+	else
+	{
+		/* Resampled, and fitted unless it is .wfm data without --adjust */
+		if (wf_import(slot->filename, format, &wave, slot->error,
+					sizeof(slot->error)) != 0)
+			return;
+		slot->bytes = wave.bytes;
+		slot->points = targetPoints;
+		if (slot->points == 0)
+			slot->points = wave.n < MAX_WF_BUFFER/2 ? wave.n : MAX_WF_BUFFER/2;
+		fit = format != WF_FORMAT_WFM || fitWaveform;
+		amplitude = !fit ? 0 : usingCustomAmp ? customAmp : wave.amplitude;
+		if (fit && amplitude == 0)
+			snprintf(slot->error, sizeof(slot->error), "Zero amplitude is impossible");
+		else if (posix_memalign((void **) &slot->data, WF_BUF_ALIGN,
+					slot->points * 2) != 0 ||
+				wf_resample(slot->data, slot->points, wave.samples, wave.n,
+					amplitude) != 0)
+		{
+			free(slot->data);
+			slot->data = NULL;
+			snprintf(slot->error, sizeof(slot->error), "Out of memory");
+		}
+		wf_samples_free(&wave);
+	}
+
+	if (slot->data != NULL)
+		slot->hash = arbcache_hash(ARBCACHE_HASH_INIT, slot->data,
+				slot->points * 2);
+}
+
+/* Conversion thread of a --arb slot, wakes up run_arbset() when done */
+static void *convert_slot(void *arg)
+{
+	arb_slot_t *slot = arg;
+
+	convert_file(slot);
+	atomic_store_explicit(&slot->done, true, memory_order_release);
+	eventfd_write(arbEvent, 1);
+	return NULL;
+}
+
+/* Run the session until a conversion is done, exits on errors */
+static void arbset_wait(void)
+{
+	struct pollfd pfd[2];
+	eventfd_t count;
+	int n;
+
+	pfd[0].fd = lxi_fd(session);
+	pfd[0].events = lxi_events(session);
+	pfd[0].revents = 0;
+	pfd[1].fd = arbEvent;
+	pfd[1].events = POLLIN;
+	pfd[1].revents = 0;
+	n = poll(pfd, 2, lxi_timeout(session));
+	if (n == -1 && errno != EINTR)
+	{
+		ERROR("Error waiting for instrument: %s\n", strerror(errno));
+		exit(3);
+	}
+	if (pfd[1].revents & POLLIN)
+		eventfd_read(arbEvent, &count);
+	if (lxi_process(session, n > 0 ? pfd[0].revents : 0) != LXI_OK)
+	{
+		ERROR("%s\n", lxi_error(session));
+		exit(lxi_status(session));
+	}
+}
+
+/* Load the --arb waveforms on one connection. All files are converted in
+ * parallel while connecting. Each waveform is queued as soon as it and the
+ * ones before it are ready, and the session sends it while the later ones
+ * are still converting. Slots known to hold their waveform already are
+ * skipped like upload_waveform() does. Returns 1 if a file could not be
+ * converted. */
+static int run_arbset(void)
+{
+	arb_slot_t *slot;
+	char command[80];
+	int i, next, error, status = 0;
+
+	arbEvent = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (arbEvent == -1)
+	{
+		ERROR("Could not start conversion: %s\n", strerror(errno));
+		exit(3);
+	}
+
+	/* Pick the kernels before the workers race for it */
+	wf_kernel();
+	for (i = 0; i < arbCount; i++)
+	{
+		error = pthread_create(&arbSlots[i].thread, NULL, convert_slot,
+				&arbSlots[i]);
+		if (error != 0)
+		{
+			ERROR("Could not start conversion: %s\n", strerror(error));
+			exit(3);
+		}
+	}
+
+	if (connect_instrument())
+		exit(2);
+
+	/* Check the slots that may already hold their waveform */
+	for (i = 0; i < arbCount; i++)
+	{
+		slot = &arbSlots[i];
+		slot->known = !forceUpload && arbcache_get(config.ip, config.port,
+				slot->arb, &slot->cached) == 0;
+		if (!slot->known)
+			continue;
+		slot->def.arb = slot->arb;
+		snprintf(command, sizeof(command), "ARB%dDEF?", slot->arb);
+		lxi_query(session, command, waveform_definition, &slot->def);
+	}
+	wait_instrument(0);
+
+	for (next = 0; next < arbCount; )
+	{
+		slot = &arbSlots[next];
+		if (!atomic_load_explicit(&slot->done, memory_order_acquire))
+		{
+			arbset_wait();
+			continue;
+		}
+		next++;
+		pthread_join(slot->thread, NULL);
+		if (slot->data == NULL)
+		{
+			ERROR("ARB%d: %s\n", slot->arb, slot->error);
+			status = 1;
+			continue;
+		}
+		stats_file_bytes(slot->bytes);
+
+		if (slot->known && slot->cached.hash == slot->hash &&
+				slot->cached.points == (long) slot->points &&
+				slot->def.length == (int) slot->points &&
+				strcmp(slot->def.name, slot->cached.name) == 0 &&
+				(slot->name == NULL || strcmp(slot->name, slot->def.name) == 0))
+		{
+			printf("ARB%d already holds %s (%s), upload skipped\n", slot->arb,
+					slot->filename, slot->def.name);
+			continue;
+		}
+
+		/* Forget the slot until the upload is confirmed */
+		arbcache_put(config.ip, config.port, slot->arb, NULL);
+		printf("Sending %s to ARB%d, %zu points\n", slot->filename, slot->arb,
+				slot->points);
+		snprintf(command, sizeof(command), "ARB%d", slot->arb);
+		lxi_write_block(session, command, slot->data, slot->points * 2,
+				NULL, NULL);
+		if (slot->name != NULL)
+		{
+			snprintf(command, sizeof(command), "ARB%dDEF %s,ON,%zu", slot->arb,
+					slot->name, slot->points);
+			lxi_write(session, command, NULL, NULL);
+		}
+		slot->sent = true;
+		syncPending = true;
+	}
+	close(arbEvent);
+	sync_check("--arb");
+	wait_instrument(0);
+	if (syncStatus != 0)
+		status = 1;
+
+	/* Remember what the slots hold now */
+	for (i = 0; i < arbCount; i++)
+	{
+		slot = &arbSlots[i];
+		if (!slot->sent)
+			continue;
+		memset(&slot->def, 0, sizeof(wf_info_t));
+		snprintf(command, sizeof(command), "ARB%dDEF?", slot->arb);
+		lxi_query(session, command, waveform_definition, &slot->def);
+	}
+	wait_instrument(0);
+	for (i = 0; i < arbCount; i++)
+	{
+		slot = &arbSlots[i];
+		if (slot->sent && slot->def.length == (int) slot->points)
+		{
+			slot->cached.hash = slot->hash;
+			slot->cached.points = slot->points;
+			snprintf(slot->cached.name, sizeof(slot->cached.name), "%s",
+					slot->def.name);
+			arbcache_put(config.ip, config.port, slot->arb, &slot->cached);
+		}
+		free(slot->data);
+	}
+
+	disconnect_instrument();
+	return status;
+}
+
+/* Print the response of one device, tagged with its name */
+static void fanout_done(probe_t *probe)
+{
+	if (probe->status == 0)
+	{
+		if (probe->reply)
+			printf("[%s] %s\n", probe->name, probe->response);
+		else if(debug)
+			printf("[%s] sent\n", probe->name);
+	}
+	else if (probe->status == 2)
+		ERROR("[%s] Timeout or connection failed\n", probe->name);
+	else
+		ERROR("[%s] Connection error\n", probe->name);
+}
+
+/* Send the command to all targets concurrently, at most parallel of them
+ * at a time. Returns the highest exit status of all devices. */
+static int run_fanout(void)
+{
+	probe_t *probes;
+	char *request;
+	size_t length;
+	char header[3+20+1];
+	struct sockaddr_storage addr;
+	socklen_t addr_length;
+	int h_size;
+	int i, status;
+
+	/* The request is the same for all devices */
+	if (wf)
+	{
+		h_size = lxi_block_header(header, lSize);
+		length = strlen(config.command) + h_size + lSize + 1;
+		request = malloc(length);
+		if (request != NULL)
+		{
+			memcpy(request, config.command, strlen(config.command));
+			memcpy(request + strlen(config.command), header, h_size);
+			memcpy(request + length - lSize - 1, waveform_buf, lSize);
+			request[length - 1] = '\n';
+		}
+	}
+	else
+	{
+		length = strlen(config.command) + 1;
+		request = malloc(length + 1);
+		if (request != NULL)
+			sprintf(request, "%s\n", config.command);
+	}
+	probes = calloc(targetCount, sizeof(probe_t));
+	if (request == NULL || probes == NULL)
+	{
+		ERROR("Out of memory\n");
+		exit(3);
+	}
+
+	for (i = 0; i < targetCount; i++)
+	{
+		if (ip_address(targets[i].ip, targets[i].port, &addr, &addr_length) == ERR)
+		{
+			ERROR("Invalid IP address: %s\n", targets[i].ip);
+			exit(1);
+		}
+		snprintf(probes[i].ip, sizeof(probes[i].ip), "%s", targets[i].ip);
+		probes[i].name = targets[i].name;
+		probes[i].port = targets[i].port;
+		probes[i].broker = brokerPath;
+		/* The broker connects to the first address itself */
+		if (brokerPath == NULL)
+		{
+			probes[i].addrs = targets[i].addrs;
+			probes[i].addr_count = targets[i].addrCount;
+			probes[i].addr_next = 1;
+			probes[i].connect_timeout = connectTimeout;
+		}
+		probes[i].request = request;
+		probes[i].request_length = length;
+		probes[i].reply = (strchr(config.command, '?') != NULL);
+	}
+	if(debug) printf("Sending command to %d devices: %s\n", targetCount,
+			config.command);
+
+	/* Uploads are not checked against the waveform cache, but they make
+	 * the remembered content of the slot invalid */
+	for (i = 0; wf && i < targetCount; i++)
+		arbcache_put(targets[i].ip, targets[i].port ? targets[i].port :
+				config.port, config.command[3] - '0', NULL);
+
+	status = run_probes(probes, targetCount, parallel, config.timeout,
+			fanout_done);
+
+	free(probes);
+	free(request);
+	return status;
+}
+
+/* Serve clients as connection broker, the devices given are connected to
+ * at once */
+static void run_broker(void)
+{
+	char *path = daemonPath;
+	int i;
+
+	if (path == NULL)
+		path = broker_path();
+	for (i = 0; i < targetCount; i++)
+		if (broker_instrument(targets[i].ip, targets[i].port) == ERR)
+		{
+			ERROR("Out of memory\n");
+			exit(3);
+		}
+
+	INFO("Broker listening on %s\n", path);
+	fflush(stdout);
+	broker_run(path, config.timeout, debug);
+	ERROR("Broker on %s failed: %s\n", path, strerror(errno));
+	exit(3);
+}
+
+/* Poll the device with pollQuery at pollRate over one connection until
+ * pollSamples are taken or we are interrupted, logging to logFileName */
+static void run_poll(void)
+{
+	acquire_stats_t stats;
+	int status;
+
+	if (connect_instrument())
+		exit(2);
+
+	INFO("Polling %s at %g Hz, press Ctrl-C to stop\n", pollQuery, pollRate);
+	fflush(stdout);
+	status = acquire_run(session, pollQuery, pollRate, pollSamples,
+			logFileName, &stats);
+
+	INFO("Samples: %ld, missed deadlines: %ld, dropped: %ld, not numeric: %ld\n",
+			stats.samples, stats.missed, stats.dropped, stats.invalid);
+	INFO("Latency: %.0f us mean, %ld us max\n", stats.mean_latency,
+			stats.max_latency);
+
+	if (status != LXI_OK)
+	{
+		if (lxi_status(session) != LXI_OK)
+			ERROR("%s\n", lxi_error(session));
+		else
+			ERROR("Logging to %s failed: %s\n", logFileName, strerror(errno));
+	}
+	disconnect_instrument();
+	exit(status);
+}
+
+/* Name script lines first to last in --sync errors */
+static void script_label(char *label, size_t size, const char *filename,
+		int first, int last)
+{
+	if (first == last)
+		snprintf(label, size, "%s:%d", filename, first);
+	else
+		snprintf(label, size, "%s:%d-%d", filename, first, last);
+}
+
+/* Queue the --sync check of script lines first to last */
+static void script_check(const char *filename, int first, int last)
+{
+	char label[512];
+
+	script_label(label, sizeof(label), filename, first, last);
+	sync_check(label);
+}
+
+/* Run a script of commands on one persistent connection. Each line holds
+ * one command:
+ *   <SCPI command>     sent as is, response printed if it is a query
+ *   ARBx <file>        upload .wfm file to ARBx (honours --adjust)
+ *   ARBx? <file>       read back ARBx to <file> and <file>.wfm
+ * Empty lines and lines starting with '#' are ignored. A filename of "-"
+ * reads the script from stdin. Up to pipelineDepth queries are kept in
+ * flight (--pipeline). With --sync the commands between queries are
+ * checked at once, the script stops at the first error. */
+static int run_script(const char *filename)
+{
+	FILE *fp;
+	char *line = NULL;
+	size_t size = 0;
+	ssize_t len;
+	char *command, *arg;
+	int lineno = 0;
+	int first = 0, last = 0; // Commands not checked yet
+	char label[512];
+
+	if (strcmp(filename, "-") == 0)
+		fp = stdin;
+	else
+		fp = fopen(filename, "r");
+	if (fp == NULL)
+	{
+		ERROR("Could not open script %s: %s\n", filename, strerror(errno));
+		exit(1);
+	}
+
+	/* Connect instrument */
+	if (connect_instrument())
+		exit(2);
+
+	while (syncStatus == 0 && (len = getline(&line, &size, fp)) != -1)
+	{
+		lineno++;
+
+		/* Strip line ending and surrounding white space */
+		while (len > 0 && isspace((unsigned char)line[len-1]))
+			line[--len] = 0;
+		command = line;
+		while (isspace((unsigned char)*command))
+			command++;
+		if (*command == 0 || *command == '#')
+			continue;
+
+		/* Waveform commands take a filename argument */
+		arg = NULL;
+		if (is_arb_command(command) &&
+			(isspace((unsigned char)command[4]) ||
+			 (command[4] == '?' && isspace((unsigned char)command[5]))))
+		{
+			arg = strpbrk(command, " \t");
+			*arg++ = 0;
+			while (isspace((unsigned char)*arg))
+				arg++;
+		}
+
+		/* Waveform transfers are not pipelined, collect any outstanding
+		 * responses first */
+		if (arg != NULL)
+		{
+			script_check(filename, first, last);
+			wait_instrument(0);
+			if (syncStatus != 0)
+				break;
+		}
+
+		config.command = command;
+		if (arg != NULL && command[4] == '?')
+		{
+			/* ARBx? <file> */
+			fileNameOut = arg;
+			fetch_waveform();
+		}
+		else if (arg != NULL)
+		{
+			/* ARBx <file> */
+			load_waveform(arg);
+			upload_waveform();
+			unload_waveform();
+		}
+		else if (is_arb_command(command) && command[4] == '?' &&
+				command[5] == 0)
+		{
+			ERROR("%s:%d: %s needs a filename\n", filename, lineno,
+					command);
+			exit(1);
+		}
+		else
+		{
+			/* Queries are written back-to-back until pipelineDepth of
+			 * them are in flight, the responses are then matched to the
+			 * queries in order. With --sync=err each has its check. */
+			if (strchr(command, '?') != NULL)
+			{
+				script_check(filename, first, last);
+				script_label(label, sizeof(label), filename, lineno, lineno);
+				send_command(label);
+				wait_instrument(syncMode == SYNC_ERR ?
+						2 * (pipelineDepth - 1) : pipelineDepth - 1);
+			}
+			else
+			{
+				if (!syncPending)
+					first = lineno;
+				last = lineno;
+				send_command(NULL);
+			}
+		}
+	}
+
+	/* Collect remaining responses */
+	script_check(filename, first, last);
+	wait_instrument(0);
+
+	/* Disconnect instrument */
+	disconnect_instrument();
+	if (syncStatus != 0)
+		exit(1);
+
+	free(line);
+	if (fp != stdin)
+		fclose(fp);
+
+	return 0;
+}
+
+/* Ask the resolver for the IPv4 and IPv6 addresses of hostname, in the
+ * order getaddrinfo() prefers them. Returns the getaddrinfo() status. */
+static int lookup_host(const char *hostname, int flags,
+		hostcache_entry_t *entry)
+{
+	struct addrinfo hints = { 0 }, *servinfo, *p;
+	char ip[NI_MAXHOST];
+	int rv, i;
+
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = flags;
+	rv = getaddrinfo(hostname, NULL, &hints, &servinfo);
+	if (rv != 0)
+		return rv;
+
+	entry->count = 0;
+	for (p = servinfo; p != NULL && entry->count < HOSTCACHE_MAX_ADDRS;
+			p = p->ai_next)
+	{
+		if (getnameinfo(p->ai_addr, p->ai_addrlen, ip, sizeof(ip), NULL, 0,
+					NI_NUMERICHOST) != 0 || strlen(ip) >= sizeof(entry->addrs[0]))
+			continue;
+		for (i = 0; i < entry->count && strcmp(entry->addrs[i], ip) != 0; i++);
+		if (i == entry->count)
+			strcpy(entry->addrs[entry->count++], ip);
+	}
+
+	freeaddrinfo(servinfo);
+	return entry->count > 0 ? 0 : EAI_NONAME;
+}
+
+/* Copy the addresses of an entry to a new array in *addrs */
+static int copy_addrs(const hostcache_entry_t *entry, char ***addrs)
+{
+	int i;
+
+	*addrs = malloc(entry->count * sizeof(char *));
+	for (i = 0; *addrs != NULL && i < entry->count; i++)
+		if (((*addrs)[i] = strdup(entry->addrs[i])) == NULL)
+			break;
+	if (*addrs == NULL || i < entry->count)
+	{
+		ERROR("Out of memory\n");
+		exit(3);
+	}
+	return entry->count;
+}
+
+/* Resolve hostname to all its IPv4 and IPv6 addresses. Returns the number
+ * of addresses, stored in a new array in *addrs, 0 if the name could not
+ * be resolved. Addresses remembered within dnsTtl seconds are used without
+ * asking DNS; older ones are used as well, and looked up again in the
+ * background once all targets are known. */
+static int hostname_to_ip(const char *hostname, char ***addrs)
+{
+	hostcache_entry_t result = { .count = 0 }, *entry = NULL;
+	time_t now = time(NULL);
+	int rv;
+
+	stats_start(PHASE_DNS);
+	if (lookup_host(hostname, AI_NUMERICHOST, &result) == 0)
+	{
+		stats_stop(PHASE_DNS);
+		return copy_addrs(&result, addrs);
+	}
+
+	if (dnsTtl > 0 && !hostCacheLoaded)
+	{
+		if (hostcache_load(&hostCache) == ERR && debug)
+			printf("Could not read host names: %s\n", strerror(errno));
+		hostCacheLoaded = true;
+	}
+	if (dnsTtl > 0)
+		entry = hostcache_update(&hostCache, hostname);
+	if (entry != NULL && (entry->count > 0 ||
+				hostcache_fresh(entry, dnsTtl, now)))
+	{
+		stats_stop(PHASE_DNS);
+		if (!hostcache_fresh(entry, dnsTtl, now))
+			entry->refresh = true;
+		if (entry->count == 0)
+			ERROR("%s did not resolve %ld s ago\n", hostname,
+					(long) (now - entry->checked));
+		return entry->count > 0 ? copy_addrs(entry, addrs) : 0;
+	}
+
+	rv = lookup_host(hostname, 0, &result);
+	stats_stop(PHASE_DNS);
+	if (entry != NULL)
+	{
+		entry->checked = now;
+		entry->count = 0;
+		if (rv == 0)
+		{
+			memcpy(entry->addrs, result.addrs, sizeof(result.addrs));
+			entry->count = result.count;
+			entry->resolved = now;
+		}
+		entry->dirty = true;
+	}
+	if (rv != 0)
+	{
+		ERROR("getaddrinfo: %s\n", gai_strerror(rv));
+		return 0;
+	}
+	return copy_addrs(&result, addrs);
+}
+
+/* Look up the host names used with outdated addresses again. This is done
+ * by a detached process, so the current run is not delayed. While DNS can
+ * not be reached the old addresses are kept; names which no longer exist
+ * lose them. */
+static void revalidate_hosts(void)
+{
+	hostcache_entry_t result, *entry;
+	time_t now = time(NULL);
+	int i, rv;
+
+	for (i = 0; i < hostCache.count && !hostCache.entries[i].refresh; i++);
+	if (i == hostCache.count || !detach())
+		return;
+
+	for (i = 0; i < hostCache.count; i++)
+	{
+		entry = &hostCache.entries[i];
+		if (!entry->refresh)
+			continue;
+		rv = lookup_host(entry->name, 0, &result);
+		entry->checked = now;
+		if (rv == 0)
+		{
+			memcpy(entry->addrs, result.addrs, sizeof(result.addrs));
+			entry->count = result.count;
+			entry->resolved = now;
+		}
+		else if (rv == EAI_NONAME)
+			entry->count = 0;
+		entry->dirty = true;
+	}
+	hostcache_save(&hostCache);
+	_exit(0);
 }
 
 
@@ -901,7 +3173,8 @@ int hostname_to_ip(char *hostname , char *ip)
 int main (int argc, char *argv[])
 {
 
-  char * resp;
+	int status;
+	stats_init();
 	/* Parse command line options */
 	parse_options(argc, argv);
 	
@@ -910,6 +3183,38 @@ int main (int argc, char *argv[])
 		/* Discover instruments IPs via VXI-11 broadcast */
 		discover_instruments();
 	}
+	else if (config.mode == MODE_INVENTORY)
+	{
+		/* Show remembered instruments */
+		list_inventory();
+	}
+	else if (config.mode == MODE_SCRIPT)
+	{
+		/* Run all commands of the script on one connection */
+		run_script(scriptFileName);
+	}
+	else if (config.mode == MODE_DAEMON)
+	{
+		/* Keep devices connected for clients */
+		run_broker();
+	}
+	else if (config.mode == MODE_POLL)
+	{
+		/* Log a measurement at a fixed rate */
+		run_poll();
+	}
+	else if (config.mode == MODE_ARBSET)
+	{
+		/* Up to four waveforms on one connection */
+		exit(run_arbset());
+	}
+	else if (config.mode == MODE_FANOUT)
+	{
+		/* Same command to many devices, exit with the worst status */
+		status = run_fanout();
+		unload_waveform();
+		exit(status);
+	}
 	else
 	{
 	
@@ -917,47 +3222,29 @@ int main (int argc, char *argv[])
 		if (connect_instrument())
 			exit(2);
 	  if(getWaveData){
-      //send_command(arbxdef?);
-      //waveforminfo = receive_response();
-      wf_info_t wf_info;
-      wf_info.arb = (int)config.command[3]-'0'; /* Set arb number */ 
-      char * defCommand = calloc(9,1);
-      char * oldCommand = calloc(strlen(config.command)+1,1);
-      strcpy(oldCommand,config.command);
-      strncpy(defCommand,config.command,4);
-      strcat(defCommand,"DEF?");
-      config.command = defCommand;
-      send_command();
-      receive_response(&resp);
-      if(debug) printf("response: %s\n", resp);
-      
-      /* extract tokens */
-      char name[40]; /* Names should be max 9 chars or it will overflow to the other ARBs */
-      char interpolation[4]; /* ON or OFF */
-      int nPoints=0; // one point is 2 bytes
-      sscanf(resp, "%[^','],%[^','],%d", wf_info.name, wf_info.interpolation, &wf_info.length);
-      wf_info.nBytes = 2*wf_info.length;
-//      if(debug) printf("name=%s, interpol=%s, nBytes=%d\n", name, interpolation, nPoints);
-      if(debug) printf("name=%s, interpol=%s, length=%d, nBytes=%d\n", wf_info.name, wf_info.interpolation, wf_info.length, wf_info.nBytes);
-
-      config.command = oldCommand;
-      send_command();
-      receive_waveform(wf_info);
+      fetch_waveform();
 
     /* Normal command */
     } else {
       /* Send command */
       printf("Sending command: %s\n", config.command);
-      send_command();
-      /* Read response */
-      receive_response(&resp);
-  //    printf("response: %s\n", resp);
+      if(wf){
+        /* Upload, if the device does not hold the waveform yet */
+        upload_waveform();
+      } else {
+        send_command(config.command);
+        sync_check(config.command);
+        /* Read response */
+        wait_instrument(0);
+      }
 	  }
 		/* Disconnect instrument */
 		disconnect_instrument();
 
     /* Free up */
-    free(waveform_buf);
+    unload_waveform();
+		if (syncStatus != 0)
+			exit(1);
 	}
 	exit (0);
 }
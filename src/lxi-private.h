@@ -0,0 +1,156 @@
+/*
+ * lxi-control - Instrument session library internals
+ *
+ * Shared by the session core in lxi.c and the transports other than raw
+ * sockets, which turn the queued requests into their own messages and
+ * feed the response data into the receive buffer for parsing.
+ *
+ * This program is free software; you can redistribute  it and/or modify it
+ * under  the terms of  the GNU General  Public License as published by the
+ * Free Software Foundation;  either version 2 of the  License, or (at your
+ * option) any later version.
+ */
+
+#ifndef LXI_PRIVATE_H
+#define LXI_PRIVATE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "lxi.h"
+
+#define LXI_RX_SIZE		16384	// Initial receive buffer, grows as needed
+#define LXI_BLOCK_EOM_GRACE	100	// ms of silence ending an indefinite block
+
+#define STATE_CONNECTING	0
+#define STATE_HELLO		1	/* Broker or transport handshake */
+#define STATE_READY		2
+#define STATE_FAILED		3
+
+#define REPLY_NONE	0
+#define REPLY_LINE	1
+#define REPLY_BLOCK	2
+
+#define BLOCK_HEADER	0	/* Waiting for #<n><length> */
+#define BLOCK_DATA	1
+#define BLOCK_TRAILER	2	/* Waiting for the LF after the data */
+
+typedef struct lxi_request lxi_request_t;
+typedef struct lxi_transport lxi_transport_t;
+
+struct lxi_request {
+	lxi_request_t *next;
+	int reply;		/* REPLY_* */
+	struct iovec iov[3];	/* Data still to be sent */
+	int iov_first, iovcnt;
+	char *text;		/* Command (and block header), owned */
+	uint32_t id;		/* Message ID given by the transport */
+	lxi_done_t done;
+	lxi_sink_t sink;
+	lxi_match_t match;	/* Optional query, NULL if always answered */
+	void *ctx;
+};
+
+struct lxi_session {
+	int fd;
+	int state;		/* STATE_* */
+	int timeout;		/* ms */
+	int connect_timeout;	/* ms */
+	int status;		/* LXI_OK until failed */
+	char error[160];
+	bool corked;
+
+	/* Addresses of the instrument. With more than one each connection
+	 * attempt has its own socket, watched through race_fd, until the first
+	 * one is established. */
+	struct sockaddr_storage addrs[LXI_MAX_ADDRS];
+	int addr_count;
+	int attempts;		/* Addresses tried so far */
+	int race[LXI_MAX_ADDRS];	/* Sockets of the attempts, -1 when done */
+	int racing;		/* Attempts under way */
+	int race_fd;		/* epoll descriptor, -1 unless racing */
+	int race_error;		/* errno of the last failed attempt */
+	struct timespec stagger;	/* Start of the next attempt */
+	struct sockaddr_storage peer;	/* Address connected to */
+
+	/* Broker handshake */
+	char hello[96];
+	size_t hello_length, hello_sent;
+
+	lxi_request_t *send_head, *send_tail;	/* Not completely sent */
+	lxi_request_t *reply_head, *reply_tail;	/* Waiting for the response */
+	int pending;
+
+	/* Received data. The buffer doubles when a response does not fit and
+	 * is kept for the following responses. */
+	char *rx;
+	size_t rx_size;
+	size_t rx_start, rx_end;
+	size_t rx_scanned;	/* Searched for the LF up to here */
+	struct timespec deadline;	/* Connect or response timeout */
+
+	/* Block response */
+	int block;		/* BLOCK_* */
+	long block_left;	/* Data bytes to come, -1 for indefinite length */
+	long block_total;
+	char chunk[LXI_BLOCK_CHUNK];
+	size_t staged;
+	struct timespec quiet;	/* End of the block when nothing arrives */
+
+	/* Transport, NULL for raw sockets */
+	const lxi_transport_t *transport;
+	void *protocol;		/* State of the transport */
+	bool waiting;		/* The transport waits for the instrument */
+
+	lxi_stats_t stats;
+};
+
+/* Fail the session and complete all requests with status */
+int lxi_fail(lxi_session_t *session, int status, const char *format, ...);
+
+/* Count data sent to and received from the instrument. lxi_received()
+ * also restarts the response timers. */
+void lxi_sent(lxi_session_t *session, size_t length);
+void lxi_received(lxi_session_t *session, size_t length);
+
+/* The request at the head of the send queue has been sent: complete it,
+ * or move it to the queue waiting for responses */
+int lxi_request_sent(lxi_session_t *session);
+
+/* Complete the optional query waiting for a response without one */
+void lxi_unanswered(lxi_session_t *session);
+
+/* Make room for more data at the end of the receive buffer */
+int lxi_rx_reserve(lxi_session_t *session);
+
+/* Complete requests with the responses in the receive buffer. quiet tells
+ * that no more data follows for now. */
+void lxi_parse(lxi_session_t *session, bool quiet);
+
+/* Close the connection and connect again to the same address at port, or
+ * at the same port if it is 0, from STATE_CONNECTING */
+int lxi_reconnect(lxi_session_t *session, unsigned int port);
+
+/* A protocol other than SCPI over a raw socket. connected() is called in
+ * STATE_HELLO each time the connection (or another one the transport
+ * started with lxi_reconnect()) is established; flush() and receive() do
+ * all I/O possible without blocking. */
+struct lxi_transport {
+	int (*connected)(lxi_session_t *session);
+	int (*flush)(lxi_session_t *session);
+	int (*receive)(lxi_session_t *session);
+	short (*events)(const lxi_session_t *session);
+	void (*close)(lxi_session_t *session);
+};
+
+/* Set up the transport before connecting. port is changed when the
+ * connection starts elsewhere, at the portmapper for VXI-11 if it is 0,
+ * or when 0 selects a default port. */
+int vxi11_open(lxi_session_t *session, unsigned int *port);
+int hislip_open(lxi_session_t *session, unsigned int *port);
+
+#endif
@@ -0,0 +1,835 @@
+/*
+ * lxi-sim - Simulated TTi TG5011 for benchmarking lxi-control
+ *
+ * Listens on the raw SCPI port and answers *IDN?, *OPC?, *ESR?,
+ * SYST:ERR?, ARBxDEF?, ARBx? and accepts ARBx <block> uploads and
+ * ARBxDEF <name>,<interpolation>,<points>, keeping the waveforms in memory.
+ * SIM:LINE? <length> answers a line of <length> characters, to test long
+ * responses. Other commands are accepted and ignored, other queries raise
+ * a command error like on the instrument. The RPC GETPORT broadcast of
+ * lxi-control --discover is answered on the portmapper port.
+ *
+ * Responses are sent like the instrument does, in a first segment of 1432
+ * bytes followed by segments of 1426 bytes. Latency, jitter, a bandwidth
+ * limit in both directions and dropped responses can be added to exercise the timeouts and
+ * the throughput of the client. Other segment sizes, indefinite length
+ * blocks and blocks without the trailing LF exercise its parsers.
+ *
+ * One epoll loop serves all connections. Each response is queued with the
+ * time it may be sent, the loop sleeps until the first one is due.
+ *
+ * This program is free software; you can redistribute  it and/or modify it
+ * under  the terms of  the GNU General  Public License as published by the
+ * Free Software Foundation;  either version 2 of the  License, or (at your
+ * option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <getopt.h>
+#include <math.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define SIM_PORT		9221	// Raw SCPI port of the TG5011
+#define SIM_RPC_PORT		111	// Portmapper answering discovery
+#define SIM_FIRST_SEGMENT	1432	// Size of the first segment of a response
+#define SIM_SEGMENT		1426	// Size of the following segments
+#define SIM_POINTS		8192	// Points of the default waveforms
+#define SIM_MAX_INPUT		(16 << 20)	// Largest command or upload
+#define SIM_MAX_LINE		(256 << 20)	// Longest SIM:LINE? response
+#define SIM_ERRORS		16	// Error queue length
+#define SIM_EVENTS		64
+#define SIM_IDN			"THURLBY THANDAR, TG5011, 000000, 4.01 - 1.60 - 2.02 (SIM)"
+
+#define ESR_COMMAND_ERROR	0x20
+
+typedef struct response response_t;
+
+struct response {
+	response_t *next;
+	char *data;
+	size_t length, sent;
+	uint64_t due;		/* ns, not sent before */
+};
+
+typedef struct client client_t;
+
+struct client {
+	client_t *next;
+	int fd;
+	char *in;		/* Received, not yet handled */
+	size_t in_length, in_size;
+	response_t *head, *tail;
+	uint64_t last_due;	/* Responses keep their order */
+	uint64_t ready;		/* Bandwidth limit, nothing sent before */
+	uint64_t read_ready;	/* Bandwidth limit, nothing read before */
+	bool blocked;		/* Socket full, waiting for EPOLLOUT */
+	bool throttled;		/* Not reading until read_ready */
+	int errors[SIM_ERRORS];	/* SYST:ERR? queue */
+	int error_count;
+	int esr;
+};
+
+typedef struct {
+	char name[40];
+	char interpolation[4];
+	uint16_t *data;		/* Big endian samples as sent */
+	size_t points;
+} arb_t;
+
+/* Settings */
+static int port = SIM_PORT;
+static int rpcPort = SIM_RPC_PORT;
+static double latency;		/* ms */
+static double jitter;		/* ms */
+static double bandwidth;	/* Bytes per second, 0 for no limit */
+static double dropRate;		/* Percent of responses not sent */
+static bool segments = true;
+static size_t segmentSize;	/* 0 for the segments of the instrument */
+static bool indefinite;		/* ARBx? answers #0 blocks */
+static bool blockLf = true;	/* LF after definite length blocks */
+static bool debug;
+
+static arb_t arbs[4];
+static client_t *clients;
+static int epfd;
+
+static void usage(void)
+{
+	printf("Usage: lxi-sim [options]\n\n");
+	printf("--port       <port>    SCPI port, 0 for any free one (default: %d)\n", SIM_PORT);
+	printf("--rpc-port   <port>    Portmapper port answering discovery, 0 for none (default: %d)\n",
+			SIM_RPC_PORT);
+	printf("--latency    <ms>      Delay of every response\n");
+	printf("--jitter     <ms>      Random extra delay of up to <ms>\n");
+	printf("--bandwidth  <bytes/s> Limit the rate responses are sent and commands read at\n");
+	printf("--drop       <percent> Responses and discovery replies not sent\n");
+	printf("--no-segments          Send responses in one piece instead of 1432/1426 byte segments\n");
+	printf("--segment    <bytes>   Send responses in segments of <bytes>\n");
+	printf("--indefinite           Read back waveforms as #0 blocks\n");
+	printf("--no-block-lf          No LF after definite length blocks\n");
+	printf("--seed       <number>  Seed of jitter and drops\n");
+	printf("--debug                Print commands\n");
+	printf("--help                 Display help\n");
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static void *xmalloc(size_t size)
+{
+	void *p = malloc(size);
+
+	if (p == NULL)
+	{
+		fprintf(stderr, "Out of memory\n");
+		exit(3);
+	}
+	return p;
+}
+
+/* Fill the waveforms with a sine of one period */
+static void arb_init(void)
+{
+	size_t i;
+	int a;
+
+	for (a = 0; a < 4; a++)
+	{
+		snprintf(arbs[a].name, sizeof(arbs[a].name), "SINE%d", a + 1);
+		strcpy(arbs[a].interpolation, "ON");
+		arbs[a].points = SIM_POINTS;
+		arbs[a].data = xmalloc(SIM_POINTS * sizeof(uint16_t));
+		for (i = 0; i < SIM_POINTS; i++)
+			arbs[a].data[i] = htons(8192 + 8191 * sin(2 * M_PI * i / SIM_POINTS));
+	}
+}
+
+/* Queue a response, or drop it */
+static void respond(client_t *client, const void *data, size_t length)
+{
+	response_t *response;
+	uint64_t due;
+
+	if (dropRate > 0 && drand48() * 100 < dropRate)
+	{
+		if (debug)
+			printf("%d: response dropped\n", client->fd);
+		return;
+	}
+
+	response = xmalloc(sizeof(response_t));
+	response->data = xmalloc(length);
+	memcpy(response->data, data, length);
+	response->length = length;
+	response->sent = 0;
+	response->next = NULL;
+
+	due = now_ns() + (latency + drand48() * jitter) * 1e6;
+	if (due < client->last_due)
+		due = client->last_due;
+	response->due = client->last_due = due;
+
+	if (client->tail != NULL)
+		client->tail->next = response;
+	else
+		client->head = response;
+	client->tail = response;
+}
+
+static void respond_line(client_t *client, const char *line)
+{
+	char buf[128];
+	int length;
+
+	length = snprintf(buf, sizeof(buf), "%s\n", line);
+	respond(client, buf, length);
+}
+
+static void command_error(client_t *client, int error)
+{
+	client->esr |= ESR_COMMAND_ERROR;
+	if (client->error_count < SIM_ERRORS)
+		client->errors[client->error_count++] = error;
+}
+
+/* ARBx <block> of length bytes */
+static void arb_upload(int a, const char *data, size_t length)
+{
+	free(arbs[a].data);
+	arbs[a].data = xmalloc(length + 1);
+	memcpy(arbs[a].data, data, length);
+	arbs[a].points = length / 2;
+}
+
+static void arb_readback(client_t *client, int a)
+{
+	size_t length = arbs[a].points * 2;
+	char header[24];
+	char *buf;
+	int n;
+
+	if (indefinite)
+		n = snprintf(header, sizeof(header), "#0");
+	else
+		n = snprintf(header, sizeof(header), "#%d%zu",
+				snprintf(NULL, 0, "%zu", length), length);
+	buf = xmalloc(n + length + 1);
+	memcpy(buf, header, n);
+	memcpy(buf + n, arbs[a].data, length);
+	buf[n + length] = '\n';
+	respond(client, buf, n + length + (indefinite || blockLf));
+	free(buf);
+}
+
+/* SIM:LINE? <length> */
+static void long_line(client_t *client, const char *arg)
+{
+	char *end, *buf;
+	size_t length, i;
+
+	length = strtoul(arg, &end, 10);
+	if (end == arg || *end != 0 || length > SIM_MAX_LINE)
+	{
+		command_error(client, -222);
+		return;
+	}
+	buf = xmalloc(length + 1);
+	for (i = 0; i < length; i++)
+		buf[i] = 'A' + i % 26;
+	buf[length] = '\n';
+	respond(client, buf, length + 1);
+	free(buf);
+}
+
+/* Handle one command of a line */
+static void command(client_t *client, char *cmd)
+{
+	char buf[128], name[40], interpolation[4];
+	char *end;
+	int a, error;
+
+	while (isspace((unsigned char) *cmd))
+		cmd++;
+	end = cmd + strlen(cmd);
+	while (end > cmd && isspace((unsigned char) end[-1]))
+		*--end = 0;
+	if (*cmd == 0)
+		return;
+	if (debug)
+		printf("%d: %s\n", client->fd, cmd);
+
+	a = (strncasecmp(cmd, "ARB", 3) == 0 && cmd[3] >= '1' && cmd[3] <= '4') ?
+			cmd[3] - '1' : -1;
+
+	if (strcasecmp(cmd, "*IDN?") == 0)
+		respond_line(client, SIM_IDN);
+	else if (strcasecmp(cmd, "*OPC?") == 0)
+		respond_line(client, "1");
+	else if (strcasecmp(cmd, "*ESR?") == 0)
+	{
+		snprintf(buf, sizeof(buf), "%d", client->esr);
+		client->esr = 0;
+		respond_line(client, buf);
+	}
+	else if (strcasecmp(cmd, "*CLS") == 0)
+	{
+		client->esr = 0;
+		client->error_count = 0;
+	}
+	else if (strcasecmp(cmd, "SYST:ERR?") == 0 ||
+			strcasecmp(cmd, "SYSTEM:ERROR?") == 0)
+	{
+		if (client->error_count == 0)
+			respond_line(client, "0, \"No error\"");
+		else
+		{
+			error = client->errors[0];
+			memmove(client->errors, client->errors + 1,
+					--client->error_count * sizeof(int));
+			snprintf(buf, sizeof(buf), "%d, \"%s\"", error,
+					error == -113 ? "Undefined header" : "Data out of range");
+			respond_line(client, buf);
+		}
+	}
+	else if (a >= 0 && strcasecmp(cmd + 4, "DEF?") == 0)
+	{
+		snprintf(buf, sizeof(buf), "%s,%s,%zu", arbs[a].name,
+				arbs[a].interpolation, arbs[a].points);
+		respond_line(client, buf);
+	}
+	else if (a >= 0 && strncasecmp(cmd + 4, "DEF ", 4) == 0)
+	{
+		if (sscanf(cmd + 8, " %39[^,],%3[^,]", name, interpolation) == 2)
+		{
+			strcpy(arbs[a].name, name);
+			strcpy(arbs[a].interpolation, interpolation);
+		}
+		else
+			command_error(client, -222);
+	}
+	else if (a >= 0 && strcmp(cmd + 4, "?") == 0)
+		arb_readback(client, a);
+	else if (strncasecmp(cmd, "SIM:LINE? ", 10) == 0)
+		long_line(client, cmd + 10);
+	else if (end[-1] == '?')
+		command_error(client, -113);
+}
+
+/* Handle a line, commands are separated by ';' */
+static void line(client_t *client, char *text)
+{
+	char *next;
+
+	while (text != NULL)
+	{
+		next = strchr(text, ';');
+		if (next != NULL)
+			*next++ = 0;
+		command(client, text);
+		text = next;
+	}
+}
+
+/* Length of the ARBx <block> command at data, 0 if it is not complete yet
+ * and -1 if it is not an upload */
+static long upload(client_t *client, char *data, size_t length)
+{
+	size_t i = 4, digits, size;
+	char number[10];
+
+	if (length < 4)
+		return memchr(data, '\n', length) ? -1 : 0;
+	if (strncasecmp(data, "ARB", 3) != 0 || data[3] < '1' || data[3] > '4')
+		return -1;
+	while (i < length && data[i] == ' ')
+		i++;
+	if (i == length)
+		return 0;
+	if (data[i] != '#')
+		return -1;
+
+	/* #<digits><size><data> */
+	if (length < i + 2)
+		return 0;
+	digits = data[i + 1] - '0';
+	if (digits < 1 || digits > 9)
+	{
+		/* Not a definite length block, handled as a line */
+		return -1;
+	}
+	if (length < i + 2 + digits)
+		return 0;
+	memcpy(number, &data[i + 2], digits);
+	number[digits] = 0;
+	size = strtoul(number, NULL, 10);
+	i += 2 + digits;
+	if (i + size > SIM_MAX_INPUT)
+		return -2;
+	if (length < i + size)
+		return 0;
+
+	if (debug)
+		printf("%d: ARB%c <%zu bytes>\n", client->fd, data[3], size);
+	arb_upload(data[3] - '1', &data[i], size);
+	i += size;
+
+	/* The terminating LF */
+	if (i < length && data[i] == '\n')
+		i++;
+	return i;
+}
+
+static void client_close(client_t *client)
+{
+	client_t **p;
+	response_t *response;
+
+	for (p = &clients; *p != client; p = &(*p)->next)
+		;
+	*p = client->next;
+
+	while ((response = client->head) != NULL)
+	{
+		client->head = response->next;
+		free(response->data);
+		free(response);
+	}
+	if (debug)
+		printf("%d: closed\n", client->fd);
+	close(client->fd);
+	free(client->in);
+	free(client);
+}
+
+static void watch(client_t *client)
+{
+	struct epoll_event ev = { 0 };
+
+	ev.events = (client->throttled ? 0 : EPOLLIN) |
+			(client->blocked ? EPOLLOUT : 0);
+	ev.data.ptr = client;
+	epoll_ctl(epfd, EPOLL_CTL_MOD, client->fd, &ev);
+}
+
+/* Read and handle commands, returns false when the client is gone */
+static bool client_read(client_t *client)
+{
+	ssize_t n;
+	size_t done, size;
+	long length;
+	uint64_t now;
+	char *lf;
+
+	while (1)
+	{
+		if (bandwidth > 0)
+		{
+			now = now_ns();
+			if (client->read_ready > now)
+			{
+				/* Until then, see main() */
+				client->throttled = true;
+				watch(client);
+				return true;
+			}
+			if (client->read_ready < now)
+				client->read_ready = now;
+		}
+
+		if (client->in_length == client->in_size)
+		{
+			if (client->in_size >= SIM_MAX_INPUT)
+				return false;
+			client->in_size = client->in_size ? client->in_size * 2 : 4096;
+			client->in = realloc(client->in, client->in_size + 1);
+			if (client->in == NULL)
+			{
+				fprintf(stderr, "Out of memory\n");
+				exit(3);
+			}
+		}
+		/* Reads of 10 ms at the bandwidth limit */
+		size = client->in_size - client->in_length;
+		if (bandwidth > 0 && size > bandwidth / 100 + 1)
+			size = bandwidth / 100 + 1;
+		n = recv(client->fd, &client->in[client->in_length], size, 0);
+		if (n == 0)
+			return false;
+		if (n == -1)
+			return errno == EAGAIN || errno == EINTR;
+		client->in_length += n;
+		if (bandwidth > 0)
+			client->read_ready += n * 1e9 / bandwidth;
+
+		done = 0;
+		while (done < client->in_length)
+		{
+			length = upload(client, &client->in[done], client->in_length - done);
+			if (length == -2)
+				return false;
+			if (length == 0)
+				break;
+			if (length > 0)
+			{
+				done += length;
+				continue;
+			}
+			lf = memchr(&client->in[done], '\n', client->in_length - done);
+			if (lf == NULL)
+				break;
+			*lf = 0;
+			line(client, &client->in[done]);
+			done = lf - client->in + 1;
+		}
+		memmove(client->in, &client->in[done], client->in_length - done);
+		client->in_length -= done;
+	}
+}
+
+/* Send the due responses, returns false when the client is gone */
+static bool client_write(client_t *client, uint64_t now)
+{
+	response_t *response;
+	size_t length, segment;
+	ssize_t n;
+
+	while ((response = client->head) != NULL && response->due <= now &&
+			client->ready <= now)
+	{
+		length = response->length - response->sent;
+		if (segments)
+		{
+			segment = segmentSize ? segmentSize :
+					response->sent == 0 ? SIM_FIRST_SEGMENT : SIM_SEGMENT;
+			if (length > segment)
+				length = segment;
+		}
+		n = send(client->fd, &response->data[response->sent], length,
+				MSG_NOSIGNAL);
+		if (n == -1)
+		{
+			if (errno != EAGAIN && errno != EINTR)
+				return false;
+			client->blocked = true;
+			return true;
+		}
+		response->sent += n;
+
+		if (bandwidth > 0)
+		{
+			if (client->ready < now)
+				client->ready = now;
+			client->ready += n * 1e9 / bandwidth;
+		}
+
+		if (response->sent == response->length)
+		{
+			client->head = response->next;
+			if (client->head == NULL)
+				client->tail = NULL;
+			free(response->data);
+			free(response);
+		}
+	}
+	return true;
+}
+
+static void accept_clients(int listener)
+{
+	struct epoll_event ev = { 0 };
+	client_t *client;
+	int fd, one = 1;
+
+	while ((fd = accept4(listener, NULL, NULL, SOCK_NONBLOCK)) != -1)
+	{
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		client = calloc(1, sizeof(client_t));
+		if (client == NULL)
+		{
+			close(fd);
+			continue;
+		}
+		client->fd = fd;
+		client->next = clients;
+		clients = client;
+
+		ev.events = EPOLLIN;
+		ev.data.ptr = client;
+		epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+		if (debug)
+			printf("%d: connected\n", fd);
+	}
+}
+
+/* Answer RPC GETPORT calls with the SCPI port */
+static void answer_rpc(int fd)
+{
+	struct sockaddr_in from;
+	socklen_t length = sizeof(from);
+	uint32_t call[16], reply[7];
+	ssize_t n;
+
+	while ((n = recvfrom(fd, call, sizeof(call), 0, (struct sockaddr *) &from,
+					&length)) != -1)
+	{
+		length = sizeof(from);
+		if (n < 4)
+			continue;
+		if (dropRate > 0 && drand48() * 100 < dropRate)
+			continue;
+		if (debug)
+			printf("GETPORT from %s\n", inet_ntoa(from.sin_addr));
+
+		/* xid, REPLY, MSG_ACCEPTED, AUTH_NULL verifier, SUCCESS, port */
+		memset(reply, 0, sizeof(reply));
+		reply[0] = call[0];
+		reply[1] = htonl(1);
+		reply[6] = htonl(port);
+		sendto(fd, reply, sizeof(reply), 0, (struct sockaddr *) &from,
+				sizeof(from));
+	}
+}
+
+static int open_socket(int type, int port)
+{
+	struct sockaddr_in addr = { 0 };
+	int fd, one = 1;
+
+	fd = socket(AF_INET, type | SOCK_NONBLOCK, 0);
+	if (fd == -1)
+		return -1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons(port);
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1 ||
+			(type == SOCK_STREAM && listen(fd, SOMAXCONN) == -1))
+	{
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static void parse_options(int argc, char *argv[])
+{
+	static struct option options[] =
+	{
+		{"port",        required_argument, 0, 'p'},
+		{"rpc-port",    required_argument, 0, 'r'},
+		{"latency",     required_argument, 0, 'l'},
+		{"jitter",      required_argument, 0, 'j'},
+		{"bandwidth",   required_argument, 0, 'b'},
+		{"drop",        required_argument, 0, 'x'},
+		{"no-segments", no_argument,       0, 'n'},
+		{"segment",     required_argument, 0, 'g'},
+		{"indefinite",  no_argument,       0, 'i'},
+		{"no-block-lf", no_argument,       0, 'f'},
+		{"seed",        required_argument, 0, 's'},
+		{"debug",       no_argument,       0, 'd'},
+		{"help",        no_argument,       0, 'h'},
+		{0, 0, 0, 0}
+	};
+	int c;
+
+	while ((c = getopt_long(argc, argv, "p:r:l:j:b:x:ng:ifs:dh", options, NULL)) != -1)
+	{
+		switch (c)
+		{
+			case 'p':
+				port = atoi(optarg);
+				break;
+			case 'r':
+				rpcPort = atoi(optarg);
+				break;
+			case 'l':
+				latency = atof(optarg);
+				break;
+			case 'j':
+				jitter = atof(optarg);
+				break;
+			case 'b':
+				bandwidth = atof(optarg);
+				break;
+			case 'x':
+				dropRate = atof(optarg);
+				break;
+			case 'n':
+				segments = false;
+				break;
+			case 'g':
+				segmentSize = atol(optarg);
+				break;
+			case 'i':
+				indefinite = true;
+				break;
+			case 'f':
+				blockLf = false;
+				break;
+			case 's':
+				srand48(atol(optarg));
+				break;
+			case 'd':
+				debug = true;
+				break;
+			case 'h':
+				usage();
+				exit(0);
+			default:
+				exit(1);
+		}
+	}
+	if (optind < argc || latency < 0 || jitter < 0 || bandwidth < 0 ||
+			dropRate < 0 || dropRate > 100)
+	{
+		usage();
+		exit(1);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	struct epoll_event ev = { 0 }, events[SIM_EVENTS];
+	static int listenerTag, rpcTag;
+	client_t *client, *next;
+	uint64_t now, due;
+	struct sockaddr_in addr;
+	socklen_t addr_length = sizeof(addr);
+	int listener, rpc = -1;
+	int i, n, timeout;
+
+	srand48(time(NULL));
+	parse_options(argc, argv);
+	signal(SIGPIPE, SIG_IGN);
+	setvbuf(stdout, NULL, _IOLBF, 0);
+	arb_init();
+
+	epfd = epoll_create1(0);
+	listener = open_socket(SOCK_STREAM, port);
+	if (epfd == -1 || listener == -1)
+	{
+		fprintf(stderr, "Error listening on port %d: %s\n", port, strerror(errno));
+		exit(3);
+	}
+	ev.events = EPOLLIN;
+	ev.data.ptr = &listenerTag;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, listener, &ev);
+
+	/* Port 0 picks a free port, which is reported below */
+	if (port == 0 && getsockname(listener, (struct sockaddr *) &addr,
+				&addr_length) == 0)
+		port = ntohs(addr.sin_port);
+
+	if (rpcPort != 0)
+	{
+		rpc = open_socket(SOCK_DGRAM, rpcPort);
+		if (rpc == -1)
+		{
+			fprintf(stderr, "Error listening on UDP port %d: %s\n", rpcPort,
+					strerror(errno));
+			exit(3);
+		}
+		ev.data.ptr = &rpcTag;
+		epoll_ctl(epfd, EPOLL_CTL_ADD, rpc, &ev);
+	}
+	printf("Simulating TG5011 on port %d", port);
+	if (rpc != -1)
+		printf(", discovery on UDP port %d", rpcPort);
+	printf("\n");
+
+	while (1)
+	{
+		/* Send what is due and sleep until the next response is, or until
+		 * a throttled client may be read again */
+		now = now_ns();
+		timeout = -1;
+		for (client = clients; client != NULL; client = next)
+		{
+			next = client->next;
+			if (client->throttled)
+			{
+				if (client->read_ready <= now)
+				{
+					client->throttled = false;
+					watch(client);
+				}
+				else
+				{
+					n = (client->read_ready - now + 999999) / 1000000;
+					if (timeout == -1 || n < timeout)
+						timeout = n;
+				}
+			}
+			if (!client->blocked && !client_write(client, now))
+			{
+				client_close(client);
+				continue;
+			}
+			if (client->blocked)
+			{
+				watch(client);
+				continue;
+			}
+			if (client->head == NULL)
+				continue;
+			due = client->head->due > client->ready ? client->head->due :
+					client->ready;
+			n = (due - now + 999999) / 1000000;
+			if (timeout == -1 || n < timeout)
+				timeout = n;
+		}
+
+		n = epoll_wait(epfd, events, SIM_EVENTS, timeout);
+		if (n == -1 && errno != EINTR)
+		{
+			fprintf(stderr, "Error waiting for clients: %s\n", strerror(errno));
+			exit(3);
+		}
+
+		for (i = 0; i < n; i++)
+		{
+			if (events[i].data.ptr == &listenerTag)
+				accept_clients(listener);
+			else if (events[i].data.ptr == &rpcTag)
+				answer_rpc(rpc);
+			else
+			{
+				client = events[i].data.ptr;
+				if (events[i].events & EPOLLOUT)
+				{
+					client->blocked = false;
+					watch(client);
+				}
+				if ((events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) &&
+						!client_read(client))
+				{
+					/* Later events of this batch may be for the closed
+					 * client, so wait for new ones */
+					client_close(client);
+					break;
+				}
+			}
+		}
+	}
+}
@@ -0,0 +1,1099 @@
+/*
+ * lxi-control - Instrument session library
+ *
+ * Requests are kept in two queues: those still being sent and those
+ * waiting for their response. Responses are matched to the waiting
+ * requests in order, so queries may be pipelined. Received data is
+ * collected in one buffer per session; block data is streamed from it to
+ * the sink in chunks, so memory use does not depend on the block size.
+ *
+ * This program is free software; you can redistribute  it and/or modify it
+ * under  the terms of  the GNU General  Public License as published by the
+ * Free Software Foundation;  either version 2 of the  License, or (at your
+ * option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "lxi.h"
+#include "lxi-private.h"
+
+uint64_t lxi_now_ns(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+long lxi_until_ms(const struct timespec *t)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (t->tv_sec - now.tv_sec) * 1000L +
+		(t->tv_nsec - now.tv_nsec) / 1000000;
+}
+
+void lxi_set_deadline(struct timespec *t, long msec)
+{
+	clock_gettime(CLOCK_MONOTONIC, t);
+	t->tv_sec += msec / 1000;
+	t->tv_nsec += (msec % 1000) * 1000000L;
+	if (t->tv_nsec >= 1000000000L)
+	{
+		t->tv_sec++;
+		t->tv_nsec -= 1000000000L;
+	}
+}
+
+static void request_free(lxi_request_t *request)
+{
+	free(request->text);
+	free(request);
+}
+
+/* Complete the oldest request waiting for a response */
+static void reply_done(lxi_session_t *session, int status,
+		const char *response, size_t length)
+{
+	lxi_request_t *request = session->reply_head;
+
+	session->reply_head = request->next;
+	if (session->reply_head == NULL)
+		session->reply_tail = NULL;
+	session->pending--;
+	session->block = BLOCK_HEADER;
+	lxi_set_deadline(&session->deadline, session->timeout);
+
+	if (request->done != NULL)
+		request->done(session, status, response, length, request->ctx);
+	request_free(request);
+}
+
+/* Close the connection attempts still under way */
+static void race_end(lxi_session_t *session)
+{
+	int i;
+
+	if (session->race_fd == -1)
+		return;
+	for (i = 0; i < session->attempts; i++)
+		if (session->race[i] != -1)
+			close(session->race[i]);
+	close(session->race_fd);
+	session->race_fd = -1;
+	session->racing = 0;
+}
+
+void lxi_unanswered(lxi_session_t *session)
+{
+	reply_done(session, LXI_OK, NULL, 0);
+}
+
+int lxi_fail(lxi_session_t *session, int status, const char *format, ...)
+{
+	lxi_request_t *request;
+	va_list args;
+
+	if (session->state == STATE_FAILED)
+		return session->status;
+
+	va_start(args, format);
+	vsnprintf(session->error, sizeof(session->error), format, args);
+	va_end(args);
+	session->status = status;
+	session->state = STATE_FAILED;
+	race_end(session);
+	if (session->fd != -1)
+		close(session->fd);
+	session->fd = -1;
+
+	while (session->reply_head != NULL)
+		reply_done(session, status, NULL, 0);
+	while ((request = session->send_head) != NULL)
+	{
+		session->send_head = request->next;
+		session->pending--;
+		if (request->done != NULL)
+			request->done(session, status, NULL, 0, request->ctx);
+		request_free(request);
+	}
+	session->send_tail = NULL;
+
+	return status;
+}
+
+/* Parse a numeric IPv4 or IPv6 address, with the scope of link-local
+ * IPv6 addresses */
+static int parse_address(const char *ip, struct sockaddr_storage *addr)
+{
+	struct addrinfo hints = { 0 }, *result;
+
+	hints.ai_flags = AI_NUMERICHOST;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(ip, NULL, &hints, &result) != 0)
+		return -1;
+	memset(addr, 0, sizeof(*addr));
+	memcpy(addr, result->ai_addr, result->ai_addrlen);
+	freeaddrinfo(result);
+	return 0;
+}
+
+static void set_port(struct sockaddr_storage *addr, unsigned int port)
+{
+	if (addr->ss_family == AF_INET6)
+		((struct sockaddr_in6 *) addr)->sin6_port = htons(port);
+	else
+		((struct sockaddr_in *) addr)->sin_port = htons(port);
+}
+
+/* Alternate the address families, starting with the family of the first
+ * address, so a broken IPv6 or IPv4 network costs one attempt only
+ * (RFC 8305) */
+static void interleave(struct sockaddr_storage *addrs, int count)
+{
+	struct sockaddr_storage sorted[LXI_MAX_ADDRS];
+	bool taken[LXI_MAX_ADDRS] = { false };
+	sa_family_t family = addrs[0].ss_family;
+	int i, n;
+
+	for (n = 0; n < count; n++)
+	{
+		for (i = 0; i < count; i++)
+			if (!taken[i] && addrs[i].ss_family == family)
+				break;
+		/* None of that family left */
+		if (i == count)
+			for (i = 0; taken[i]; i++);
+		taken[i] = true;
+		sorted[n] = addrs[i];
+		family = addrs[i].ss_family == AF_INET6 ? AF_INET : AF_INET6;
+	}
+	memcpy(addrs, sorted, count * sizeof(*addrs));
+}
+
+/* Start a non-blocking TCP connection to addr in *fd. Returns
+ * LXI_ESYSTEM if the socket could not be created, LXI_ECONNECT if the
+ * connection failed at once, with errno set. */
+static int start_connect(const struct sockaddr_storage *addr, int *fd)
+{
+	int one = 1, error;
+
+	*fd = socket(addr->ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+			0);
+	if (*fd == -1)
+		return LXI_ESYSTEM;
+	setsockopt(*fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	if (connect(*fd, (const struct sockaddr *) addr,
+				addr->ss_family == AF_INET6 ? sizeof(struct sockaddr_in6) :
+				sizeof(struct sockaddr_in)) == -1 && errno != EINPROGRESS)
+	{
+		error = errno;
+		close(*fd);
+		*fd = -1;
+		errno = error;
+		return LXI_ECONNECT;
+	}
+	return LXI_OK;
+}
+
+/* Start connecting to the next address. Attempts which fail at once move
+ * on to the following one. */
+static int race_start(lxi_session_t *session)
+{
+	struct epoll_event event = { 0 };
+	int slot, fd, status;
+
+	while (session->attempts < session->addr_count)
+	{
+		slot = session->attempts++;
+		status = start_connect(&session->addrs[slot], &fd);
+		if (status == LXI_ESYSTEM)
+			return lxi_fail(session, LXI_ESYSTEM, "Error creating socket: %s",
+					strerror(errno));
+		if (status != LXI_OK)
+		{
+			session->race_error = errno;
+			continue;
+		}
+
+		event.events = EPOLLOUT;
+		event.data.u32 = slot;
+		if (epoll_ctl(session->race_fd, EPOLL_CTL_ADD, fd, &event) == -1)
+		{
+			close(fd);
+			return lxi_fail(session, LXI_ESYSTEM,
+					"Error waiting for connection: %s", strerror(errno));
+		}
+		session->race[slot] = fd;
+		session->racing++;
+		lxi_set_deadline(&session->stagger, LXI_CONNECT_STAGGER);
+		break;
+	}
+	if (session->racing == 0)
+		return lxi_fail(session, LXI_ECONNECT,
+				"Error establishing TCP connection: %s",
+				strerror(session->race_error));
+	return LXI_OK;
+}
+
+/* Keep the first connection established, start the next attempt when one
+ * fails or the previous one has not succeeded in time */
+static int race(lxi_session_t *session)
+{
+	struct epoll_event events[LXI_MAX_ADDRS];
+	int n, i, slot, fd, error;
+	socklen_t length;
+
+	n = epoll_wait(session->race_fd, events, LXI_MAX_ADDRS, 0);
+	for (i = 0; i < n; i++)
+	{
+		slot = events[i].data.u32;
+		fd = session->race[slot];
+		error = 0;
+		length = sizeof(error);
+		getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length);
+		session->race[slot] = -1;
+		session->racing--;
+		if (error == 0)
+		{
+			race_end(session);
+			session->fd = fd;
+			session->peer = session->addrs[slot];
+			return LXI_OK;
+		}
+		close(fd);
+		session->race_error = error;
+		lxi_set_deadline(&session->stagger, 0);
+	}
+
+	if (lxi_until_ms(&session->deadline) <= 0)
+		return lxi_fail(session, LXI_ECONNECT,
+				"Timeout establishing connection");
+	if (session->racing == 0 || lxi_until_ms(&session->stagger) <= 0)
+		return race_start(session);
+	return LXI_OK;
+}
+
+lxi_session_t *lxi_open(const char *ip, unsigned int port, int transport,
+		const char *broker, int timeout)
+{
+	return lxi_open_addrs(&ip, 1, port, transport, broker, timeout, timeout);
+}
+
+lxi_session_t *lxi_open_addrs(const char *const *ips, int count,
+		unsigned int port, int transport, const char *broker, int timeout,
+		int connect_timeout)
+{
+	lxi_session_t *session;
+	struct sockaddr_un local = { 0 };
+	int i, status;
+
+	session = calloc(1, sizeof(lxi_session_t));
+	if (session == NULL)
+		return NULL;
+	session->rx = malloc(LXI_RX_SIZE);
+	if (session->rx == NULL)
+	{
+		free(session);
+		return NULL;
+	}
+	session->rx_size = LXI_RX_SIZE;
+	session->fd = -1;
+	session->race_fd = -1;
+	session->timeout = timeout;
+	session->connect_timeout = connect_timeout;
+	session->stats.opened = lxi_now_ns();
+	session->state = STATE_CONNECTING;
+	lxi_set_deadline(&session->deadline, connect_timeout);
+
+	if (count < 1)
+	{
+		lxi_fail(session, LXI_EUSAGE, "No IP address");
+		return session;
+	}
+	if (broker != NULL)
+		count = 1;
+	else if (count > LXI_MAX_ADDRS)
+		count = LXI_MAX_ADDRS;
+	for (i = 0; i < count; i++)
+	{
+		if (parse_address(ips[i], &session->addrs[i]) != 0)
+		{
+			lxi_fail(session, LXI_EUSAGE, "Invalid IP address: %s", ips[i]);
+			return session;
+		}
+		session->race[i] = -1;
+	}
+	session->addr_count = count;
+
+	if (transport != LXI_RAW)
+	{
+		/* The broker only relays raw sockets */
+		if (broker != NULL)
+		{
+			lxi_fail(session, LXI_EUSAGE, "%s is not supported by the broker",
+					transport == LXI_VXI11 ? "VXI-11" : "HiSLIP");
+			return session;
+		}
+		if ((transport == LXI_VXI11 ?
+				vxi11_open(session, &port) :
+				hislip_open(session, &port)) != LXI_OK)
+			return session;
+	}
+	for (i = 0; i < count; i++)
+		set_port(&session->addrs[i], port);
+	session->peer = session->addrs[0];
+
+	if (broker != NULL)
+	{
+		/* The broker connects, the requests follow the CONNECT line */
+		if (strlen(broker) >= sizeof(local.sun_path))
+		{
+			lxi_fail(session, LXI_EUSAGE, "Broker socket name too long");
+			return session;
+		}
+		local.sun_family = AF_UNIX;
+		strcpy(local.sun_path, broker);
+		session->hello_length = snprintf(session->hello,
+				sizeof(session->hello), "CONNECT %s %u\n", ips[0], port);
+
+		session->fd = socket(AF_UNIX,
+				SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (session->fd == -1)
+			lxi_fail(session, LXI_ESYSTEM, "Error creating socket: %s",
+					strerror(errno));
+		else if (connect(session->fd, (struct sockaddr *)&local,
+					sizeof(local)) == -1 && errno != EINPROGRESS)
+			lxi_fail(session, LXI_ECONNECT, "Could not connect to broker %s: %s",
+					broker, strerror(errno));
+		return session;
+	}
+
+	if (count > 1)
+	{
+		interleave(session->addrs, count);
+		session->race_fd = epoll_create1(EPOLL_CLOEXEC);
+		if (session->race_fd == -1)
+			lxi_fail(session, LXI_ESYSTEM, "Error waiting for connection: %s",
+					strerror(errno));
+		else
+			race_start(session);
+		return session;
+	}
+
+	status = start_connect(&session->addrs[0], &session->fd);
+	if (status == LXI_ESYSTEM)
+		lxi_fail(session, LXI_ESYSTEM, "Error creating socket: %s",
+				strerror(errno));
+	else if (status != LXI_OK)
+		lxi_fail(session, LXI_ECONNECT, "Error establishing TCP connection: %s",
+				strerror(errno));
+	return session;
+}
+
+int lxi_reconnect(lxi_session_t *session, unsigned int port)
+{
+	int status;
+
+	if (session->fd != -1)
+		close(session->fd);
+	if (port != 0)
+		set_port(&session->peer, port);
+	status = start_connect(&session->peer, &session->fd);
+	if (status == LXI_ESYSTEM)
+		return lxi_fail(session, LXI_ESYSTEM, "Error creating socket: %s",
+				strerror(errno));
+	if (status != LXI_OK)
+		return lxi_fail(session, LXI_ECONNECT,
+				"Error establishing TCP connection: %s", strerror(errno));
+	session->state = STATE_CONNECTING;
+	lxi_set_deadline(&session->deadline, session->connect_timeout);
+	return LXI_OK;
+}
+
+void lxi_close(lxi_session_t *session)
+{
+	lxi_request_t *request;
+
+	if (session == NULL)
+		return;
+	if (session->transport != NULL)
+		session->transport->close(session);
+	race_end(session);
+	if (session->fd != -1)
+		close(session->fd);
+	while ((request = session->send_head) != NULL)
+	{
+		session->send_head = request->next;
+		request_free(request);
+	}
+	while ((request = session->reply_head) != NULL)
+	{
+		session->reply_head = request->next;
+		request_free(request);
+	}
+	free(session->rx);
+	free(session);
+}
+
+int lxi_block_header(char *header, size_t length)
+{
+	int digits = snprintf(NULL, 0, "%zu", length);
+
+	return sprintf(header, " #%d%zu", digits, length);
+}
+
+static int queue(lxi_session_t *session, const char *command, int reply,
+		const void *data, size_t length, bool block, lxi_done_t done,
+		lxi_sink_t sink, lxi_match_t match, void *ctx)
+{
+	static char lf[] = "\n";
+	lxi_request_t *request;
+	size_t command_length = strlen(command);
+
+	if (session->state == STATE_FAILED)
+		return session->status;
+
+	request = calloc(1, sizeof(lxi_request_t));
+	if (request != NULL)
+		request->text = malloc(command_length + 24 + 1);
+	if (request == NULL || request->text == NULL)
+	{
+		free(request);
+		return lxi_fail(session, LXI_ESYSTEM, "Out of memory");
+	}
+
+	/* Command, block header and data, then LF */
+	memcpy(request->text, command, command_length);
+	if (block)
+	{
+		command_length += lxi_block_header(request->text + command_length,
+				length);
+		request->iov[request->iovcnt].iov_base = request->text;
+		request->iov[request->iovcnt++].iov_len = command_length;
+		request->iov[request->iovcnt].iov_base = (void *) data;
+		request->iov[request->iovcnt++].iov_len = length;
+		request->iov[request->iovcnt].iov_base = lf;
+		request->iov[request->iovcnt++].iov_len = 1;
+	}
+	else
+	{
+		request->text[command_length++] = '\n';
+		request->iov[request->iovcnt].iov_base = request->text;
+		request->iov[request->iovcnt++].iov_len = command_length;
+	}
+	request->reply = reply;
+	request->done = done;
+	request->sink = sink;
+	request->match = match;
+	request->ctx = ctx;
+
+	if (session->send_tail != NULL)
+		session->send_tail->next = request;
+	else
+		session->send_head = request;
+	session->send_tail = request;
+	session->pending++;
+
+	return LXI_OK;
+}
+
+int lxi_write(lxi_session_t *session, const char *command, lxi_done_t done,
+		void *ctx)
+{
+	return queue(session, command, REPLY_NONE, NULL, 0, false, done, NULL,
+			NULL, ctx);
+}
+
+int lxi_write_block(lxi_session_t *session, const char *command,
+		const void *data, size_t length, lxi_done_t done, void *ctx)
+{
+	return queue(session, command, REPLY_NONE, data, length, true, done,
+			NULL, NULL, ctx);
+}
+
+int lxi_query(lxi_session_t *session, const char *command, lxi_done_t done,
+		void *ctx)
+{
+	return queue(session, command, REPLY_LINE, NULL, 0, false, done, NULL,
+			NULL, ctx);
+}
+
+int lxi_query_optional(lxi_session_t *session, const char *command,
+		lxi_match_t match, lxi_done_t done, void *ctx)
+{
+	return queue(session, command, REPLY_LINE, NULL, 0, false, done, NULL,
+			match, ctx);
+}
+
+int lxi_query_block(lxi_session_t *session, const char *command,
+		lxi_sink_t sink, lxi_done_t done, void *ctx)
+{
+	return queue(session, command, REPLY_BLOCK, NULL, 0, false, done, sink,
+			NULL, ctx);
+}
+
+int lxi_fd(const lxi_session_t *session)
+{
+	return session->race_fd != -1 ? session->race_fd : session->fd;
+}
+
+short lxi_events(const lxi_session_t *session)
+{
+	if (session->state == STATE_FAILED)
+		return 0;
+	if (session->state == STATE_CONNECTING)
+		return session->race_fd != -1 ? POLLIN : POLLOUT;
+	if (session->transport != NULL)
+		return session->transport->events(session);
+	if (session->hello_sent < session->hello_length ||
+			session->send_head != NULL)
+		return POLLIN | POLLOUT;
+	return POLLIN;
+}
+
+int lxi_timeout(const lxi_session_t *session)
+{
+	long wait = -1;
+
+	if (session->state == STATE_FAILED)
+		return -1;
+	if (session->state != STATE_READY || session->reply_head != NULL ||
+			session->waiting)
+		wait = lxi_until_ms(&session->deadline);
+	if (session->race_fd != -1 && session->attempts < session->addr_count &&
+			lxi_until_ms(&session->stagger) < wait)
+		wait = lxi_until_ms(&session->stagger);
+	if (session->transport == NULL && session->reply_head != NULL &&
+			session->block != BLOCK_HEADER &&
+			(session->block == BLOCK_TRAILER || session->block_left < 0) &&
+			session->rx_end - session->rx_start <= 1 &&
+			(wait == -1 || lxi_until_ms(&session->quiet) < wait))
+		wait = lxi_until_ms(&session->quiet);
+	return wait < 0 ? (wait == -1 ? -1 : 0) : (int) wait;
+}
+
+static void cork(lxi_session_t *session, bool on)
+{
+#ifdef TCP_CORK
+	int value = on;
+
+	if (session->hello_length == 0)
+		setsockopt(session->fd, IPPROTO_TCP, TCP_CORK, &value, sizeof(value));
+#endif
+	session->corked = on;
+}
+
+void lxi_sent(lxi_session_t *session, size_t length)
+{
+	session->stats.last_sent = lxi_now_ns();
+	if (session->stats.first_sent == 0)
+		session->stats.first_sent = session->stats.last_sent;
+	session->stats.bytes_sent += length;
+}
+
+void lxi_received(lxi_session_t *session, size_t length)
+{
+	session->stats.bytes_received += length;
+	if (session->state == STATE_READY)
+	{
+		session->stats.last_received = lxi_now_ns();
+		if (session->stats.first_received == 0)
+			session->stats.first_received = session->stats.last_received;
+	}
+	lxi_set_deadline(&session->deadline, session->timeout);
+	lxi_set_deadline(&session->quiet, LXI_BLOCK_EOM_GRACE);
+}
+
+int lxi_request_sent(lxi_session_t *session)
+{
+	lxi_request_t *request = session->send_head;
+
+	session->send_head = request->next;
+	if (session->send_head == NULL)
+		session->send_tail = NULL;
+	request->next = NULL;
+	if (request->reply == REPLY_NONE)
+	{
+		session->pending--;
+		if (request->done != NULL)
+			request->done(session, LXI_OK, NULL, 0, request->ctx);
+		request_free(request);
+		return session->status;
+	}
+	if (session->reply_head == NULL)
+		lxi_set_deadline(&session->deadline, session->timeout);
+	if (session->reply_tail != NULL)
+		session->reply_tail->next = request;
+	else
+		session->reply_head = request;
+	session->reply_tail = request;
+	return LXI_OK;
+}
+
+/* Send queued data until the socket is full */
+static int flush(lxi_session_t *session)
+{
+	lxi_request_t *request;
+	struct iovec *iov;
+	ssize_t length;
+
+	while (session->hello_sent < session->hello_length)
+	{
+		length = send(session->fd, session->hello + session->hello_sent,
+				session->hello_length - session->hello_sent, MSG_NOSIGNAL);
+		if (length == -1)
+			return (errno == EAGAIN) ? LXI_OK : lxi_fail(session, LXI_ECONNECT,
+					"Error sending to broker: %s", strerror(errno));
+		session->hello_sent += length;
+	}
+
+	while ((request = session->send_head) != NULL)
+	{
+		/* Blocks go out in full segments */
+		if (request->iovcnt > 1 && !session->corked)
+			cork(session, true);
+
+		iov = &request->iov[request->iov_first];
+		length = writev(session->fd, iov, request->iovcnt - request->iov_first);
+		if (length == -1)
+		{
+			if (errno == EAGAIN || errno == EINTR)
+				return LXI_OK;
+			return lxi_fail(session, LXI_ECONNECT,
+					"Error sending SCPI command: %s", strerror(errno));
+		}
+		lxi_sent(session, length);
+
+		/* Skip what was written */
+		while (request->iov_first < request->iovcnt &&
+				(size_t) length >= iov->iov_len)
+		{
+			length -= iov->iov_len;
+			iov++;
+			request->iov_first++;
+		}
+		if (request->iov_first < request->iovcnt)
+		{
+			iov->iov_base = (char *) iov->iov_base + length;
+			iov->iov_len -= length;
+			continue;
+		}
+
+		if (session->corked)
+			cork(session, false);
+		if (lxi_request_sent(session) != LXI_OK)
+			return session->status;
+	}
+	return LXI_OK;
+}
+
+/* Pass data on to the sink of the current block in whole chunks */
+static int block_data(lxi_session_t *session, const char *data, size_t length)
+{
+	lxi_request_t *request = session->reply_head;
+	size_t n;
+
+	session->block_total += length;
+	if (request->sink == NULL)
+		return LXI_OK;
+
+	/* Whole chunks directly from the receive buffer */
+	if (session->staged == 0)
+	{
+		while (length >= LXI_BLOCK_CHUNK)
+		{
+			if (request->sink(data, LXI_BLOCK_CHUNK, request->ctx))
+				return lxi_fail(session, LXI_ESYSTEM,
+							"Could not store block data");
+			data += LXI_BLOCK_CHUNK;
+			length -= LXI_BLOCK_CHUNK;
+		}
+	}
+
+	/* Collect the rest */
+	while (length > 0)
+	{
+		n = LXI_BLOCK_CHUNK - session->staged;
+		if (n > length)
+			n = length;
+		memcpy(&session->chunk[session->staged], data, n);
+		session->staged += n;
+		data += n;
+		length -= n;
+		if (session->staged == LXI_BLOCK_CHUNK)
+		{
+			if (request->sink(session->chunk, LXI_BLOCK_CHUNK, request->ctx))
+				return lxi_fail(session, LXI_ESYSTEM,
+							"Could not store block data");
+			session->staged = 0;
+		}
+	}
+	return LXI_OK;
+}
+
+static void block_done(lxi_session_t *session)
+{
+	lxi_request_t *request = session->reply_head;
+
+	if (session->staged > 0 && request->sink != NULL &&
+			request->sink(session->chunk, session->staged, request->ctx))
+	{
+		lxi_fail(session, LXI_ESYSTEM, "Could not store block data");
+		return;
+	}
+	session->staged = 0;
+	reply_done(session, LXI_OK, NULL, session->block_total);
+}
+
+/* Parse a block response (#<N><length><data> or #0<data><LF>) from the
+ * receive buffer. For indefinite length blocks the data ends with a LF
+ * after which the instrument stays silent for LXI_BLOCK_EOM_GRACE ms.
+ * Returns true when more data is needed. */
+static bool parse_block(lxi_session_t *session, bool quiet)
+{
+	char *rx = session->rx;
+	size_t available;
+	int digits, i;
+
+	if (session->block == BLOCK_HEADER)
+	{
+		available = session->rx_end - session->rx_start;
+		if (available < 2)
+			return true;
+		if (rx[session->rx_start] != '#' ||
+				!isdigit((unsigned char) rx[session->rx_start+1]))
+		{
+			lxi_fail(session, LXI_ESYSTEM, "Response is not block data");
+			return true;
+		}
+		digits = rx[session->rx_start+1] - '0';
+		if (available < (size_t) 2 + digits)
+			return true;
+		session->block_left = digits > 0 ? 0 : -1;
+		for (i = 0; i < digits; i++)
+		{
+			if (!isdigit((unsigned char) rx[session->rx_start+2+i]))
+			{
+				lxi_fail(session, LXI_ESYSTEM, "Invalid block header");
+				return true;
+			}
+			session->block_left = session->block_left * 10 +
+				rx[session->rx_start+2+i] - '0';
+		}
+		session->rx_start += 2 + digits;
+		session->block = BLOCK_DATA;
+		session->block_total = 0;
+		session->staged = 0;
+	}
+
+	if (session->block == BLOCK_DATA)
+	{
+		available = session->rx_end - session->rx_start;
+		if (session->block_left >= 0)
+		{
+			if (available > (size_t) session->block_left)
+				available = session->block_left;
+		}
+		else if (available > 0 && rx[session->rx_end-1] == '\n')
+		{
+			/* The LF ending an indefinite block is the last byte before
+			 * the instrument goes quiet, hold it back until then */
+			if (available == 1 && quiet)
+			{
+				session->rx_start++;
+				block_done(session);
+				return false;
+			}
+			available--;
+		}
+
+		if (available > 0)
+		{
+			if (block_data(session, &rx[session->rx_start], available) != LXI_OK)
+				return true;
+			session->rx_start += available;
+			if (session->block_left > 0)
+				session->block_left -= available;
+		}
+		if (session->block_left != 0)
+			return true;
+		session->block = BLOCK_TRAILER;
+	}
+
+	/* Consume the LF after a definite length block */
+	if (session->rx_end > session->rx_start)
+	{
+		if (rx[session->rx_start] == '\n')
+			session->rx_start++;
+	}
+	else if (!quiet)
+		return true;
+	block_done(session);
+	return false;
+}
+
+void lxi_parse(lxi_session_t *session, bool quiet)
+{
+	char *rx = session->rx;
+	char *lf;
+	size_t start;
+	int status;
+
+	while (session->state != STATE_FAILED)
+	{
+		if (session->state == STATE_HELLO)
+		{
+			/* OK or ERR <status> <message> from the broker */
+			lf = memchr(&rx[session->rx_start], '\n',
+					session->rx_end - session->rx_start);
+			if (lf == NULL)
+				break;
+			*lf = 0;
+			if (strcmp(&rx[session->rx_start], "OK") != 0)
+			{
+				status = LXI_ECONNECT;
+				sscanf(&rx[session->rx_start], "ERR %d", &status);
+				lf = strchr(&rx[session->rx_start], ' ');
+				if (lf != NULL)
+					lf = strchr(lf + 1, ' ');
+				lxi_fail(session, status, "Broker: %s",
+						lf != NULL ? lf + 1 : "Bad reply");
+				break;
+			}
+			session->rx_start = lf - rx + 1;
+			session->state = STATE_READY;
+			session->stats.connected = lxi_now_ns();
+			session->stats.bytes_received -= session->rx_start;
+			continue;
+		}
+
+		if (session->reply_head == NULL)
+		{
+			/* Nobody asked for this */
+			session->rx_start = session->rx_end;
+			break;
+		}
+
+		if (session->reply_head->reply == REPLY_BLOCK)
+		{
+			if (parse_block(session, quiet))
+				break;
+			quiet = false;
+			continue;
+		}
+
+		/* Long lines arrive in many pieces, only search the new data */
+		start = session->rx_scanned > session->rx_start ?
+				session->rx_scanned : session->rx_start;
+		lf = memchr(&rx[start], '\n', session->rx_end - start);
+		if (lf == NULL)
+		{
+			session->rx_scanned = session->rx_end;
+			break;
+		}
+		*lf = 0;
+		start = session->rx_start;
+		if (session->reply_head->match != NULL &&
+				session->reply_head->next != NULL &&
+				!session->reply_head->match(&rx[start], lf - &rx[start],
+					session->reply_head->ctx))
+		{
+			/* Not answered, the line is for the next request */
+			*lf = '\n';
+			lxi_unanswered(session);
+			continue;
+		}
+		session->rx_start = lf - rx + 1;
+		reply_done(session, LXI_OK, &rx[start], lf - &rx[start]);
+	}
+
+	if (session->rx_start == session->rx_end)
+		session->rx_start = session->rx_end = session->rx_scanned = 0;
+}
+
+int lxi_rx_reserve(lxi_session_t *session)
+{
+	size_t size;
+	char *rx;
+
+	/* Move unconsumed data to start of buffer */
+	if (session->rx_start > 0)
+	{
+		memmove(session->rx, &session->rx[session->rx_start],
+				session->rx_end - session->rx_start);
+		session->rx_end -= session->rx_start;
+		session->rx_scanned = session->rx_scanned > session->rx_start ?
+				session->rx_scanned - session->rx_start : 0;
+		session->rx_start = 0;
+	}
+
+	/* Grow the buffer for a response which does not fit */
+	if (session->rx_end == session->rx_size)
+	{
+		if (session->rx_size >= LXI_MAX_RESPONSE)
+			return lxi_fail(session, LXI_ESYSTEM, "Response exceeds %d bytes",
+					LXI_MAX_RESPONSE);
+		size = session->rx_size * 2;
+		if (size > LXI_MAX_RESPONSE)
+			size = LXI_MAX_RESPONSE;
+		rx = realloc(session->rx, size);
+		if (rx == NULL)
+			return lxi_fail(session, LXI_ESYSTEM, "Out of memory");
+		session->rx = rx;
+		session->rx_size = size;
+	}
+	return LXI_OK;
+}
+
+/* Read what has arrived */
+static int receive(lxi_session_t *session)
+{
+	ssize_t length;
+
+	while (session->state != STATE_FAILED)
+	{
+		if (lxi_rx_reserve(session) != LXI_OK)
+			break;
+		length = recv(session->fd, &session->rx[session->rx_end],
+				session->rx_size - session->rx_end, 0);
+		if (length == -1)
+		{
+			if (errno == EAGAIN || errno == EINTR)
+				break;
+			return lxi_fail(session, LXI_ESYSTEM, "Error reading response: %s",
+					strerror(errno));
+		}
+		if (length == 0)
+			return lxi_fail(session, LXI_ECONNECT, "Connection closed by %s",
+					session->hello_length ? "broker" : "instrument");
+
+		session->rx_end += length;
+		lxi_received(session, length);
+		lxi_parse(session, false);
+	}
+	return session->status;
+}
+
+int lxi_process(lxi_session_t *session, short revents)
+{
+	int error = 0;
+	socklen_t len = sizeof(error);
+
+	if (session->state == STATE_FAILED)
+		return session->status;
+
+	if (session->state == STATE_CONNECTING)
+	{
+		if (session->race_fd != -1)
+		{
+			if (race(session) != LXI_OK || session->race_fd != -1)
+				return session->status;
+		}
+		else if (revents == 0)
+		{
+			if (lxi_until_ms(&session->deadline) <= 0)
+				return lxi_fail(session, LXI_ECONNECT,
+						"Timeout establishing connection");
+			return LXI_OK;
+		}
+		else
+		{
+			getsockopt(session->fd, SOL_SOCKET, SO_ERROR, &error, &len);
+			if (error != 0)
+				return lxi_fail(session, LXI_ECONNECT,
+						"Error establishing connection: %s", strerror(error));
+		}
+		session->state = session->hello_length || session->transport ?
+				STATE_HELLO : STATE_READY;
+		if (session->state == STATE_READY)
+			session->stats.connected = lxi_now_ns();
+		lxi_set_deadline(&session->deadline, session->timeout);
+		if (session->transport != NULL &&
+				session->transport->connected(session) != LXI_OK)
+			return session->status;
+	}
+
+	if (session->transport != NULL)
+	{
+		if (session->transport->flush(session) != LXI_OK ||
+				session->transport->receive(session) != LXI_OK)
+			return session->status;
+	}
+	else if (flush(session) != LXI_OK || receive(session) != LXI_OK)
+		return session->status;
+
+	/* Timers. The transports mark the end of a response, they need no
+	 * quiet period. */
+	if (session->transport == NULL && session->reply_head != NULL &&
+			session->block != BLOCK_HEADER && lxi_until_ms(&session->quiet) <= 0)
+		lxi_parse(session, true);
+	if ((session->state == STATE_HELLO || session->reply_head != NULL ||
+			session->waiting) && lxi_until_ms(&session->deadline) <= 0)
+		return lxi_fail(session, LXI_ECONNECT, "Timeout waiting for %s",
+				session->state != STATE_HELLO ? "response" :
+				session->hello_length ? "broker" : "instrument");
+
+	return session->status;
+}
+
+int lxi_wait(lxi_session_t *session, int pending)
+{
+	struct pollfd pfd;
+	int n;
+
+	while (session->state != STATE_FAILED &&
+			(session->state != STATE_READY || session->pending > pending))
+	{
+		pfd.fd = lxi_fd(session);
+		pfd.events = lxi_events(session);
+		pfd.revents = 0;
+		n = poll(&pfd, 1, lxi_timeout(session));
+		if (n == -1 && errno != EINTR)
+			return lxi_fail(session, LXI_ESYSTEM,
+					"Error waiting for instrument: %s", strerror(errno));
+		lxi_process(session, n > 0 ? pfd.revents : 0);
+	}
+	return session->status;
+}
+
+int lxi_pending(const lxi_session_t *session)
+{
+	return session->pending;
+}
+
+int lxi_status(const lxi_session_t *session)
+{
+	return session->status;
+}
+
+const char *lxi_error(const lxi_session_t *session)
+{
+	return session->status == LXI_OK ? "No error" : session->error;
+}
+
+const lxi_stats_t *lxi_stats(const lxi_session_t *session)
+{
+	return &session->stats;
+}
@@ -0,0 +1,166 @@
+/*
+ * lxi-control - Instrument session library
+ *
+ * A session is one connection to an LXI instrument speaking SCPI over a
+ * raw socket, either directly or through the lxi-control broker, or over
+ * VXI-11 (SCPI in ONC RPC calls, as spoken by most LXI instruments) or
+ * HiSLIP (framed messages, pipelined in overlapped mode). All I/O
+ * is non-blocking: commands are queued and complete through callbacks
+ * while lxi_process() is called whenever the session file descriptor is
+ * ready, so any number of sessions can share the event loop of the
+ * application. lxi_wait() runs a session on its own for simple blocking
+ * use.
+ *
+ * Errors are returned as status codes which match the exit status of
+ * lxi-control. After an error the session is failed: pending requests are
+ * completed with the error and all later calls return it.
+ *
+ * This program is free software; you can redistribute  it and/or modify it
+ * under  the terms of  the GNU General  Public License as published by the
+ * Free Software Foundation;  either version 2 of the  License, or (at your
+ * option) any later version.
+ */
+
+#ifndef LXI_H
+#define LXI_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#define LXI_OK		0
+#define LXI_EUSAGE	1	/* Invalid argument or request */
+#define LXI_ECONNECT	2	/* Timeout or connection failed */
+#define LXI_ESYSTEM	3	/* System call failed or out of memory */
+
+/* Transports */
+#define LXI_RAW		0	/* SCPI over a raw TCP socket */
+#define LXI_VXI11	1	/* VXI-11 core channel */
+#define LXI_HISLIP	2	/* HiSLIP, port 0 for the default 4880 */
+
+#define LXI_MAX_ADDRS		8	/* Addresses raced by lxi_open_addrs() */
+#define LXI_CONNECT_STAGGER	250	/* ms between connection attempts */
+
+#define LXI_BLOCK_CHUNK	4096	/* Block data is passed on in chunks of this size */
+#define LXI_MAX_RESPONSE	(64 << 20)	/* Longest response line */
+
+typedef struct lxi_session lxi_session_t;
+
+/* Timing and traffic of a session. Times are CLOCK_MONOTONIC ns, 0 if the
+ * event has not happened yet. Only instrument traffic is counted, not the
+ * broker handshake. */
+typedef struct {
+	uint64_t opened;		/* lxi_open() called */
+	uint64_t connected;		/* Ready for requests */
+	uint64_t first_sent, last_sent;
+	uint64_t first_received, last_received;
+	uint64_t bytes_sent, bytes_received;
+} lxi_stats_t;
+
+/* Called when a request completes. For queries response holds the LF
+ * terminated response without its LF, valid during the call only; for
+ * block queries length is the number of data bytes. response is NULL for
+ * other requests and on error. */
+typedef void (*lxi_done_t)(lxi_session_t *session, int status,
+		const char *response, size_t length, void *ctx);
+
+/* Tells if a line is the response of an optional query, returns 0 if it
+ * answers the request queued after it */
+typedef int (*lxi_match_t)(const char *response, size_t length, void *ctx);
+
+/* Receiver of block data in LXI_BLOCK_CHUNK pieces (the last one may be
+ * shorter), returns non-zero on error */
+typedef int (*lxi_sink_t)(const void *data, size_t length, void *ctx);
+
+/* Start connecting to the instrument at ip:port (IPv4 or IPv6), through
+ * the broker listening on the Unix socket broker unless it is NULL.
+ * Requests may be queued at once. timeout is in ms, for connecting and
+ * for each response. For LXI_VXI11 port 0 asks the portmapper of the
+ * instrument for the port, and there is no broker. Returns NULL if out of
+ * memory; other errors fail the session. */
+lxi_session_t *lxi_open(const char *ip, unsigned int port, int transport,
+		const char *broker, int timeout);
+
+/* Like lxi_open() for an instrument reachable at count IPv4 or IPv6
+ * addresses (at most LXI_MAX_ADDRS are used). The addresses are raced:
+ * alternating the address families, the next one is tried
+ * LXI_CONNECT_STAGGER ms after the previous one or as soon as that fails,
+ * and the first connection established is kept. connect_timeout bounds
+ * each TCP connection setup in ms, timeout the handshakes and responses.
+ * The broker is only given the first address. */
+lxi_session_t *lxi_open_addrs(const char *const *ips, int count,
+		unsigned int port, int transport, const char *broker, int timeout,
+		int connect_timeout);
+
+/* Close the connection, pending requests are dropped without callback */
+void lxi_close(lxi_session_t *session);
+
+/* Queue a command without response, a LF is appended */
+int lxi_write(lxi_session_t *session, const char *command, lxi_done_t done,
+		void *ctx);
+
+/* Queue command followed by length bytes of data as a definite length
+ * block. data must stay valid until done is called. */
+int lxi_write_block(lxi_session_t *session, const char *command,
+		const void *data, size_t length, lxi_done_t done, void *ctx);
+
+/* Queue a query answered by one LF terminated line */
+int lxi_query(lxi_session_t *session, const char *command, lxi_done_t done,
+		void *ctx);
+
+/* Queue a query the instrument may not answer, like a query it rejects
+ * with a command error, followed by a query which is always answered. A
+ * line for which match returns 0 is left to that request once it has been
+ * sent, done is then called with LXI_OK and a NULL response. VXI-11 and HiSLIP in
+ * synchronized mode wait for each response before sending on, there an
+ * unanswered query still runs into the timeout. */
+int lxi_query_optional(lxi_session_t *session, const char *command,
+		lxi_match_t match, lxi_done_t done, void *ctx);
+
+/* Queue a query answered by an IEEE 488.2 block, the data is passed to
+ * sink as it arrives */
+int lxi_query_block(lxi_session_t *session, const char *command,
+		lxi_sink_t sink, lxi_done_t done, void *ctx);
+
+/* File descriptor to watch, and the poll(2) events to watch it for. The
+ * descriptor may change while connecting, so ask again after each call of
+ * lxi_process(). */
+int lxi_fd(const lxi_session_t *session);
+short lxi_events(const lxi_session_t *session);
+
+/* ms until lxi_process() must be called even if the descriptor is not
+ * ready, -1 if there is no timer */
+int lxi_timeout(const lxi_session_t *session);
+
+/* Do all I/O possible without blocking and run the callbacks of completed
+ * requests. revents are the poll(2) events of the descriptor, 0 on
+ * timeout. Returns the session status. */
+int lxi_process(lxi_session_t *session, short revents);
+
+/* Block until at most pending requests are outstanding and the connection
+ * is established. Returns the session status. */
+int lxi_wait(lxi_session_t *session, int pending);
+
+/* Number of requests not completed yet */
+int lxi_pending(const lxi_session_t *session);
+
+/* Status of the session and a message describing the error */
+int lxi_status(const lxi_session_t *session);
+const char *lxi_error(const lxi_session_t *session);
+
+/* Timing and traffic counters of the session */
+const lxi_stats_t *lxi_stats(const lxi_session_t *session);
+
+/* Write the " #<n><length>" header of a definite length block to header,
+ * which must hold 24 bytes. Returns the header length. */
+int lxi_block_header(char *header, size_t length);
+
+/* CLOCK_MONOTONIC in ns, the clock of lxi_stats_t */
+uint64_t lxi_now_ns(void);
+
+/* Set t to msec milliseconds from now, and the milliseconds from now until
+ * t, negative once it has passed */
+void lxi_set_deadline(struct timespec *t, long msec);
+long lxi_until_ms(const struct timespec *t);
+
+#endif
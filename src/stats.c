@@ -0,0 +1,156 @@
+/*
+ * lxi-control - Run statistics
+ *
+ * This program is free software; you can redistribute  it and/or modify it
+ * under  the terms of  the GNU General  Public License as published by the
+ * Free Software Foundation;  either version 2 of the  License, or (at your
+ * option) any later version.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "stats.h"
+
+typedef struct {
+	const char *name;
+	double value;
+	bool valid;		/* The phase happened */
+} metric_t;
+
+static const char *phaseNames[PHASES] = { "dns", "connect", "file_io", "plot" };
+
+static uint64_t runStarted;
+static uint64_t phaseStarted[PHASES];
+static uint64_t phaseTime[PHASES];
+static bool phaseSeen[PHASES];
+static uint64_t fileBytes;
+static lxi_stats_t network;
+
+void stats_init(void)
+{
+	runStarted = lxi_now_ns();
+}
+
+void stats_start(int phase)
+{
+	phaseStarted[phase] = lxi_now_ns();
+}
+
+void stats_stop(int phase)
+{
+	phaseTime[phase] += lxi_now_ns() - phaseStarted[phase];
+	phaseSeen[phase] = true;
+}
+
+void stats_file_bytes(size_t bytes)
+{
+	fileBytes += bytes;
+}
+
+void stats_session(const lxi_stats_t *session)
+{
+	network = *session;
+}
+
+/* Seconds from start to end, invalid unless both happened */
+static metric_t interval(const char *name, uint64_t start, uint64_t end)
+{
+	metric_t metric = { name, 0, start != 0 && end >= start };
+
+	if (metric.valid)
+		metric.value = (end - start) / 1e9;
+	return metric;
+}
+
+/* Bytes per second over the interval, invalid if it is empty */
+static metric_t rate(const char *name, uint64_t bytes, uint64_t start,
+		uint64_t end)
+{
+	metric_t metric = { name, 0, start != 0 && end > start };
+
+	if (metric.valid)
+		metric.value = bytes / ((end - start) / 1e9);
+	return metric;
+}
+
+void stats_print(FILE *fp, int format)
+{
+	metric_t phases[PHASES + 4], rates[2];
+	struct {
+		const char *name;
+		uint64_t value;
+	} counters[] = {
+		{ "bytes_sent", network.bytes_sent },
+		{ "bytes_received", network.bytes_received },
+		{ "file_bytes", fileBytes },
+	};
+	int count = 0, i;
+
+	for (i = 0; i < PHASES; i++)
+	{
+		phases[count].name = phaseNames[i];
+		phases[count].value = phaseTime[i] / 1e9;
+		phases[count++].valid = phaseSeen[i];
+	}
+	/* Connected until the first request went out, the wait for the
+	 * response and its transfer */
+	phases[count++] = interval("first_byte_sent", network.connected,
+			network.first_sent);
+	phases[count++] = interval("first_byte_received", network.first_sent,
+			network.first_received);
+	phases[count++] = interval("last_byte_received", network.first_received,
+			network.last_received);
+	phases[count++] = interval("total", runStarted, lxi_now_ns());
+
+	rates[0] = rate("send", network.bytes_sent, network.first_sent,
+			network.last_sent);
+	rates[1] = rate("receive", network.bytes_received, network.first_received,
+			network.last_received);
+
+	if (format == STATS_OPENMETRICS)
+	{
+		fprintf(fp, "# TYPE lxi_control_phase_seconds gauge\n");
+		fprintf(fp, "# UNIT lxi_control_phase_seconds seconds\n");
+		for (i = 0; i < count; i++)
+			if (phases[i].valid)
+				fprintf(fp, "lxi_control_phase_seconds{phase=\"%s\"} %.9f\n",
+						phases[i].name, phases[i].value);
+		for (i = 0; i < 3; i++)
+		{
+			fprintf(fp, "# TYPE lxi_control_%s counter\n", counters[i].name);
+			fprintf(fp, "lxi_control_%s_total %llu\n", counters[i].name,
+					(unsigned long long) counters[i].value);
+		}
+		fprintf(fp, "# TYPE lxi_control_throughput_bytes_per_second gauge\n");
+		for (i = 0; i < 2; i++)
+			if (rates[i].valid)
+				fprintf(fp, "lxi_control_throughput_bytes_per_second"
+						"{direction=\"%s\"} %.0f\n", rates[i].name,
+						rates[i].value);
+		fprintf(fp, "# EOF\n");
+		return;
+	}
+
+	fprintf(fp, "{");
+	for (i = 0; i < count; i++)
+	{
+		if (phases[i].valid)
+			fprintf(fp, "\"%s_seconds\":%.9f,", phases[i].name, phases[i].value);
+		else
+			fprintf(fp, "\"%s_seconds\":null,", phases[i].name);
+	}
+	for (i = 0; i < 3; i++)
+		fprintf(fp, "\"%s\":%llu,", counters[i].name,
+				(unsigned long long) counters[i].value);
+	for (i = 0; i < 2; i++)
+	{
+		if (rates[i].valid)
+			fprintf(fp, "\"%s_bytes_per_second\":%.0f", rates[i].name,
+					rates[i].value);
+		else
+			fprintf(fp, "\"%s_bytes_per_second\":null", rates[i].name);
+		fprintf(fp, i < 1 ? "," : "}\n");
+	}
+}
@@ -0,0 +1,48 @@
+/*
+ * lxi-control - Run statistics
+ *
+ * Time spent in each phase of a run is measured with the monotonic clock
+ * and dumped with --stats, as one JSON object or in the OpenMetrics text
+ * format. Network times and byte counts come from the lxi session.
+ *
+ * This program is free software; you can redistribute  it and/or modify it
+ * under  the terms of  the GNU General  Public License as published by the
+ * Free Software Foundation;  either version 2 of the  License, or (at your
+ * option) any later version.
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+#include "lxi.h"
+
+#define STATS_JSON		0
+#define STATS_OPENMETRICS	1
+
+/* Phases timed by the application */
+#define PHASE_DNS	0	/* Host name lookup */
+#define PHASE_CONNECT	1	/* Until the session is ready */
+#define PHASE_FILE	2	/* Reading and writing waveform files */
+#define PHASE_PLOT	3	/* Reducing and drawing the plot */
+#define PHASES		4
+
+/* Start the run clock */
+void stats_init(void);
+
+/* Add the time between start and stop to phase */
+void stats_start(int phase);
+void stats_stop(int phase);
+
+/* Count bytes read or written by file I/O */
+void stats_file_bytes(size_t bytes);
+
+/* Keep the network counters of a session before it is closed */
+void stats_session(const lxi_stats_t *session);
+
+/* Write all counters to fp */
+void stats_print(FILE *fp, int format);
+
+#endif
@@ -0,0 +1,94 @@
+# Helpers of the make check scripts, sourced by them. The programs are run
+# from the build directory against lxi-sim on a free port.
+
+TMP=$(mktemp -d) || exit 99
+trap 'stop_sim; rm -rf "$TMP"' EXIT
+
+# Keep the inventory, the waveform cache and the plots of read backs to
+# the tests
+LXI_CONTROL_CACHE_DIR=$TMP/cache
+HOME=$TMP
+export LXI_CONTROL_CACHE_DIR HOME
+unset LXI_CONTROL_BROKER
+
+SIM_PID=
+SIM_PORT=
+
+fail()
+{
+	echo "FAIL: $*" >&2
+	exit 1
+}
+
+# Start lxi-sim with the options given, setting SIM_PORT
+start_sim()
+{
+	stop_sim
+	rm -f "$TMP/sim.log"
+	./lxi-sim --port 0 --rpc-port 0 "$@" > "$TMP/sim.log" 2>&1 &
+	SIM_PID=$!
+	i=0
+	while [ $i -lt 50 ]; do
+		SIM_PORT=$(sed -n 's/^Simulating TG5011 on port \([0-9]*\).*/\1/p' "$TMP/sim.log" 2>/dev/null)
+		[ -n "$SIM_PORT" ] && return 0
+		sleep 0.1
+		i=$((i + 1))
+	done
+	cat "$TMP/sim.log" >&2
+	echo "ERROR: lxi-sim did not start" >&2
+	exit 99
+}
+
+stop_sim()
+{
+	if [ -n "$SIM_PID" ]; then
+		kill "$SIM_PID" 2>/dev/null
+		wait "$SIM_PID" 2>/dev/null
+	fi
+	SIM_PID=
+}
+
+# lxi-control talking to the simulator
+control()
+{
+	./lxi-control --ip 127.0.0.1 --port "$SIM_PORT" "$@"
+}
+
+now_ms()
+{
+	echo $(($(date +%s%N) / 1000000))
+}
+
+# Write a .csv file of one period of a sine with <points> lines
+sine_csv()
+{
+	awk -v n="$2" 'BEGIN { for (i = 0; i < n; i++)
+		printf "%d,%.6f\n", i, sin(2 * 3.141592653589793 * i / n) }' > "$1"
+}
+
+# Write a .wfm file of a rising ramp of <points> samples with an amplitude
+# header of <amplitude>, in the little endian format of Waveform Manager
+ramp_wfm()
+{
+	LC_ALL=C awk -v n="$2" -v a="$3" 'BEGIN {
+		printf "%c%c", a % 256, int(a / 256)
+		for (i = 0; i < n; i++) {
+			v = int((i - n / 2) * 16384 / n)
+			if (v < 0)
+				v += 65536
+			printf "%c%c", v % 256, int(v / 256)
+		} }' > "$1"
+}
+
+# Check that file holds <bytes> bytes
+expect_size()
+{
+	size=$(wc -c < "$1")
+	[ "$size" -eq "$2" ] || fail "$1 has $size bytes, expected $2"
+}
+
+# Value of <key> in the --stats JSON of file
+stats_value()
+{
+	sed -n "s/.*\"$2\":\([^,}]*\).*/\1/p" "$1"
+}
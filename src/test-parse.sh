@@ -0,0 +1,73 @@
+#!/bin/sh
+# Response parsing of lxi-control against lxi-sim, run by make check. Block
+# read backs are checked in one piece, in the segments of the instrument
+# and in segments small enough to split the #<N><length> and #0 headers
+# across reads, with and without the LF after the block. Lines longer than
+# the receive buffer must grow it up to LXI_MAX_RESPONSE and fail beyond.
+
+. "${srcdir:-.}/test-lib.sh"
+
+IDN="THURLBY THANDAR, TG5011, 000000, 4.01 - 1.60 - 2.02 (SIM)"
+MAX_RESPONSE=67108864
+
+sine_csv "$TMP/sine.csv" 100
+cat > "$TMP/readback.scr" <<EOF
+ARB1? $TMP/script.out
+*IDN?
+EOF
+
+# Upload 100 points, then read them back pipelined with a query after the
+# block and on their own
+check_readback()
+{
+	name=$1
+	shift
+	start_sim "$@"
+	control --scpi ARB1 --file "$TMP/sine.csv" --points 100 > /dev/null ||
+		fail "$name: upload"
+	control --script "$TMP/readback.scr" --pipeline 2 > "$TMP/script.log" 2>&1 ||
+		fail "$name: read back script, exit status $?: $(grep -v gnuplot "$TMP/script.log")"
+	grep -q "^$IDN\$" "$TMP/script.log" || fail "$name: *IDN? after the block"
+	control --scpi ARB1? --file "$TMP/single.out" > "$TMP/single.log" 2>&1 ||
+		fail "$name: read back, exit status $?: $(grep -v gnuplot "$TMP/single.log")"
+	expect_size "$TMP/script.out" 200
+	if [ -f "$TMP/expected.out" ]; then
+		cmp -s "$TMP/script.out" "$TMP/expected.out" ||
+			fail "$name: read back in a script differs"
+	else
+		cp "$TMP/script.out" "$TMP/expected.out"
+	fi
+	cmp -s "$TMP/single.out" "$TMP/expected.out" || fail "$name: read back differs"
+	echo "$name: ok"
+}
+
+for segment in "--no-segments" "" "--segment 1" "--segment 2" "--segment 3"; do
+	# Small segments need spacing to arrive in separate reads
+	case $segment in
+		--segment*) pace="--bandwidth 50000";;
+		*) pace=;;
+	esac
+	check_readback "block ${segment:-default}" $segment $pace
+	check_readback "#0 block ${segment:-default}" $segment $pace --indefinite
+	check_readback "block without LF ${segment:-default}" $segment $pace --no-block-lf
+done
+
+# Long lines, in one piece and in the segments of the instrument
+for segment in "--no-segments" ""; do
+	start_sim $segment
+	for length in 100000 1000000 $((MAX_RESPONSE - 1)); do
+		control --scpi "SIM:LINE? $length" > "$TMP/line.out" ||
+			fail "line of $length bytes ${segment:-default}"
+		size=$(tail -n 1 "$TMP/line.out" | wc -c)
+		[ "$size" -eq $((length + 1)) ] ||
+			fail "line of $length bytes ${segment:-default} has $size bytes"
+	done
+	control --scpi "SIM:LINE? $MAX_RESPONSE" > /dev/null 2> "$TMP/line.err" &&
+		fail "line of $MAX_RESPONSE bytes ${segment:-default} accepted"
+	grep -q "Response exceeds $MAX_RESPONSE bytes" "$TMP/line.err" ||
+		fail "line of $MAX_RESPONSE bytes ${segment:-default}: $(cat "$TMP/line.err")"
+	echo "long lines ${segment:-default}: ok"
+done
+rm -f "$TMP/line.out"
+
+exit 0
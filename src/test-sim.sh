@@ -0,0 +1,123 @@
+#!/bin/sh
+# Throughput and latency checks of lxi-control against lxi-sim, run by
+# make check. A wrong response fails the test, and so does a run slower
+# than its limit. The limits are far above what a plain Linux box reaches
+# on loopback, so they only catch regressions like lost pipelining.
+
+. "${srcdir:-.}/test-lib.sh"
+
+IDN="THURLBY THANDAR, TG5011, 000000, 4.01 - 1.60 - 2.02 (SIM)"
+
+# Queries are answered in order, also when pipelined
+start_sim
+i=0
+: > "$TMP/idn.scr"
+while [ $i -lt 200 ]; do
+	echo '*IDN?' >> "$TMP/idn.scr"
+	echo 'ARB1DEF?' >> "$TMP/idn.scr"
+	i=$((i + 1))
+done
+for depth in 1 16; do
+	control --script "$TMP/idn.scr" --pipeline $depth > "$TMP/idn.out" ||
+		fail "script with --pipeline $depth"
+	[ "$(grep -c "^$IDN\$" "$TMP/idn.out")" -eq 200 ] ||
+		fail "*IDN? responses with --pipeline $depth"
+	[ "$(grep -c '^SINE1,ON,8192$' "$TMP/idn.out")" -eq 200 ] ||
+		fail "ARB1DEF? responses with --pipeline $depth"
+	sed -n '1p;2p' "$TMP/idn.out" | tr '\n' '|' | grep -q "^$IDN|SINE1" ||
+		fail "responses out of order with --pipeline $depth"
+done
+
+# With 10 ms latency 100 queries take a second one by one, pipelining
+# must hide most of it
+start_sim --latency 10
+head -n 100 "$TMP/idn.scr" > "$TMP/latency.scr"
+start=$(now_ms)
+control --script "$TMP/latency.scr" --pipeline 20 > "$TMP/latency.out" ||
+	fail "pipelined script with latency"
+elapsed=$(($(now_ms) - start))
+[ "$(wc -l < "$TMP/latency.out")" -eq 100 ] || fail "pipelined responses"
+echo "100 queries at 10 ms latency, pipeline 20: $elapsed ms"
+[ $elapsed -lt 600 ] || fail "pipelined queries took $elapsed ms, limit 600 ms"
+
+# Upload and read back: a resampled .csv, then the .wfm the read back
+# wrote, which must come back unchanged
+start_sim
+sine_csv "$TMP/sine.csv" 1000
+cat > "$TMP/arb.scr" <<EOF
+ARB1 $TMP/sine.csv
+ARB1DEF?
+ARB1? $TMP/arb1.out
+ARB2 $TMP/arb1.out.wfm
+ARB2? $TMP/arb2.out
+EOF
+control --script "$TMP/arb.scr" --points 1000 > "$TMP/arb.log" ||
+	fail "upload and read back script"
+grep -q ',1000$' "$TMP/arb.log" || fail "ARB1DEF? after the upload"
+expect_size "$TMP/arb1.out" 2000
+expect_size "$TMP/arb1.out.wfm" 2002
+cmp -s "$TMP/arb1.out" "$TMP/arb2.out" || fail ".wfm read back and uploaded again differs"
+
+# The 32768 amplitude header of Waveform Manager is unsigned, resampling
+# must fit the ramp like the direct upload does and not turn it over
+ramp_wfm "$TMP/ramp.wfm" 1000 32768
+control --scpi ARB1 --file "$TMP/ramp.wfm" --adjust > /dev/null ||
+	fail "upload of a .wfm ramp"
+control --scpi ARB1? --file "$TMP/ramp.out" > /dev/null 2>&1 ||
+	fail "read back of a .wfm ramp"
+control --scpi ARB1 --file "$TMP/ramp.wfm" --adjust --points 1000 > /dev/null ||
+	fail "resampled upload of a .wfm ramp"
+control --scpi ARB1? --file "$TMP/resampled.out" > /dev/null 2>&1 ||
+	fail "read back of a resampled .wfm ramp"
+cmp -s "$TMP/ramp.out" "$TMP/resampled.out" ||
+	fail "resampled .wfm ramp differs from the direct upload"
+
+# Read back throughput of the largest waveform, with --stats
+sine_csv "$TMP/big.csv" 131072
+control --scpi ARB3 --file "$TMP/big.csv" --points 131072 > /dev/null ||
+	fail "upload of 131072 points"
+control --scpi ARB3? --file "$TMP/big.out" --stats 2> "$TMP/stats.json" > /dev/null ||
+	fail "read back of 131072 points"
+expect_size "$TMP/big.out" 262144
+received=$(stats_value "$TMP/stats.json" bytes_received)
+[ "$received" -ge 262144 ] || fail "--stats bytes_received is $received"
+rate=$(stats_value "$TMP/stats.json" receive_bytes_per_second)
+echo "Read back of 131072 points: $rate bytes/s"
+awk -v r="$rate" 'BEGIN { exit !(r > 10000000) }' ||
+	fail "read back at $rate bytes/s, limit 10 MB/s"
+stop_sim
+
+# --arb sends each waveform while the later ones are still converting. The
+# file of ARB2 is a FIFO which is only written once the simulator, reading
+# at a limited bandwidth, has received all of ARB1.
+start_sim --bandwidth 1000000 --debug
+sine_csv "$TMP/arb1.csv" 65536
+sine_csv "$TMP/arb2.csv" 100
+mkfifo "$TMP/slow.csv" || exit 99
+control --arb 1="$TMP/arb1.csv" --arb 2="$TMP/slow.csv" --points 65536 \
+	> "$TMP/arbset.log" 2>&1 &
+pid=$!
+start=$(now_ms)
+i=0
+while [ $i -lt 100 ] && ! grep -q 'ARB1 <131072 bytes>' "$TMP/sim.log"; do
+	sleep 0.05
+	i=$((i + 1))
+done
+elapsed=$(($(now_ms) - start))
+cat "$TMP/arb2.csv" > "$TMP/slow.csv"
+wait $pid || fail "--arb upload: $(cat "$TMP/arbset.log")"
+[ $i -lt 100 ] || fail "ARB1 was not sent while ARB2 was converting"
+echo "ARB1 received after $elapsed ms, before ARB2 was converted"
+grep -q 'ARB2 <131072 bytes>' "$TMP/sim.log" || fail "ARB2 was not sent"
+stop_sim
+
+# Conversion kernels: no allocations, and far from slow
+./lxi-bench --points 65536 --repeat 3 --csv > "$TMP/bench.csv" || fail "lxi-bench"
+cat "$TMP/bench.csv"
+awk -F, '$1 == "fit" || $1 == "swap" {
+		if ($7 != 0) { print "FAIL: " $1 " " $2 " allocates"; bad = 1 }
+		if ($4 > 20) { print "FAIL: " $1 " " $2 " takes " $4 " ns/sample, limit 20"; bad = 1 }
+	}
+	END { exit bad }' "$TMP/bench.csv" >&2 || exit 1
+
+exit 0
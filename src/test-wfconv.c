@@ -0,0 +1,178 @@
+/*
+ * test-wfconv - Check of the waveform conversion kernels, run by make check
+ *
+ * Every kernel set the CPU supports is compared against the scalar one for
+ * all int16 samples at a range of amplitudes, including negative ones and
+ * ones beyond the vector kernels, and the scalar fit is compared against
+ * the original double precision conversion. The byte swap is checked for
+ * all lengths up to a few vectors, unaligned sources and in place.
+ *
+ * This program is free software; you can redistribute  it and/or modify it
+ * under  the terms of  the GNU General  Public License as published by the
+ * Free Software Foundation;  either version 2 of the  License, or (at your
+ * option) any later version.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <arpa/inet.h>
+
+#include "wfconv.h"
+
+#define TEST_SAMPLES	65536		// All int16 values
+#define TEST_TAIL	70		// Lengths checked for the tails
+
+static const char *kernels[] = { "avx2", "sse2" };
+
+/* Beyond 65535 the vector kernels fall back to the scalar fit */
+static const int amplitudes[] = {
+	1, -1, 2, 3, 7, 100, -100, 4096, 8191, 8192, -8192, 8193, 32767,
+	-32767, 32768, -32768, 65534, 65535, -65535, 65536, -65536, 100000,
+	-1000000, INT_MAX, -INT_MAX, INT_MIN,
+};
+
+static int16_t src[TEST_SAMPLES];
+static uint16_t expect[TEST_SAMPLES];
+static uint16_t out[TEST_SAMPLES];
+static int failures;
+
+/* Report a mismatch of case <what> <param> at sample i */
+static void fail(const char *kernel, const char *what, int param,
+		size_t i, unsigned int got, unsigned int wanted)
+{
+	if (failures++ < 20)
+		fprintf(stderr, "FAIL: %s %s %d at %zu: 0x%04x, expected 0x%04x\n",
+				kernel, what, param, i, got, wanted);
+}
+
+/* The original conversion of lxi-control */
+static uint16_t fit_double(int16_t sample, int amplitude)
+{
+	double value = (double) sample / amplitude * WF_GEN_AMPLITUDE;
+
+	if (value >= 0)
+		value += 0.5 + WF_GEN_AMPLITUDE;
+	else
+		value += -0.5 + WF_GEN_AMPLITUDE;
+
+	return htons((uint16_t) (int) value & 0x7fff);
+}
+
+static void check_fit(const char *kernel)
+{
+	size_t a, i, n;
+	int amplitude;
+
+	for (a = 0; a < sizeof(amplitudes) / sizeof(amplitudes[0]); a++)
+	{
+		amplitude = amplitudes[a];
+
+		wf_select_kernel("scalar");
+		wf_fit(expect, src, TEST_SAMPLES, amplitude);
+		wf_select_kernel(kernel);
+
+		if (strcmp(kernel, "scalar") == 0)
+		{
+			for (i = 0; i < TEST_SAMPLES; i++)
+				if (expect[i] != fit_double(src[i], amplitude))
+					fail(kernel, "fit against double at amplitude", amplitude, i,
+							expect[i], fit_double(src[i], amplitude));
+			continue;
+		}
+
+		wf_fit(out, src, TEST_SAMPLES, amplitude);
+		for (i = 0; i < TEST_SAMPLES; i++)
+			if (out[i] != expect[i])
+				fail(kernel, "fit at amplitude", amplitude, i, out[i], expect[i]);
+
+		/* Short and unaligned runs end in the scalar tail */
+		for (n = 0; n < TEST_TAIL; n++)
+		{
+			memset(out, 0, sizeof(out));
+			wf_fit(&out[1], &src[1], n, amplitude);
+			for (i = 1; i <= n; i++)
+				if (out[i] != expect[i])
+					fail(kernel, "fit tail at amplitude", amplitude, i, out[i], expect[i]);
+			if (out[n + 1] != 0)
+				fail(kernel, "fit past the end at amplitude", amplitude, n + 1, out[n + 1], 0);
+		}
+
+		/* In place */
+		memcpy(out, src, sizeof(out));
+		wf_fit(out, (const int16_t *) out, TEST_SAMPLES, amplitude);
+		for (i = 0; i < TEST_SAMPLES; i++)
+			if (out[i] != expect[i])
+				fail(kernel, "fit in place at amplitude", amplitude, i, out[i], expect[i]);
+	}
+}
+
+static void check_swap(const char *kernel)
+{
+	uint8_t bytes[2 * TEST_TAIL + 4];
+	uint16_t buffer[TEST_TAIL + 1];
+	uint16_t wanted;
+	size_t offset, i, n;
+
+	/* The first byte of a sample is its high byte after the swap, in
+	 * either host order */
+	for (i = 0; i < sizeof(bytes); i++)
+		bytes[i] = (uint8_t) (i * 37 + 11);
+
+	for (offset = 0; offset < 4; offset++)
+	{
+		for (n = 0; n <= TEST_TAIL; n++)
+		{
+			memset(buffer, 0, sizeof(buffer));
+			wf_swap(buffer, &bytes[offset], n);
+			for (i = 0; i < n; i++)
+			{
+				wanted = bytes[offset + 2*i] << 8 | bytes[offset + 2*i + 1];
+				if (buffer[i] != wanted)
+					fail(kernel, "swap at offset", (int) offset, i, buffer[i], wanted);
+			}
+			if (n < TEST_TAIL && buffer[n] != 0)
+				fail(kernel, "swap past the end at offset", (int) offset, n, buffer[n], 0);
+
+			/* In place */
+			memcpy(buffer, &bytes[offset], 2 * n);
+			wf_swap(buffer, buffer, n);
+			for (i = 0; i < n; i++)
+			{
+				wanted = bytes[offset + 2*i] << 8 | bytes[offset + 2*i + 1];
+				if (buffer[i] != wanted)
+					fail(kernel, "swap in place at offset", (int) offset, i, buffer[i], wanted);
+			}
+		}
+	}
+}
+
+int main(void)
+{
+	size_t i, k;
+
+	for (i = 0; i < TEST_SAMPLES; i++)
+		src[i] = (int16_t) (i + INT16_MIN);
+
+	check_fit("scalar");
+	check_swap("scalar");
+
+	for (k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++)
+	{
+		if (wf_select_kernel(kernels[k]) != 0)
+		{
+			printf("%s: not supported, skipped\n", kernels[k]);
+			continue;
+		}
+		check_fit(kernels[k]);
+		check_swap(kernels[k]);
+		printf("%s: checked\n", kernels[k]);
+	}
+
+	if (failures)
+		fprintf(stderr, "%d failures\n", failures);
+
+	return failures ? 1 : 0;
+}
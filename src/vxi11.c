@@ -0,0 +1,578 @@
+/*
+ * lxi-control - VXI-11 transport
+ *
+ * VXI-11 carries SCPI in ONC RPC calls (RFC 5531) on a TCP connection to
+ * the core channel of the instrument: create_link opens a link to the
+ * instrument, device_write sends commands and device_read fetches the
+ * response until the instrument sets END. The port of the core channel is
+ * asked from the portmapper (RFC 1833) of the instrument unless given.
+ *
+ * The connection stays open for the whole session and one call is
+ * outstanding at a time. Commands are written straight from the request
+ * in chunks of the maxRecvSize of the instrument, and device_read asks for
+ * up to VXI11_READ_SIZE bytes so a response normally takes a single call.
+ * The response data is received directly into the session receive buffer,
+ * only the record marks between the fragments of the reply are taken out,
+ * and parsed there like data from a raw socket.
+ *
+ * This program is free software; you can redistribute  it and/or modify it
+ * under  the terms of  the GNU General  Public License as published by the
+ * Free Software Foundation;  either version 2 of the  License, or (at your
+ * option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "lxi.h"
+#include "lxi-private.h"
+
+#define VXI11_PMAP_PORT		111
+#define VXI11_PMAP_PROG		100000
+#define VXI11_PMAP_VERS		2
+#define VXI11_CORE_PROG		395183	// DEVICE_CORE
+#define VXI11_CORE_VERS		1
+
+/* Procedures */
+#define VXI11_GETPORT		3	/* Of the portmapper */
+#define VXI11_CREATE_LINK	10
+#define VXI11_DEVICE_WRITE	11
+#define VXI11_DEVICE_READ	12
+#define VXI11_DESTROY_LINK	23
+
+#define VXI11_DEVICE		"inst0"
+#define VXI11_READ_SIZE		(16 << 20)	// requestSize of device_read
+#define VXI11_MIN_RECV		1024	// Smallest maxRecvSize allowed
+
+#define VXI11_FLAG_END		0x08	/* Last chunk of device_write */
+#define VXI11_REASON_END	0x04	/* device_read got the whole response */
+#define VXI11_ERROR_TIMEOUT	15
+
+#define VXI11_LAST_FRAGMENT	0x80000000
+
+typedef struct vxi11 vxi11_t;
+
+struct vxi11 {
+	unsigned int port;	/* Of the core channel, 0 until known */
+	uint32_t xid;
+	uint32_t lid;
+	bool linked;
+	size_t max_recv;	/* Largest device_write the instrument takes */
+
+	/* Call being sent, the request data of device_write follows the
+	 * header */
+	uint32_t proc;		/* 0 if no call is outstanding */
+	uint32_t call[20];
+	size_t header, data;
+	size_t length, sent;	/* Record mark included */
+	size_t written;		/* Data of the send queue head written before */
+
+	/* Reply being received */
+	unsigned char mark[4];
+	size_t mark_length;
+	size_t fragment;	/* Bytes left in the current fragment */
+	bool last;		/* It is the last fragment of the record */
+	uint32_t reply[10];	/* Header and results */
+	size_t have, need;
+	size_t data_left;	/* device_read data still to come */
+};
+
+static size_t request_length(const lxi_request_t *request)
+{
+	size_t length = 0;
+	int i;
+
+	for (i = request->iov_first; i < request->iovcnt; i++)
+		length += request->iov[i].iov_len;
+	return length;
+}
+
+/* Start a call to proc with count argument words, the record is sent by
+ * send_call() */
+static void call(lxi_session_t *session, uint32_t prog, uint32_t vers,
+		uint32_t proc, const uint32_t *args, int count, size_t data)
+{
+	vxi11_t *vxi = session->protocol;
+	uint32_t *word = vxi->call;
+	int i;
+
+	word++;			/* Record mark, below */
+	*word++ = htonl(++vxi->xid);
+	*word++ = htonl(0);	/* CALL */
+	*word++ = htonl(2);	/* RPC version */
+	*word++ = htonl(prog);
+	*word++ = htonl(vers);
+	*word++ = htonl(proc);
+	for (i = 0; i < 4; i++)
+		*word++ = htonl(0);	/* AUTH_NONE credential and verifier */
+	for (i = 0; i < count; i++)
+		*word++ = htonl(args[i]);
+
+	vxi->header = (char *) word - (char *) vxi->call;
+	vxi->data = data;
+	vxi->length = vxi->header + ((data + 3) & ~(size_t) 3);
+	vxi->call[0] = htonl(VXI11_LAST_FRAGMENT | (vxi->length - 4));
+	vxi->sent = 0;
+	vxi->proc = proc;
+
+	vxi->mark_length = 0;
+	vxi->fragment = 0;
+	vxi->last = false;
+	vxi->have = 0;
+	vxi->need = 12;
+	vxi->data_left = 0;
+
+	session->waiting = true;
+	lxi_set_deadline(&session->deadline, session->timeout);
+}
+
+/* Send the rest of the current call */
+static int send_call(lxi_session_t *session)
+{
+	static char zero[4];
+	vxi11_t *vxi = session->protocol;
+	lxi_request_t *request = session->send_head;
+	struct iovec iov[6], *v;
+	size_t offset, left, n;
+	ssize_t length;
+	int count, i;
+
+	while (vxi->sent < vxi->length)
+	{
+		/* Header, the request data carried by this call and padding */
+		count = 0;
+		iov[count].iov_base = vxi->call;
+		iov[count++].iov_len = vxi->header;
+		offset = vxi->written;
+		left = vxi->data;
+		for (i = 0; left > 0 && i < request->iovcnt; i++)
+		{
+			if (offset >= request->iov[i].iov_len)
+			{
+				offset -= request->iov[i].iov_len;
+				continue;
+			}
+			n = request->iov[i].iov_len - offset;
+			if (n > left)
+				n = left;
+			iov[count].iov_base = (char *) request->iov[i].iov_base + offset;
+			iov[count++].iov_len = n;
+			left -= n;
+			offset = 0;
+		}
+		iov[count].iov_base = zero;
+		iov[count++].iov_len = vxi->length - vxi->header - vxi->data;
+
+		/* Skip what was sent */
+		v = iov;
+		offset = vxi->sent;
+		while (offset >= v->iov_len)
+		{
+			offset -= v->iov_len;
+			v++;
+			count--;
+		}
+		v->iov_base = (char *) v->iov_base + offset;
+		v->iov_len -= offset;
+
+		length = writev(session->fd, v, count);
+		if (length == -1)
+		{
+			if (errno == EAGAIN || errno == EINTR)
+				return LXI_OK;
+			return lxi_fail(session, LXI_ECONNECT,
+					"Error sending SCPI command: %s", strerror(errno));
+		}
+		vxi->sent += length;
+		if (session->state == STATE_READY)
+			lxi_sent(session, length);
+	}
+	return LXI_OK;
+}
+
+/* Start the next call for the queued requests */
+static void next_call(lxi_session_t *session)
+{
+	vxi11_t *vxi = session->protocol;
+	lxi_request_t *request = session->send_head;
+	uint32_t args[6];
+	size_t total, data;
+
+	if (session->reply_head != NULL)
+	{
+		/* Fetch the response before the next command */
+		args[0] = vxi->lid;
+		args[1] = VXI11_READ_SIZE;
+		args[2] = session->timeout;	/* io_timeout */
+		args[3] = 0;			/* lock_timeout */
+		args[4] = 0;			/* flags */
+		args[5] = 0;			/* termChar */
+		call(session, VXI11_CORE_PROG, VXI11_CORE_VERS, VXI11_DEVICE_READ,
+				args, 6, 0);
+	}
+	else if (request != NULL)
+	{
+		total = request_length(request);
+		data = total - vxi->written;
+		if (data > vxi->max_recv)
+			data = vxi->max_recv;
+		args[0] = vxi->lid;
+		args[1] = session->timeout;
+		args[2] = 0;
+		args[3] = vxi->written + data == total ? VXI11_FLAG_END : 0;
+		args[4] = data;
+		call(session, VXI11_CORE_PROG, VXI11_CORE_VERS, VXI11_DEVICE_WRITE,
+				args, 5, data);
+	}
+}
+
+static int vxi11_flush(lxi_session_t *session)
+{
+	vxi11_t *vxi = session->protocol;
+
+	if (session->state == STATE_READY && vxi->proc == 0)
+		next_call(session);
+	if (vxi->proc != 0)
+		return send_call(session);
+	return LXI_OK;
+}
+
+static ssize_t receive_error(lxi_session_t *session, ssize_t length)
+{
+	if (length == -1 && (errno == EAGAIN || errno == EINTR))
+		return 0;
+	if (length == -1)
+		lxi_fail(session, LXI_ESYSTEM, "Error reading response: %s",
+				strerror(errno));
+	else
+		lxi_fail(session, LXI_ECONNECT, "Connection closed by instrument");
+	return -1;
+}
+
+/* Read the record mark starting the next fragment. Returns 1 when it is
+ * complete, 0 if it has not arrived yet and -1 on error. */
+static ssize_t read_mark(lxi_session_t *session)
+{
+	vxi11_t *vxi = session->protocol;
+	ssize_t length;
+	uint32_t mark;
+
+	while (vxi->mark_length < 4)
+	{
+		length = recv(session->fd, &vxi->mark[vxi->mark_length],
+				4 - vxi->mark_length, 0);
+		if (length <= 0)
+			return receive_error(session, length);
+		vxi->mark_length += length;
+	}
+	memcpy(&mark, vxi->mark, 4);
+	mark = ntohl(mark);
+	vxi->fragment = mark & ~VXI11_LAST_FRAGMENT;
+	vxi->last = (mark & VXI11_LAST_FRAGMENT) != 0;
+	vxi->mark_length = 0;
+	return 1;
+}
+
+/* Read up to size bytes of the reply record into buffer, leaving out the
+ * record marks. Returns the number of bytes read, 0 if nothing has arrived
+ * and -1 on error. */
+static ssize_t record_read(lxi_session_t *session, void *buffer, size_t size)
+{
+	vxi11_t *vxi = session->protocol;
+	ssize_t length;
+
+	while (vxi->fragment == 0)
+	{
+		if (vxi->last)
+		{
+			lxi_fail(session, LXI_ECONNECT, "Truncated RPC reply");
+			return -1;
+		}
+		if ((length = read_mark(session)) <= 0)
+			return length;
+	}
+
+	if (size > vxi->fragment)
+		size = vxi->fragment;
+	length = recv(session->fd, buffer, size, 0);
+	if (length <= 0)
+		return receive_error(session, length);
+	vxi->fragment -= length;
+	if (session->state == STATE_READY)
+		lxi_received(session, length);
+	return length;
+}
+
+static int device_error(lxi_session_t *session, uint32_t error)
+{
+	if (error == VXI11_ERROR_TIMEOUT)
+		return lxi_fail(session, LXI_ECONNECT, "Timeout waiting for response");
+	return lxi_fail(session, LXI_ECONNECT, "VXI-11 error %u", error);
+}
+
+/* Check the reply as far as it has arrived: the RPC header, then the
+ * results of the call */
+static int check_reply(lxi_session_t *session)
+{
+	vxi11_t *vxi = session->protocol;
+	uint32_t *word = vxi->reply;
+	static const size_t results[] = {
+		[VXI11_GETPORT] = 4,
+		[VXI11_CREATE_LINK] = 16,
+		[VXI11_DEVICE_WRITE] = 8,
+		[VXI11_DEVICE_READ] = 12,
+	};
+
+	if (vxi->have == 12)
+	{
+		if (ntohl(word[0]) != vxi->xid || ntohl(word[1]) != 1)
+			return lxi_fail(session, LXI_ECONNECT, "Invalid RPC reply");
+		if (ntohl(word[2]) != 0)
+			return lxi_fail(session, LXI_ECONNECT, "RPC call denied");
+		vxi->need = 24;
+		return LXI_OK;
+	}
+	if (vxi->have == 24)
+	{
+		if (ntohl(word[4]) != 0)
+			return lxi_fail(session, LXI_ECONNECT, "Invalid RPC reply");
+		if (ntohl(word[5]) != 0)
+			return lxi_fail(session, LXI_ECONNECT,
+					vxi->proc == VXI11_GETPORT ? "Portmapper failed (%u)" :
+					"No VXI-11 service on instrument (%u)", ntohl(word[5]));
+		vxi->need += results[vxi->proc];
+		return LXI_OK;
+	}
+
+	word += 6;
+	switch (vxi->proc)
+	{
+		case VXI11_GETPORT:
+			if (ntohl(word[0]) == 0 || ntohl(word[0]) > 65535)
+				return lxi_fail(session, LXI_ECONNECT,
+						"No VXI-11 service on instrument");
+			break;
+		case VXI11_CREATE_LINK:
+			if (ntohl(word[0]) != 0)
+				return lxi_fail(session, LXI_ECONNECT,
+						"Could not create VXI-11 link (error %u)",
+						ntohl(word[0]));
+			break;
+		case VXI11_DEVICE_WRITE:
+			if (ntohl(word[0]) != 0)
+				return device_error(session, ntohl(word[0]));
+			break;
+		case VXI11_DEVICE_READ:
+			if (ntohl(word[0]) != 0)
+				return device_error(session, ntohl(word[0]));
+			vxi->data_left = ntohl(word[2]);
+			break;
+	}
+	return LXI_OK;
+}
+
+/* The instrument sends END instead of the final LF of a response */
+static void response_end(lxi_session_t *session)
+{
+	if (session->reply_head->reply == REPLY_LINE &&
+			(session->rx_end == session->rx_start ||
+			session->rx[session->rx_end-1] != '\n'))
+	{
+		if (lxi_rx_reserve(session) != LXI_OK)
+			return;
+		session->rx[session->rx_end++] = '\n';
+	}
+	lxi_parse(session, true);
+}
+
+/* The whole reply record has been received */
+static int complete(lxi_session_t *session)
+{
+	vxi11_t *vxi = session->protocol;
+	uint32_t *word = &vxi->reply[6];
+	uint32_t proc = vxi->proc;
+	size_t size;
+
+	vxi->proc = 0;
+	session->waiting = false;
+	switch (proc)
+	{
+		case VXI11_GETPORT:
+			/* On to the core channel */
+			vxi->port = ntohl(word[0]);
+			return lxi_reconnect(session, vxi->port);
+		case VXI11_CREATE_LINK:
+			vxi->lid = ntohl(word[1]);
+			vxi->max_recv = ntohl(word[3]);
+			if (vxi->max_recv < VXI11_MIN_RECV)
+				vxi->max_recv = VXI11_MIN_RECV;
+			vxi->linked = true;
+			session->state = STATE_READY;
+			session->stats.connected = lxi_now_ns();
+			break;
+		case VXI11_DEVICE_WRITE:
+			/* The instrument may take less, the rest goes again */
+			size = ntohl(word[1]);
+			vxi->written += size < vxi->data ? size : vxi->data;
+			if (vxi->written == request_length(session->send_head))
+			{
+				vxi->written = 0;
+				if (lxi_request_sent(session) != LXI_OK)
+					return session->status;
+			}
+			break;
+		case VXI11_DEVICE_READ:
+			if ((ntohl(word[1]) & VXI11_REASON_END) &&
+					session->reply_head != NULL)
+				response_end(session);
+			if (session->state == STATE_FAILED)
+				return session->status;
+			break;
+	}
+	return vxi11_flush(session);
+}
+
+static int vxi11_receive(lxi_session_t *session)
+{
+	vxi11_t *vxi = session->protocol;
+	char skip[64];
+	ssize_t length;
+	size_t size;
+
+	while (session->state != STATE_FAILED && vxi->proc != 0)
+	{
+		if (vxi->have < vxi->need)
+		{
+			length = record_read(session, (char *) vxi->reply + vxi->have,
+					vxi->need - vxi->have);
+			if (length <= 0)
+				break;
+			vxi->have += length;
+			if (vxi->have == vxi->need)
+				check_reply(session);
+		}
+		else if (vxi->data_left > 0)
+		{
+			/* Response data straight into the receive buffer */
+			if (lxi_rx_reserve(session) != LXI_OK)
+				break;
+			size = session->rx_size - session->rx_end;
+			if (size > vxi->data_left)
+				size = vxi->data_left;
+			length = record_read(session, &session->rx[session->rx_end], size);
+			if (length <= 0)
+				break;
+			session->rx_end += length;
+			vxi->data_left -= length;
+			lxi_parse(session, false);
+		}
+		else if (vxi->fragment > 0)
+		{
+			/* Padding, and whatever else ends the record */
+			length = record_read(session, skip, sizeof(skip));
+			if (length <= 0)
+				break;
+		}
+		else if (!vxi->last)
+		{
+			if (read_mark(session) <= 0)
+				break;
+		}
+		else
+			complete(session);
+	}
+	return session->status;
+}
+
+static int vxi11_connected(lxi_session_t *session)
+{
+	vxi11_t *vxi = session->protocol;
+	uint32_t args[6];
+	const char *device = VXI11_DEVICE;
+	int i;
+
+	if (vxi->port == 0)
+	{
+		args[0] = VXI11_CORE_PROG;
+		args[1] = VXI11_CORE_VERS;
+		args[2] = IPPROTO_TCP;
+		args[3] = 0;
+		call(session, VXI11_PMAP_PROG, VXI11_PMAP_VERS, VXI11_GETPORT, args, 4,
+				0);
+		return LXI_OK;
+	}
+
+	args[0] = getpid();	/* clientId */
+	args[1] = 0;		/* lockDevice */
+	args[2] = 0;		/* lock_timeout */
+	args[3] = strlen(device);
+	args[4] = args[5] = 0;
+	for (i = 0; device[i] != 0; i++)	/* XDR string, padded */
+		args[4 + i / 4] |= (uint32_t) device[i] << (24 - 8 * (i % 4));
+	call(session, VXI11_CORE_PROG, VXI11_CORE_VERS, VXI11_CREATE_LINK, args, 6,
+			0);
+	return LXI_OK;
+}
+
+static short vxi11_events(const lxi_session_t *session)
+{
+	const vxi11_t *vxi = session->protocol;
+
+	/* Writable to start the next call at once */
+	if (vxi->proc != 0 ? vxi->sent < vxi->length :
+			session->state == STATE_READY &&
+			(session->send_head != NULL || session->reply_head != NULL))
+		return POLLIN | POLLOUT;
+	return POLLIN;
+}
+
+static void vxi11_close(lxi_session_t *session)
+{
+	vxi11_t *vxi = session->protocol;
+	uint32_t lid = vxi->lid;
+
+	/* Unless a call is under way, without waiting for the reply */
+	if (vxi->linked && vxi->proc == 0 && session->fd != -1)
+	{
+		call(session, VXI11_CORE_PROG, VXI11_CORE_VERS, VXI11_DESTROY_LINK,
+				&lid, 1, 0);
+		send(session->fd, vxi->call, vxi->length, MSG_NOSIGNAL);
+	}
+	free(vxi);
+	session->protocol = NULL;
+}
+
+static const lxi_transport_t vxi11_transport = {
+	vxi11_connected,
+	vxi11_flush,
+	vxi11_receive,
+	vxi11_events,
+	vxi11_close,
+};
+
+int vxi11_open(lxi_session_t *session, unsigned int *port)
+{
+	vxi11_t *vxi;
+
+	vxi = calloc(1, sizeof(vxi11_t));
+	if (vxi == NULL)
+		return lxi_fail(session, LXI_ESYSTEM, "Out of memory");
+	vxi->port = *port;
+	if (*port == 0)
+		*port = VXI11_PMAP_PORT;
+	session->transport = &vxi11_transport;
+	session->protocol = vxi;
+	return LXI_OK;
+}
@@ -0,0 +1,396 @@
+/*
+ * lxi-control - Waveform conversion kernels
+ *
+ * This program is free software; you can redistribute  it and/or modify it
+ * under  the terms of  the GNU General  Public License as published by the
+ * Free Software Foundation;  either version 2 of the  License, or (at your
+ * option) any later version.
+ */
+
+#include <stdbool.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "wfconv.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define WF_X86
+#include <immintrin.h>
+#endif
+
+/* Largest amplitude the vector kernels handle, beyond it the numerator of
+ * the fit overflows their 32 bit lanes. Amplitudes read from a .wfm header
+ * are always within it. */
+#define WF_VEC_MAX_AMPLITUDE	65535
+
+/*
+ * The original floating point fit of a sample x with amplitude A is
+ *
+ *   v = x / A * 8192
+ *   t = v + 0.5 + 8192   (v >= 0)
+ *   t = v - 0.5 + 8192   (v <  0)
+ *   out = (uint16_t)(int)t & 0x7fff
+ *
+ * which for A > 0 equals the exact integer expression
+ *
+ *   out = trunc((16384x + sA + 16384A) / 2A),  s = (x >= 0) ? 1 : -1
+ *
+ * A negative amplitude is handled by negating x. The vector kernels add
+ * bias*2A to make the numerator positive and divide by 2A with a 32 bit
+ * reciprocal, which is exact after one correction step.
+ */
+typedef struct {
+	int32_t  a;		/* |amplitude| */
+	bool     neg;		/* Amplitude is negative */
+	uint32_t d;		/* Divisor 2A */
+	uint32_t bias;		/* Numerator + bias*d is never negative */
+	uint32_t m;		/* Reciprocal of d */
+	int      shift;		/* (numerator * m) >> shift = quotient */
+} fit_t;
+
+static void fit_setup(fit_t *fit, int amplitude)
+{
+	int l = 0;
+
+	fit->neg = amplitude < 0;
+	fit->a = fit->neg ? -amplitude : amplitude;
+	fit->d = 2 * fit->a;
+	fit->bias = ((1u << 29) + fit->a + fit->d - 1) / fit->d;
+
+	/* l = floor(log2(d)) keeps the reciprocal within 32 bits */
+	while ((2u << l) <= fit->d)
+		l++;
+	fit->shift = 32 + l;
+	fit->m = ((((uint64_t) 1) << fit->shift) - 1) / fit->d;
+}
+
+static inline uint16_t fit_sample(int16_t sample, int64_t a)
+{
+	int64_t x = sample;
+	int64_t n;
+
+	if (a < 0)
+	{
+		a = -a;
+		x = -x;
+	}
+	n = 16384 * x + (x >= 0 ? a : -a) + 16384 * a;
+
+	return htons((uint16_t) (int32_t) (n / (2 * a)) & 0x7fff);
+}
+
+/*----------------------------------------------------------------------------*/
+/* Scalar kernels */
+
+static void fit_scalar(uint16_t *dst, const int16_t *src, size_t n, int amplitude)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		dst[i] = fit_sample(src[i], amplitude);
+}
+
+static void swap_scalar(uint16_t *dst, const void *src, size_t n)
+{
+	const uint8_t *bytes = src;
+	uint16_t sample;
+	size_t i;
+
+	for (i = 0; i < n; i++)
+	{
+		memcpy(&sample, &bytes[2*i], sizeof(sample));
+		dst[i] = htons(sample);
+	}
+}
+
+#ifdef WF_X86
+/*----------------------------------------------------------------------------*/
+/* SSE2 kernels */
+
+/* Constants of the fit, broadcast to all lanes */
+typedef struct {
+	__m128i a, c, bd, d, dm1, m, b, shift;
+} fit_sse2_t;
+
+__attribute__((target("sse2")))
+static inline __m128i fit4_sse2(__m128i x, const fit_sse2_t *k, bool neg)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i lo = _mm_set_epi32(0, -1, 0, -1);
+	__m128i sign, n, np, q, qd, r, corr, adj;
+
+	if (neg)
+		x = _mm_sub_epi32(zero, x);
+
+	/* Numerator 16384x + sA + 16384A and its biased (positive) version */
+	sign = _mm_srai_epi32(x, 31);
+	n = _mm_sub_epi32(_mm_xor_si128(k->a, sign), sign);
+	n = _mm_add_epi32(_mm_add_epi32(_mm_slli_epi32(x, 14), n), k->c);
+	np = _mm_add_epi32(n, k->bd);
+
+	/* Quotient estimate, even and odd lanes */
+	q = _mm_or_si128(
+		_mm_srl_epi64(_mm_mul_epu32(np, k->m), k->shift),
+		_mm_slli_epi64(_mm_srl_epi64(_mm_mul_epu32(
+			_mm_srli_epi64(np, 32), k->m), k->shift), 32));
+
+	/* Remainder, correct an estimate which is one too small */
+	qd = _mm_or_si128(
+		_mm_and_si128(_mm_mul_epu32(q, k->d), lo),
+		_mm_slli_epi64(_mm_mul_epu32(_mm_srli_epi64(q, 32), k->d), 32));
+	r = _mm_sub_epi32(np, qd);
+	corr = _mm_cmpgt_epi32(r, k->dm1);
+	q = _mm_sub_epi32(q, corr);
+	r = _mm_sub_epi32(r, _mm_and_si128(corr, k->d));
+
+	/* Truncate negative numerators towards zero */
+	adj = _mm_andnot_si128(_mm_cmpeq_epi32(r, zero), _mm_srai_epi32(n, 31));
+	q = _mm_sub_epi32(q, adj);
+
+	q = _mm_sub_epi32(q, k->b);
+
+	/* Keep the low 16 bits for the saturating pack */
+	return _mm_srai_epi32(_mm_slli_epi32(q, 16), 16);
+}
+
+__attribute__((target("sse2")))
+static void fit_sse2(uint16_t *dst, const int16_t *src, size_t n, int amplitude)
+{
+	const __m128i mask = _mm_set1_epi16(0x7fff);
+	fit_sse2_t k;
+	fit_t fit;
+	__m128i x, x0, x1;
+	size_t i;
+
+	fit_setup(&fit, amplitude);
+	k.a = _mm_set1_epi32(fit.a);
+	k.c = _mm_set1_epi32(16384 * fit.a);
+	k.bd = _mm_set1_epi32(fit.bias * fit.d);
+	k.d = _mm_set1_epi32(fit.d);
+	k.dm1 = _mm_set1_epi32(fit.d - 1);
+	k.m = _mm_set1_epi32(fit.m);
+	k.b = _mm_set1_epi32(fit.bias);
+	k.shift = _mm_cvtsi32_si128(fit.shift);
+
+	for (i = 0; i + 8 <= n; i += 8)
+	{
+		x = _mm_loadu_si128((const __m128i *) &src[i]);
+		x0 = _mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16);
+		x1 = _mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16);
+		x = _mm_packs_epi32(fit4_sse2(x0, &k, fit.neg),
+				fit4_sse2(x1, &k, fit.neg));
+		x = _mm_and_si128(x, mask);
+		x = _mm_or_si128(_mm_slli_epi16(x, 8), _mm_srli_epi16(x, 8));
+		_mm_storeu_si128((__m128i *) &dst[i], x);
+	}
+
+	fit_scalar(&dst[i], &src[i], n - i, amplitude);
+}
+
+__attribute__((target("sse2")))
+static void swap_sse2(uint16_t *dst, const void *src, size_t n)
+{
+	const uint8_t *bytes = src;
+	__m128i x;
+	size_t i;
+
+	for (i = 0; i + 8 <= n; i += 8)
+	{
+		x = _mm_loadu_si128((const __m128i *) &bytes[2*i]);
+		x = _mm_or_si128(_mm_slli_epi16(x, 8), _mm_srli_epi16(x, 8));
+		_mm_storeu_si128((__m128i *) &dst[i], x);
+	}
+
+	swap_scalar(&dst[i], &bytes[2*i], n - i);
+}
+
+/*----------------------------------------------------------------------------*/
+/* AVX2 kernels */
+
+typedef struct {
+	__m256i a, c, bd, d, dm1, m, b;
+	__m128i shift;
+} fit_avx2_t;
+
+__attribute__((target("avx2")))
+static inline __m256i fit8_avx2(__m256i x, const fit_avx2_t *k, bool neg)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i sign, n, np, q, r, corr, adj;
+
+	if (neg)
+		x = _mm256_sub_epi32(zero, x);
+
+	sign = _mm256_srai_epi32(x, 31);
+	n = _mm256_sub_epi32(_mm256_xor_si256(k->a, sign), sign);
+	n = _mm256_add_epi32(_mm256_add_epi32(_mm256_slli_epi32(x, 14), n), k->c);
+	np = _mm256_add_epi32(n, k->bd);
+
+	q = _mm256_or_si256(
+		_mm256_srl_epi64(_mm256_mul_epu32(np, k->m), k->shift),
+		_mm256_slli_epi64(_mm256_srl_epi64(_mm256_mul_epu32(
+			_mm256_srli_epi64(np, 32), k->m), k->shift), 32));
+
+	r = _mm256_sub_epi32(np, _mm256_mullo_epi32(q, k->d));
+	corr = _mm256_cmpgt_epi32(r, k->dm1);
+	q = _mm256_sub_epi32(q, corr);
+	r = _mm256_sub_epi32(r, _mm256_and_si256(corr, k->d));
+
+	adj = _mm256_andnot_si256(_mm256_cmpeq_epi32(r, zero),
+			_mm256_srai_epi32(n, 31));
+	q = _mm256_sub_epi32(q, adj);
+
+	q = _mm256_sub_epi32(q, k->b);
+
+	return _mm256_srai_epi32(_mm256_slli_epi32(q, 16), 16);
+}
+
+__attribute__((target("avx2")))
+static void fit_avx2(uint16_t *dst, const int16_t *src, size_t n, int amplitude)
+{
+	const __m256i mask = _mm256_set1_epi16(0x7fff);
+	fit_avx2_t k;
+	fit_t fit;
+	__m256i x, x0, x1;
+	size_t i;
+
+	fit_setup(&fit, amplitude);
+	k.a = _mm256_set1_epi32(fit.a);
+	k.c = _mm256_set1_epi32(16384 * fit.a);
+	k.bd = _mm256_set1_epi32(fit.bias * fit.d);
+	k.d = _mm256_set1_epi32(fit.d);
+	k.dm1 = _mm256_set1_epi32(fit.d - 1);
+	k.m = _mm256_set1_epi32(fit.m);
+	k.b = _mm256_set1_epi32(fit.bias);
+	k.shift = _mm_cvtsi32_si128(fit.shift);
+
+	for (i = 0; i + 16 <= n; i += 16)
+	{
+		x0 = _mm256_cvtepi16_epi32(
+			_mm_loadu_si128((const __m128i *) &src[i]));
+		x1 = _mm256_cvtepi16_epi32(
+			_mm_loadu_si128((const __m128i *) &src[i+8]));
+
+		/* The pack works per 128 bit lane, restore sample order */
+		x = _mm256_packs_epi32(fit8_avx2(x0, &k, fit.neg),
+				fit8_avx2(x1, &k, fit.neg));
+		x = _mm256_permute4x64_epi64(x, 0xd8);
+
+		x = _mm256_and_si256(x, mask);
+		x = _mm256_or_si256(_mm256_slli_epi16(x, 8),
+				_mm256_srli_epi16(x, 8));
+		_mm256_storeu_si256((__m256i *) &dst[i], x);
+	}
+
+	fit_scalar(&dst[i], &src[i], n - i, amplitude);
+}
+
+__attribute__((target("avx2")))
+static void swap_avx2(uint16_t *dst, const void *src, size_t n)
+{
+	const uint8_t *bytes = src;
+	__m256i x;
+	size_t i;
+
+	for (i = 0; i + 16 <= n; i += 16)
+	{
+		x = _mm256_loadu_si256((const __m256i *) &bytes[2*i]);
+		x = _mm256_or_si256(_mm256_slli_epi16(x, 8),
+				_mm256_srli_epi16(x, 8));
+		_mm256_storeu_si256((__m256i *) &dst[i], x);
+	}
+
+	swap_scalar(&dst[i], &bytes[2*i], n - i);
+}
+#endif /* WF_X86 */
+
+/*----------------------------------------------------------------------------*/
+/* Runtime selection */
+
+typedef struct {
+	const char *name;
+	void (*fit)(uint16_t *, const int16_t *, size_t, int);
+	void (*swap)(uint16_t *, const void *, size_t);
+} wf_kernel_t;
+
+/* Best first */
+static const wf_kernel_t kernels[] = {
+#ifdef WF_X86
+	{ "avx2",   fit_avx2,   swap_avx2 },
+	{ "sse2",   fit_sse2,   swap_sse2 },
+#endif
+	{ "scalar", fit_scalar, swap_scalar },
+};
+
+static const wf_kernel_t *kernel;
+
+static bool kernel_supported(const wf_kernel_t *k)
+{
+#ifdef WF_X86
+	__builtin_cpu_init();
+	if (strcmp(k->name, "avx2") == 0)
+		return __builtin_cpu_supports("avx2");
+	if (strcmp(k->name, "sse2") == 0)
+		return __builtin_cpu_supports("sse2");
+#endif
+	return true;
+}
+
+static const wf_kernel_t *kernel_get(void)
+{
+	size_t i;
+
+	if (kernel == NULL)
+	{
+		for (i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++)
+		{
+			if (kernel_supported(&kernels[i]))
+			{
+				kernel = &kernels[i];
+				break;
+			}
+		}
+	}
+	return kernel;
+}
+
+int wf_select_kernel(const char *name)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++)
+	{
+		if (strcmp(kernels[i].name, name) == 0 &&
+				kernel_supported(&kernels[i]))
+		{
+			kernel = &kernels[i];
+			return 0;
+		}
+	}
+	return -1;
+}
+
+const char *wf_kernel(void)
+{
+	return kernel_get()->name;
+}
+
+void wf_fit(uint16_t *dst, const int16_t *src, size_t n, int amplitude)
+{
+	if (amplitude < -WF_VEC_MAX_AMPLITUDE ||
+			amplitude > WF_VEC_MAX_AMPLITUDE)
+		fit_scalar(dst, src, n, amplitude);
+	else
+		kernel_get()->fit(dst, src, n, amplitude);
+}
+
+void wf_swap(uint16_t *dst, const void *src, size_t n)
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	/* Host order is network order */
+	if (dst != src)
+		memmove(dst, src, n * sizeof(uint16_t));
+#else
+	kernel_get()->swap(dst, src, n);
+#endif
+}
@@ -0,0 +1,42 @@
+/*
+ * lxi-control - Waveform conversion kernels
+ *
+ * Conversion of waveform samples between the TTi Waveform Manager .wfm
+ * format, host byte order and the network byte order used on the wire.
+ * SSE2 and AVX2 versions are selected at runtime when the CPU supports
+ * them, otherwise a portable scalar version is used.
+ *
+ * This program is free software; you can redistribute  it and/or modify it
+ * under  the terms of  the GNU General  Public License as published by the
+ * Free Software Foundation;  either version 2 of the  License, or (at your
+ * option) any later version.
+ */
+
+#ifndef WFCONV_H
+#define WFCONV_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Peak amplitude of the function generator. Samples are offset by this
+ * value, so -8192 becomes 0 and +8192 becomes 16384 */
+#define WF_GEN_AMPLITUDE	8192
+
+/* Fit .wfm samples with peak amplitude <amplitude> to the generator
+ * amplitude, offset and mask them to 15 bits and store them in network
+ * byte order. Rounding is identical to the original double precision
+ * conversion. dst may be the same as src. amplitude must not be 0. */
+void wf_fit(uint16_t *dst, const int16_t *src, size_t n, int amplitude);
+
+/* Convert n 16 bit samples between host and network byte order. src does
+ * not have to be aligned and dst may be the same as src. */
+void wf_swap(uint16_t *dst, const void *src, size_t n);
+
+/* Name of the kernels in use ("avx2", "sse2" or "scalar") */
+const char *wf_kernel(void);
+
+/* Force use of the named kernels, returns -1 if they are not supported on
+ * this CPU */
+int wf_select_kernel(const char *name);
+
+#endif
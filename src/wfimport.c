@@ -0,0 +1,540 @@
+/*
+ * lxi-control - Waveform import and resampling
+ *
+ * This program is free software; you can redistribute  it and/or modify it
+ * under  the terms of  the GNU General  Public License as published by the
+ * Free Software Foundation;  either version 2 of the  License, or (at your
+ * option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+
+#include "wfconv.h"
+#include "wfimport.h"
+
+#define WF_READ_CHUNK	65536	// Bytes read at a time
+
+/* Resampling kernel: a Kaiser windowed sinc tabulated in WF_SINC_PHASES
+ * steps per zero crossing, linearly interpolated in between. This is a
+ * polyphase filter with as many phases as the ratio needs. */
+#define WF_SINC_ZEROS	16	// Zero crossings on each side
+#define WF_SINC_PHASES	256
+#define WF_SINC_TABLE	(WF_SINC_ZEROS * WF_SINC_PHASES)
+#define WF_KAISER_BETA	8.6	// About 90 dB stop band attenuation
+
+int wf_format(const char *filename)
+{
+	const char *dot = strrchr(filename, '.');
+
+	if (dot == NULL)
+		return WF_FORMAT_WFM;
+	if (strcasecmp(dot, ".csv") == 0 || strcasecmp(dot, ".txt") == 0)
+		return WF_FORMAT_CSV;
+	if (strcasecmp(dot, ".f32") == 0)
+		return WF_FORMAT_F32;
+	if (strcasecmp(dot, ".f64") == 0)
+		return WF_FORMAT_F64;
+	if (strcasecmp(dot, ".npy") == 0)
+		return WF_FORMAT_NPY;
+	return WF_FORMAT_WFM;
+}
+
+void wf_samples_free(wf_samples_t *wave)
+{
+	free(wave->samples);
+	wave->samples = NULL;
+	wave->n = 0;
+}
+
+/* Make room for count more samples */
+static int reserve(wf_samples_t *wave, size_t *size, size_t count)
+{
+	double *samples;
+	size_t new_size = *size ? *size : 4096;
+
+	if (wave->n + count <= *size)
+		return 0;
+	while (new_size < wave->n + count)
+		new_size *= 2;
+	samples = realloc(wave->samples, new_size * sizeof(double));
+	if (samples == NULL)
+		return -1;
+	wave->samples = samples;
+	*size = new_size;
+	return 0;
+}
+
+/* Sample in the last column of a line. Returns 1 for a line without
+ * data (empty or a # comment), -1 if it is not a number. */
+static int parse_line(char *line, double *value)
+{
+	char *end = line + strlen(line), *field, *p;
+
+	while (end > line && (end[-1] == '\r' || end[-1] == ' ' ||
+				end[-1] == '\t'))
+		*--end = 0;
+	while (*line == ' ' || *line == '\t')
+		line++;
+	if (*line == 0 || *line == '#')
+		return 1;
+
+	field = line;
+	for (p = line; *p != 0; p++)
+		if (*p == ',' || *p == ';' || *p == ' ' || *p == '\t')
+			field = p + 1;
+	if (*field == 0)
+		return -1;
+	*value = strtod(field, &p);
+	return *p == 0 ? 0 : -1;
+}
+
+static int import_csv(int fd, wf_samples_t *wave, char *error,
+		size_t error_size)
+{
+	char *buffer, *lf;
+	size_t kept = 0, end, start, size = 0;
+	ssize_t length;
+	long line = 0;
+	double value;
+	int result = 0, status;
+
+	buffer = malloc(WF_READ_CHUNK + 1);
+	if (buffer == NULL)
+	{
+		snprintf(error, error_size, "Out of memory");
+		return -1;
+	}
+
+	do
+	{
+		length = read(fd, buffer + kept, WF_READ_CHUNK - kept);
+		if (length == -1)
+		{
+			snprintf(error, error_size, "Error reading: %s", strerror(errno));
+			result = -1;
+			break;
+		}
+		wave->bytes += length;
+		end = kept + length;
+		if (length == 0 && kept > 0)
+			buffer[end++] = '\n';	/* Last line without LF */
+
+		/* Whole lines, the rest is kept for the next chunk */
+		start = 0;
+		while (result == 0 &&
+				(lf = memchr(buffer + start, '\n', end - start)) != NULL)
+		{
+			*lf = 0;
+			line++;
+			status = parse_line(buffer + start, &value);
+			start = lf - buffer + 1;
+
+			/* Column titles are fine before the data */
+			if (status == 1 || (status == -1 && wave->n == 0))
+				continue;
+			if (status == -1)
+			{
+				snprintf(error, error_size, "Invalid sample in line %ld", line);
+				result = -1;
+			}
+			else if (reserve(wave, &size, 1) != 0)
+			{
+				snprintf(error, error_size, "Out of memory");
+				result = -1;
+			}
+			else
+				wave->samples[wave->n++] = value;
+		}
+
+		kept = end - start;
+		memmove(buffer, buffer + start, kept);
+		if (kept == WF_READ_CHUNK)
+		{
+			snprintf(error, error_size, "Line %ld is too long", line + 1);
+			result = -1;
+		}
+	} while (result == 0 && length > 0);
+
+	free(buffer);
+	return result;
+}
+
+/* Read count float32 or float64 values (count 0 until the end of the
+ * file), byte swapped if swap is set */
+static int import_binary(int fd, wf_samples_t *wave, size_t element,
+		size_t count, bool swap, char *error, size_t error_size)
+{
+	unsigned char *buffer, *p;
+	size_t kept = 0, size = 0, i, values;
+	ssize_t length;
+	uint32_t word;
+	uint64_t dword;
+	float f;
+	double d;
+
+	buffer = malloc(WF_READ_CHUNK);
+	if (buffer == NULL || (count > 0 && reserve(wave, &size, count) != 0))
+	{
+		free(buffer);
+		snprintf(error, error_size, "Out of memory");
+		return -1;
+	}
+
+	while (count == 0 || wave->n < count)
+	{
+		length = read(fd, buffer + kept, WF_READ_CHUNK - kept);
+		if (length == -1)
+		{
+			snprintf(error, error_size, "Error reading: %s", strerror(errno));
+			break;
+		}
+		if (length == 0)
+		{
+			if (count > 0 || kept > 0)
+				snprintf(error, error_size, "File ends inside the data");
+			else
+				count = wave->n;
+			break;
+		}
+		wave->bytes += length;
+		kept += length;
+
+		values = kept / element;
+		if (count > 0 && values > count - wave->n)
+			values = count - wave->n;
+		if (reserve(wave, &size, values) != 0)
+		{
+			snprintf(error, error_size, "Out of memory");
+			break;
+		}
+		for (i = 0, p = buffer; i < values; i++, p += element)
+		{
+			if (element == 4)
+			{
+				memcpy(&word, p, 4);
+				if (swap)
+					word = __builtin_bswap32(word);
+				memcpy(&f, &word, 4);
+				wave->samples[wave->n++] = f;
+			}
+			else
+			{
+				memcpy(&dword, p, 8);
+				if (swap)
+					dword = __builtin_bswap64(dword);
+				memcpy(&d, &dword, 8);
+				wave->samples[wave->n++] = d;
+			}
+		}
+		kept -= values * element;
+		memmove(buffer, p, kept);
+	}
+
+	free(buffer);
+	return wave->n == count ? 0 : -1;
+}
+
+/* Parse the header of a .npy file, leaving fd at the data */
+static int npy_header(int fd, wf_samples_t *wave, size_t *element,
+		size_t *count, bool *swap, char *error, size_t error_size)
+{
+	unsigned char start[12];
+	char *header = NULL, *p;
+	size_t length, prefix, dims = 0;
+	unsigned long dim;
+	bool little = htons(1) != 1;
+	int result = -1;
+
+	if (read(fd, start, 10) != 10 || memcmp(start, "\x93NUMPY", 6) != 0)
+	{
+		snprintf(error, error_size, "Not a NumPy file");
+		return -1;
+	}
+	if (start[6] == 1)
+	{
+		length = start[8] | start[9] << 8;
+		prefix = 10;
+	}
+	else if (read(fd, start + 10, 2) == 2)
+	{
+		length = start[8] | start[9] << 8 | (size_t) start[10] << 16 |
+			(size_t) start[11] << 24;
+		prefix = 12;
+	}
+	else
+	{
+		snprintf(error, error_size, "Not a NumPy file");
+		return -1;
+	}
+
+	header = malloc(length + 1);
+	if (header == NULL || read(fd, header, length) != (ssize_t) length)
+	{
+		snprintf(error, error_size, "Invalid NumPy header");
+		free(header);
+		return -1;
+	}
+	header[length] = 0;
+	wave->bytes = prefix + length;
+
+	/* {'descr': '<f8', 'fortran_order': False, 'shape': (1000,), } */
+	p = strstr(header, "'descr'");
+	if (p == NULL || (p = strchr(p + 7, '\'')) == NULL ||
+			(p[1] != '<' && p[1] != '>' && p[1] != '=') || p[2] != 'f' ||
+			(p[3] != '4' && p[3] != '8') || p[4] != '\'')
+	{
+		snprintf(error, error_size, "Only float32 and float64 arrays are supported");
+		goto out;
+	}
+	*element = p[3] - '0';
+	*swap = (p[1] == '<' && !little) || (p[1] == '>' && little);
+
+	p = strstr(header, "'shape'");
+	if (p == NULL || (p = strchr(p, '(')) == NULL)
+	{
+		snprintf(error, error_size, "Invalid NumPy header");
+		goto out;
+	}
+	*count = 1;
+	for (p++; *p != ')' && *p != 0; p++)
+	{
+		if (*p < '0' || *p > '9')
+			continue;
+		dim = strtoul(p, &p, 10);
+		p--;
+		if (dim > 1)
+			dims++;
+		*count *= dim;
+	}
+	if (dims > 1 || *count == 0)
+	{
+		snprintf(error, error_size, "Only one dimensional arrays are supported");
+		goto out;
+	}
+	result = 0;
+out:
+	free(header);
+	return result;
+}
+
+/* .wfm samples are 16 bit little endian after the amplitude */
+static int import_wfm(int fd, wf_samples_t *wave, char *error,
+		size_t error_size)
+{
+	unsigned char *buffer;
+	size_t kept = 0, size = 0, i, values;
+	ssize_t length;
+	bool header = true;
+
+	buffer = malloc(WF_READ_CHUNK);
+	if (buffer == NULL)
+	{
+		snprintf(error, error_size, "Out of memory");
+		return -1;
+	}
+	while ((length = read(fd, buffer + kept, WF_READ_CHUNK - kept)) > 0)
+	{
+		wave->bytes += length;
+		kept += length;
+		i = 0;
+		if (header && kept >= 2)
+		{
+			wave->amplitude = buffer[0] | buffer[1] << 8;
+			header = false;
+			i = 2;
+		}
+		values = (kept - i) / 2;
+		if (reserve(wave, &size, values) != 0)
+		{
+			length = -1;
+			errno = ENOMEM;
+			break;
+		}
+		for (; values > 0; values--, i += 2)
+			wave->samples[wave->n++] = (int16_t) (buffer[i] | buffer[i+1] << 8);
+		kept -= i;
+		memmove(buffer, buffer + i, kept);
+	}
+	free(buffer);
+	if (length == -1)
+	{
+		snprintf(error, error_size, "Error reading: %s", strerror(errno));
+		return -1;
+	}
+	if (header)
+	{
+		snprintf(error, error_size, "Could not read header");
+		return -1;
+	}
+	return 0;
+}
+
+int wf_import(const char *filename, int format, wf_samples_t *wave,
+		char *error, size_t error_size)
+{
+	size_t element = format == WF_FORMAT_F64 ? 8 : 4, count = 0, i;
+	bool swap = false;
+	double peak = 0;
+	int fd, result;
+
+	memset(wave, 0, sizeof(wf_samples_t));
+	fd = open(filename, O_RDONLY);
+	if (fd == -1)
+	{
+		snprintf(error, error_size, "Could not open %s: %s", filename,
+				strerror(errno));
+		return -1;
+	}
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	switch (format)
+	{
+		case WF_FORMAT_CSV:
+			result = import_csv(fd, wave, error, error_size);
+			break;
+		case WF_FORMAT_NPY:
+			result = npy_header(fd, wave, &element, &count, &swap, error,
+					error_size);
+			if (result == 0)
+				result = import_binary(fd, wave, element, count, swap, error,
+						error_size);
+			break;
+		case WF_FORMAT_WFM:
+			result = import_wfm(fd, wave, error, error_size);
+			break;
+		default:
+			result = import_binary(fd, wave, element, 0, false, error,
+					error_size);
+			break;
+	}
+	close(fd);
+
+	if (result == 0 && wave->n == 0)
+	{
+		snprintf(error, error_size, "No samples in %s", filename);
+		result = -1;
+	}
+	if (result != 0)
+	{
+		wf_samples_free(wave);
+		return -1;
+	}
+
+	if (format != WF_FORMAT_WFM)
+	{
+		for (i = 0; i < wave->n; i++)
+			if (fabs(wave->samples[i]) > peak)
+				peak = fabs(wave->samples[i]);
+		wave->amplitude = peak;
+	}
+	return 0;
+}
+
+static double bessel_i0(double x)
+{
+	double sum = 1, term = 1;
+	int k;
+
+	for (k = 1; term > 1e-12 * sum; k++)
+	{
+		term *= (x / (2 * k)) * (x / (2 * k));
+		sum += term;
+	}
+	return sum;
+}
+
+/* Fit like wf_fit(), clipped to the generator amplitude */
+static uint16_t encode(double v)
+{
+	if (v > WF_GEN_AMPLITUDE)
+		v = WF_GEN_AMPLITUDE;
+	if (v < -WF_GEN_AMPLITUDE)
+		v = -WF_GEN_AMPLITUDE;
+	v = (v >= 0 ? v + 0.5 : v - 0.5) + WF_GEN_AMPLITUDE;
+	return htons((uint16_t) (int) v & 0x7fff);
+}
+
+/* Like an unfitted .wfm sample, which is sent as is */
+static uint16_t encode_raw(double v)
+{
+	if (v > INT16_MAX)
+		v = INT16_MAX;
+	if (v < INT16_MIN)
+		v = INT16_MIN;
+	return htons((uint16_t) (int16_t) lround(v));
+}
+
+int wf_resample(uint16_t *dst, size_t points, const double *src, size_t n,
+		double amplitude)
+{
+	float kernel[WF_SINC_TABLE + 2];
+	double gain = amplitude != 0 ? WF_GEN_AMPLITUDE / amplitude : 1;
+	double ratio = (double) n / points;	/* Input samples per output */
+	double scale = ratio > 1 ? 1 / ratio : 1;	/* Cutoff */
+	double width = WF_SINC_ZEROS / scale;	/* Input samples on each side */
+	double t, x, w, sum, weights, norm = bessel_i0(WF_KAISER_BETA);
+	size_t pad = (size_t) width + 2, i, j;
+	long first, last, k;
+	double *wrapped;
+
+	if (n == points)
+	{
+		for (i = 0; i < n; i++)
+			dst[i] = amplitude != 0 ? encode(src[i] * gain) :
+				encode_raw(src[i]);
+		return 0;
+	}
+
+	/* One period, with the neighbouring periods around it so the filter
+	 * needs no wrap around */
+	wrapped = malloc((n + 2 * pad) * sizeof(double));
+	if (wrapped == NULL)
+		return -1;
+	for (i = 0; i < n + 2 * pad; i++)
+		wrapped[i] = src[(i + n - pad % n) % n];
+
+	for (i = 0; i <= WF_SINC_TABLE; i++)
+	{
+		x = (double) i / WF_SINC_PHASES;
+		w = (double) i / WF_SINC_TABLE;
+		kernel[i] = (i == 0 ? 1 : sin(M_PI * x) / (M_PI * x)) *
+			bessel_i0(WF_KAISER_BETA * sqrt(1 - w * w)) / norm;
+	}
+	kernel[WF_SINC_TABLE + 1] = 0;
+
+	for (j = 0; j < points; j++)
+	{
+		t = j * ratio;
+		first = (long) ceil(t - width);
+		last = (long) floor(t + width);
+		sum = weights = 0;
+		for (k = first; k <= last; k++)
+		{
+			x = fabs(t - k) * scale * WF_SINC_PHASES;
+			i = (size_t) x;
+			if (i >= WF_SINC_TABLE)
+				continue;
+			w = kernel[i] + (x - i) * (kernel[i+1] - kernel[i]);
+			sum += w * wrapped[k + pad];
+			weights += w;
+		}
+		dst[j] = amplitude != 0 ? encode(sum / weights * gain) :
+			encode_raw(sum / weights);
+	}
+
+	free(wrapped);
+	return 0;
+}
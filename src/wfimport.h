@@ -0,0 +1,57 @@
+/*
+ * lxi-control - Waveform import and resampling
+ *
+ * Waveforms from simulations come as CSV text, raw float32/float64
+ * arrays or NumPy .npy files of any length. They are read in chunks
+ * into an array of samples, then resampled to the number of points of
+ * the function generator and encoded like a fitted .wfm waveform, in one
+ * pass.
+ *
+ * This program is free software; you can redistribute  it and/or modify it
+ * under  the terms of  the GNU General  Public License as published by the
+ * Free Software Foundation;  either version 2 of the  License, or (at your
+ * option) any later version.
+ */
+
+#ifndef WFIMPORT_H
+#define WFIMPORT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* File formats */
+#define WF_FORMAT_WFM	0	/* TTi Waveform Manager */
+#define WF_FORMAT_CSV	1	/* One sample per line, the last column */
+#define WF_FORMAT_F32	2	/* Raw float32 in host order */
+#define WF_FORMAT_F64	3	/* Raw float64 in host order */
+#define WF_FORMAT_NPY	4	/* NumPy array of float32 or float64 */
+
+typedef struct {
+	double *samples;
+	size_t n;
+	double amplitude;	/* From the .wfm header, else the peak |sample| */
+	size_t bytes;		/* File size */
+} wf_samples_t;
+
+/* Format of a file from its extension: .csv and .txt, .f32, .f64 and
+ * .npy, anything else is .wfm */
+int wf_format(const char *filename);
+
+/* Read all samples of filename. Returns 0, or -1 with a message in error
+ * (which must hold error_size bytes). */
+int wf_import(const char *filename, int format, wf_samples_t *wave,
+		char *error, size_t error_size);
+
+void wf_samples_free(wf_samples_t *wave);
+
+/* Resample the n samples of src, taken as one period of a repeating
+ * waveform, to points samples with a windowed sinc filter. The results are
+ * fitted to the generator amplitude as if src had peak amplitude
+ * <amplitude>, clipped, offset and stored in network byte order like
+ * wf_fit() does. With amplitude 0 they are only rounded to 16 bit and
+ * stored in network byte order, like an unfitted .wfm file is sent.
+ * Returns -1 if out of memory. */
+int wf_resample(uint16_t *dst, size_t points, const double *src, size_t n,
+		double amplitude);
+
+#endif
@@ -0,0 +1,210 @@
+/*
+ * lxi-control - Waveform plots
+ *
+ * This program is free software; you can redistribute  it and/or modify it
+ * under  the terms of  the GNU General  Public License as published by the
+ * Free Software Foundation;  either version 2 of the  License, or (at your
+ * option) any later version.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "wfplot.h"
+
+#define PLOT_MAX	16384	// Top of the value axis
+#define PLOT_TICKS	4	// Intervals between axis labels
+
+/* Plot area of the SVG image */
+#define SVG_LEFT	70
+#define SVG_RIGHT	20
+#define SVG_TOP		40
+#define SVG_BOTTOM	50
+
+int wf_plot_init(wf_plot_t *plot, size_t total, size_t width)
+{
+	memset(plot, 0, sizeof(wf_plot_t));
+	plot->total = total;
+	plot->width = width < total ? width : total;
+	if (plot->width == 0)
+		return 0;
+
+	plot->min = malloc(plot->width * sizeof(uint16_t));
+	plot->max = calloc(plot->width, sizeof(uint16_t));
+	if (plot->min == NULL || plot->max == NULL)
+	{
+		wf_plot_free(plot);
+		return -1;
+	}
+	memset(plot->min, 0xff, plot->width * sizeof(uint16_t));
+	plot->edge = total / plot->width;
+	return 0;
+}
+
+void wf_plot_add(wf_plot_t *plot, const uint16_t *samples, size_t n)
+{
+	size_t count, i;
+	uint16_t lo, hi;
+
+	if (plot->width == 0)
+		return;
+	while (n > 0)
+	{
+		/* Samples past the announced length go into the last column */
+		if (plot->sample >= plot->edge && plot->column + 1 < plot->width)
+		{
+			plot->column++;
+			plot->edge = (uint64_t) (plot->column + 1) * plot->total /
+				plot->width;
+			continue;
+		}
+		count = n;
+		if (plot->column + 1 < plot->width && count > plot->edge - plot->sample)
+			count = plot->edge - plot->sample;
+
+		lo = plot->min[plot->column];
+		hi = plot->max[plot->column];
+		for (i = 0; i < count; i++)
+		{
+			lo = samples[i] < lo ? samples[i] : lo;
+			hi = samples[i] > hi ? samples[i] : hi;
+		}
+		plot->min[plot->column] = lo;
+		plot->max[plot->column] = hi;
+
+		samples += count;
+		n -= count;
+		plot->sample += count;
+	}
+}
+
+/* Sample number of the start of a column */
+static size_t column_start(const wf_plot_t *plot, size_t column)
+{
+	return (uint64_t) column * plot->total / plot->width;
+}
+
+static void svg_text(FILE *fp, const char *text)
+{
+	for (; *text != 0; text++)
+	{
+		if (*text == '<')
+			fputs("&lt;", fp);
+		else if (*text == '>')
+			fputs("&gt;", fp);
+		else if (*text == '&')
+			fputs("&amp;", fp);
+		else
+			fputc(*text, fp);
+	}
+}
+
+int wf_plot_svg(const wf_plot_t *plot, FILE *fp, const char *title)
+{
+	double w = WF_PLOT_WIDTH - SVG_LEFT - SVG_RIGHT;
+	double h = WF_PLOT_HEIGHT - SVG_TOP - SVG_BOTTOM;
+	double x;
+	size_t c;
+	int i;
+	bool first = true;
+
+	fprintf(fp, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+			"<svg xmlns=\"http://www.w3.org/2000/svg\" width=\"%d\" height=\"%d\" "
+			"font-family=\"sans-serif\" font-size=\"12\">\n"
+			"<rect width=\"100%%\" height=\"100%%\" fill=\"white\"/>\n",
+			WF_PLOT_WIDTH, WF_PLOT_HEIGHT);
+	fprintf(fp, "<text x=\"%d\" y=\"%d\" text-anchor=\"middle\">",
+			WF_PLOT_WIDTH / 2, SVG_TOP / 2 + 6);
+	svg_text(fp, title);
+	fprintf(fp, "</text>\n");
+
+	/* Axes with labels */
+	fprintf(fp, "<rect x=\"%d\" y=\"%d\" width=\"%g\" height=\"%g\" "
+			"fill=\"none\" stroke=\"black\"/>\n", SVG_LEFT, SVG_TOP, w, h);
+	for (i = 0; i <= PLOT_TICKS; i++)
+	{
+		fprintf(fp, "<text x=\"%g\" y=\"%g\" text-anchor=\"middle\">%zu</text>\n",
+				SVG_LEFT + w * i / PLOT_TICKS, SVG_TOP + h + 18,
+				plot->total * i / PLOT_TICKS);
+		fprintf(fp, "<text x=\"%d\" y=\"%g\" text-anchor=\"end\">%d</text>\n",
+				SVG_LEFT - 6, SVG_TOP + h - h * i / PLOT_TICKS + 4,
+				PLOT_MAX * i / PLOT_TICKS);
+	}
+	fprintf(fp, "<text x=\"%g\" y=\"%d\" text-anchor=\"middle\">Bins</text>\n",
+			SVG_LEFT + w / 2, WF_PLOT_HEIGHT - 10);
+	fprintf(fp, "<text x=\"16\" y=\"%g\" text-anchor=\"middle\" "
+			"transform=\"rotate(-90 16 %g)\">Value</text>\n",
+			SVG_TOP + h / 2, SVG_TOP + h / 2);
+
+	/* Minimum and maximum of each column, joined to the next one */
+	fprintf(fp, "<clipPath id=\"area\"><rect x=\"%d\" y=\"%d\" width=\"%g\" "
+			"height=\"%g\"/></clipPath>\n", SVG_LEFT, SVG_TOP, w, h);
+	fprintf(fp, "<path clip-path=\"url(#area)\" fill=\"none\" stroke=\"#9400d3\" "
+			"stroke-width=\"1\" d=\"");
+	for (c = 0; c < plot->width; c++)
+	{
+		if (plot->min[c] > plot->max[c])
+			continue;
+		x = SVG_LEFT + w * (column_start(plot, c) + 0.5) / plot->total;
+		fprintf(fp, "%c%.1f %.1fL%.1f %.1f", first ? 'M' : 'L', x,
+				SVG_TOP + h - h * plot->min[c] / PLOT_MAX, x,
+				SVG_TOP + h - h * plot->max[c] / PLOT_MAX);
+		first = false;
+	}
+	fprintf(fp, "\"/>\n</svg>\n");
+
+	return ferror(fp) ? -1 : 0;
+}
+
+int wf_plot_gnuplot(const wf_plot_t *plot, FILE *gnuplot, const char *title,
+		const char *output)
+{
+	float point[2];
+	size_t c, points = 0;
+
+	for (c = 0; c < plot->width; c++)
+		if (plot->min[c] <= plot->max[c])
+			points += 2;
+
+	fprintf(gnuplot, "set term png size %d,%d\n", WF_PLOT_WIDTH,
+			WF_PLOT_HEIGHT);
+	fprintf(gnuplot, "set xlabel 'Bins'\n");
+	fprintf(gnuplot, "set ylabel 'Value'\n");
+	fprintf(gnuplot, "set title '%s'\n", title);
+	fprintf(gnuplot, "set output '%s'\n", output);
+	if (points == 0)
+	{
+		/* Nothing but the axes */
+		fprintf(gnuplot, "plot [0:%zu] [0:%d] NaN notitle\n",
+				plot->total > 0 ? plot->total : 1, PLOT_MAX);
+		return ferror(gnuplot) ? -1 : 0;
+	}
+
+	/* Two points per column, read by gnuplot as binary floats */
+	fprintf(gnuplot, "plot [0:%zu] [0:%d] '-' binary record=(%zu) "
+			"format='%%float%%float' using 1:2 with lines notitle\n",
+			plot->total, PLOT_MAX, points);
+	for (c = 0; c < plot->width; c++)
+	{
+		if (plot->min[c] > plot->max[c])
+			continue;
+		point[0] = column_start(plot, c);
+		point[1] = plot->min[c];
+		fwrite(point, sizeof(point), 1, gnuplot);
+		point[1] = plot->max[c];
+		fwrite(point, sizeof(point), 1, gnuplot);
+	}
+
+	return ferror(gnuplot) ? -1 : 0;
+}
+
+void wf_plot_free(wf_plot_t *plot)
+{
+	free(plot->min);
+	free(plot->max);
+	plot->min = plot->max = NULL;
+	plot->width = 0;
+}
@@ -0,0 +1,51 @@
+/*
+ * lxi-control - Waveform plots
+ *
+ * A read back waveform is reduced to the minimum and maximum of the samples
+ * falling into each column of the plot while it is received, so peaks are
+ * kept whatever the length. The columns are drawn as SVG directly, or sent
+ * to gnuplot as binary data.
+ *
+ * This program is free software; you can redistribute  it and/or modify it
+ * under  the terms of  the GNU General  Public License as published by the
+ * Free Software Foundation;  either version 2 of the  License, or (at your
+ * option) any later version.
+ */
+
+#ifndef WFPLOT_H
+#define WFPLOT_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define WF_PLOT_WIDTH	640	// Columns, the width of the gnuplot png terminal
+#define WF_PLOT_HEIGHT	480
+
+typedef struct {
+	size_t total;		/* Samples of the waveform */
+	size_t width;		/* Columns, at most total */
+	size_t sample;		/* Samples added so far */
+	size_t column;		/* Of the next sample */
+	size_t edge;		/* First sample of the next column */
+	uint16_t *min, *max;	/* min > max for columns without samples */
+} wf_plot_t;
+
+/* Set up a plot of total samples in at most width columns. Returns -1 if
+ * out of memory. */
+int wf_plot_init(wf_plot_t *plot, size_t total, size_t width);
+
+/* Add the next n samples, in host order */
+void wf_plot_add(wf_plot_t *plot, const uint16_t *samples, size_t n);
+
+/* Write the plot as an SVG image */
+int wf_plot_svg(const wf_plot_t *plot, FILE *fp, const char *title);
+
+/* Send the plot commands and data to gnuplot, which writes a PNG image to
+ * output */
+int wf_plot_gnuplot(const wf_plot_t *plot, FILE *gnuplot, const char *title,
+		const char *output);
+
+void wf_plot_free(wf_plot_t *plot);
+
+#endif